@@ -1,20 +1,31 @@
 #include "core_allvars.h"
 
 
-/*  galaxy data  */
-struct GALAXY			
-  *Gal, *HaloGal;
+/*  misc  */
 
-struct halo_data *Halo;
+char OutputFields[MAX_STRING_LEN];
+const struct output_field *OutputField[MAXOUTPUTFIELDS];
+int NOutputFields;
 
-/*  auxiliary halo data  */
-struct halo_aux_data		
-  *HaloAux;
+int CatalogOutput;
+int GalaxyStats;
+int HistoryOutput;
+int SharedOutput;
+int CheckpointEveryTrees;
 
+int CoolingTable;
+char CoolingCacheFile[MAX_STRING_LEN];
 
-/*  misc  */
+int FoFParallelMinHalos;
+int StreamTreesMinHalos;
+int TreeOrder;
+int TreeOrderWindow;
+
+char SweepFile[MAX_STRING_LEN];
 
 int HDF5Output;
+int HDF5ChunkSize;
+int HDF5Compression;
 #ifdef HDF5
 char          *core_output_file;
 size_t         HDF5_dst_size;
@@ -27,12 +38,7 @@ int            HDF5_n_props;
 
 int FirstFile;
 int LastFile;
-int MaxGals;
-int FoF_MaxGals;
 int Ntrees;			   /*  number of trees in current file  */
-int NumGals;			 /*  Total number of galaxies stored for current tree  */
-
-int GalaxyCounter; /*  unique galaxy ID for main progenitor line in tree */
 
 char OutputDir[MAX_STRING_LEN];
 char FileNameGalaxies[MAX_STRING_LEN];
@@ -40,6 +46,7 @@ char TreeName[MAX_STRING_LEN];
 char TreeExtension[MAX_STRING_LEN] = {"\0"}; /* If the FileType is HDF5 they will have .hdf5 extension, otherwise nothing. */
 char SimulationDir[MAX_STRING_LEN];
 char FileWithSnapList[MAX_STRING_LEN];
+double OutputBufferSize;
 
 int TotHalos;
 int TotGalaxies[ABSOLUTEMAXSNAPS];
@@ -110,12 +117,12 @@ int ListOutputSnaps[ABSOLUTEMAXSNAPS];
 double ZZ[ABSOLUTEMAXSNAPS];
 double AA[ABSOLUTEMAXSNAPS];
 double *Age;
+double HubbleOfZ[ABSOLUTEMAXSNAPS];
+double RhoCritOfZ[ABSOLUTEMAXSNAPS];
 
 int MAXSNAPS;
 int NOUT;
 int Snaplistlen;
 
-gsl_rng *random_generator;
-
-int TreeID;
-int FileNum;
+enum Valid_TreeTypes TreeType;
+enum Valid_OutputFormats OutputFormat;
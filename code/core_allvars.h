@@ -2,7 +2,7 @@
 #define ALLVARS_H
 
 #include <stdio.h>
-#include <gsl/gsl_rng.h>
+#include <stdint.h>
 #include "core_simulation.h"
 
 #ifdef HDF5
@@ -18,7 +18,9 @@ do {                                                                \
   myexit(sigterm);                                                \
 } while(0)
 
-#define  STEPS 10         /* Number of integration intervals between two snapshots */
+#ifndef STEPS
+#define  STEPS 10         /* Number of integration intervals between two snapshots (STEPS in the Makefile) */
+#endif
 #define  MAXGALFAC 1
 #define  ALLOCPARAMETER 10.0
 #define  MAX_NODE_NAME_LEN 50
@@ -121,7 +123,7 @@ struct GALAXY
   int   GalaxyNr;
   int   CentralGal;
   int   HaloNr;
-  long long MostBoundID;
+  int   BirthHalo;   /* the halo it was created in, at most one galaxy per halo; keys its random numbers */
 
   int   mergeType;  /* 0=none; 1=minor merger; 2=major merger; 3=disk instability; 4=disrupt to ICS */
   int   mergeIntoID;
@@ -156,14 +158,6 @@ struct GALAXY
   float MetalsEjectedMass;
   float MetalsICS;
 
-  /* to calculate magnitudes */
-  float SfrDisk[STEPS];
-  float SfrBulge[STEPS];
-  float SfrDiskColdGas[STEPS];
-  float SfrDiskColdGasMetals[STEPS];
-  float SfrBulgeColdGas[STEPS];
-  float SfrBulgeColdGasMetals[STEPS];
-
   /* misc */
   float DiskScaleRadius;
   float MergTime;
@@ -180,8 +174,42 @@ struct GALAXY
   float infallMvir;
   float infallVvir;
   float infallVmax;
-}
-*Gal, *HaloGal;
+};
+
+
+/* The cold side of a galaxy, kept apart from struct GALAXY so that the recipes loop over
+   compact records. Gal[] and HaloGal[] each have one of these per galaxy, at the same index. */
+struct GALAXY_HISTORY
+{
+  long long MostBoundID;
+
+  /* star formation in the substeps of the current snapshot, to calculate magnitudes */
+  float SfrDisk[STEPS];
+  float SfrBulge[STEPS];
+  float SfrDiskColdGas[STEPS];
+  float SfrDiskColdGasMetals[STEPS];
+  float SfrBulgeColdGas[STEPS];
+  float SfrBulgeColdGasMetals[STEPS];
+};
+
+
+/* description of one member of struct GALAXY_OUTPUT, see core_output_fields.c */
+enum output_field_type
+{
+  output_int32 = 0,
+  output_int64,
+  output_float32
+};
+
+struct output_field
+{
+  const char *name;
+  size_t offset;                /* within struct GALAXY_OUTPUT */
+  size_t size;                  /* bytes per galaxy, 12 for the 3-vectors */
+  enum output_field_type type;  /* of a single element */
+};
+
+#define MAXOUTPUTFIELDS 64
 
 
 /* auxiliary halo data */
@@ -191,18 +219,55 @@ struct halo_aux_data
   int HaloFlag;
   int NGalaxies;
   int FirstGalaxy;
-}
-*HaloAux;
+};
+
+
+/* region the arrays of a tree are allocated from, see core_mymalloc.c */
+struct arena
+{
+  struct arena_chunk *chunks;   /* newest first */
+  size_t capacity;              /* bytes in all chunks */
+  void   *last;                 /* most recent allocation, the one that can grow in place */
+};
+
+/* totals over a FoF group, see sum_fof_baryons */
+struct fof_baryons
+{
+  double StellarMass, BlackHoleMass, ColdGas, HotGas, MetalsHotGas;
+  double EjectedMass, MetalsEjectedMass, ICS, MetalsICS;
+  double SatelliteBaryons;   /* StellarMass + BlackHoleMass + ColdGas + HotGas of all but the central */
+};
+
+/* everything that belongs to the tree currently being processed; each worker thread owns one */
+struct tree_context
+{
+  struct halo_data     *Halo;
+  int    HaloMapped;     /* Halo points into a memory-mapped tree file and must not be freed */
+  int    PrefetchSlot;   /* prefetch queue slot that Halo is borrowed from, -1 if none */
+  struct halo_aux_data *HaloAux;
+  struct GALAXY        *Gal, *HaloGal;
+  struct GALAXY_HISTORY *GalHistory, *HaloGalHistory;  /* their cold sides */
+  int    *GalaxySlot;    /* latest HaloGal slot of every GalaxyNr, -1 before the galaxy is stored */
+  int    MaxGalaxyNr;    /* entries of GalaxySlot */
+  int    GalBase;        /* slot held in HaloGal[0]; the slots before it are written out (streamed trees) */
+  int    *MergeRank;     /* scratch for the mergeIntoID offsets in evolve_galaxies, FoF_MaxGals + 3 */
+  int    *FoFOrder;      /* first halo of every FoF group, in the order they are evolved */
+  int    NumFoFGroups;
+
+  int    TreeID;         /* number of the tree within the current file */
+  int    FileNum;
+  int    NumGals;        /* Total number of galaxies stored for current tree */
+  int    MaxGals;        /* Maximum number of galaxies HaloGal can hold, from slot GalBase on */
+  int    FoF_MaxGals;
+  int    GalaxyCounter;  /* unique galaxy ID for main progenitor line in tree */
+
+  struct arena Arena;    /* Halo (unless borrowed or mapped), HaloAux, HaloGal, Gal and the indices live here */
+};
 
 extern int    FirstFile;    /* first and last file for processing */
 extern int    LastFile;
 
 extern int    Ntrees;      /* number of trees in current file  */
-extern int    NumGals;     /* Total number of galaxies stored for current tree */
-extern int    MaxGals;     /* Maximum number of galaxies allowed for current tree */  
-extern int    FoF_MaxGals;
-
-extern int    GalaxyCounter;     /* unique galaxy ID for main progenitor line in tree */
 
 extern int    LastSnapShotNr;
 
@@ -212,6 +277,7 @@ extern char   TreeName[MAX_STRING_LEN];
 extern char   TreeExtension[MAX_STRING_LEN]; // If the trees are in HDF5, they will have a .hdf5 extension. Otherwise they have no extension.
 extern char   SimulationDir[MAX_STRING_LEN];
 extern char   FileWithSnapList[MAX_STRING_LEN];
+extern double OutputBufferSize;  /* MB of galaxy records held per output snapshot before writing */
 
 extern int    TotHalos;
 extern int    TotGalaxies[ABSOLUTEMAXSNAPS];
@@ -241,6 +307,22 @@ extern int    DiskInstabilityOn;
 extern int    AGNrecipeOn;
 extern int    SFprescription;
 
+/* The recipe switches as the recipes test them: the parameters above, or constants when the
+   recipes are compiled in (RECIPES in the Makefile) so that the branches not taken disappear */
+#ifdef FIXED_RECIPES
+#define  SF_PRESCRIPTION   FIXED_SF
+#define  AGN_RECIPE        FIXED_AGN
+#define  SUPERNOVA_RECIPE  FIXED_SN
+#define  REIONIZATION      FIXED_REIONIZATION
+#define  DISK_INSTABILITY  FIXED_DISK_INSTABILITY
+#else
+#define  SF_PRESCRIPTION   SFprescription
+#define  AGN_RECIPE        AGNrecipeOn
+#define  SUPERNOVA_RECIPE  SupernovaRecipeOn
+#define  REIONIZATION      ReionizationOn
+#define  DISK_INSTABILITY  DiskInstabilityOn
+#endif
+
 /* recipe parameters */
 extern int    NParam;
 extern char   ParamTag[MAXTAGS][50];
@@ -282,15 +364,36 @@ extern int    ListOutputSnaps[ABSOLUTEMAXSNAPS];
 extern double ZZ[ABSOLUTEMAXSNAPS];
 extern double AA[ABSOLUTEMAXSNAPS];
 extern double *Age;
+extern double HubbleOfZ[ABSOLUTEMAXSNAPS];   /* H(z) of every snapshot, internal units */
+extern double RhoCritOfZ[ABSOLUTEMAXSNAPS];  /* critical density of every snapshot */
 
 extern int    MAXSNAPS;
 extern int    NOUT;
 extern int    Snaplistlen;
 
-extern gsl_rng *random_generator;
+extern char   OutputFields[MAX_STRING_LEN];  /* "all" or a comma separated list of output properties */
+extern const struct output_field *OutputField[MAXOUTPUTFIELDS];  /* the selected ones */
+extern int    NOutputFields;
+
+extern int    CatalogOutput;    /* write the galaxy files; 0 leaves only the statistics */
+extern int    GalaxyStats;      /* collect binned statistics of the output snapshots while the run goes, see core_stats.c */
+extern int    HistoryOutput;    /* also write every galaxy of every snapshot, with an index, see core_save_history.c */
+extern int    SharedOutput;     /* one galaxy file per output snapshot for all tree files and tasks */
+extern int    CheckpointEveryTrees;  /* binary outputs: write a restart point after every that many trees, 0 only on SIGXCPU */
+
+extern int    CoolingTable;     /* look the cooling rates up in the precomputed fine table */
+extern char   CoolingCacheFile[MAX_STRING_LEN];  /* binary copy of the cooling functions, "none" for no cache */
+
+extern int    StreamTreesMinHalos;  /* trees of at least this many halos are evolved snapshot by snapshot and written as they go, 0 never */
+extern int    FoFParallelMinHalos;  /* with OpenMP, trees of at least this many halos evolve their FoF groups in parallel, 0 never */
+extern int    TreeOrder;        /* 0 trees in file order, 1 the most expensive first, 2 only write the schedules; see core_tree_order.c */
+extern int    TreeOrderWindow;  /* with TreeOrder 1, a tree starts no more than this many trees ahead of the galaxies written, 0 no limit */
+
+extern char   SweepFile[MAX_STRING_LEN];  /* parameter sets to evaluate on the same trees, "none" for a normal run, see core_sweep.c */
 
-extern int TreeID;
-extern int FileNum;
+extern int    HDF5Output;       /* write the galaxies as HDF5 tables instead of the binary files */
+extern int    HDF5ChunkSize;    /* galaxies per chunk of the HDF5 tables */
+extern int    HDF5Compression;  /* deflate the HDF5 tables */
 
 #ifdef HDF5
 extern char          *core_output_file;
@@ -311,9 +414,36 @@ enum Valid_TreeTypes
 {
   genesis_lhalo_hdf5 = 0,
   lhalo_binary = 1,
+  lhalo_binary_mmap = 2,
   num_tree_types
 };
-enum Valid_TreeTypes TreeType;
+extern enum Valid_TreeTypes TreeType;
+
+enum Valid_OutputFormats
+{
+  sage_binary = 0,   /* one struct GALAXY_OUTPUT record per galaxy */
+  sage_columns = 1,  /* blocks of galaxies stored property by property */
+  num_output_formats
+};
+extern enum Valid_OutputFormats OutputFormat;
+
+/* phases measured by the built-in timing (USE-TIMING), see core_timing.c */
+enum timing_phase
+{
+  timing_load_tree = 0,
+  timing_construct_galaxies,
+  timing_join_progenitors,
+  timing_evolve_galaxies,
+  timing_infall,
+  timing_reincorporation,
+  timing_cooling,
+  timing_starformation,
+  timing_mergers,
+  timing_disruption,
+  timing_attach_galaxies,
+  timing_save_galaxies,
+  num_timing_phases
+};
 
 
 #endif  /* #ifndef ALLVARS_H */
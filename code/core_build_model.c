@@ -13,70 +13,181 @@
 
 
 
-void construct_galaxies(int halonr, int tree)
+// one pending call of the recursive traversal: the progenitors of halonr are visited
+// first (phase 0), then those of every halo of its FoF group (phase 1, fofhalo is the
+// member being looked at), and finally the group itself is put in the order (phase 2)
+struct traversal_frame
 {
-  static int halosdone = 0;
-  int prog, fofhalo, ngal;
+  int halonr, phase, fofhalo, prog;
+};
 
-  HaloAux[halonr].DoneFlag = 1;
-  halosdone++;
 
-  prog = Halo[halonr].FirstProgenitor;
-  while(prog >= 0)
-  {
-    if(HaloAux[prog].DoneFlag == 0)
-      construct_galaxies(prog, tree);
-    prog = Halo[prog].NextProgenitor;
-  }
 
-  fofhalo = Halo[halonr].FirstHaloInFOFgroup;
-  if(HaloAux[fofhalo].HaloFlag == 0)
+static struct traversal_frame *push_halo(struct traversal_frame *top, int halonr, struct tree_context *ctx)
+{
+  ctx->HaloAux[halonr].DoneFlag = 1;
+  top++;
+  top->halonr = halonr;
+  top->phase = 0;
+  top->fofhalo = -1;
+  top->prog = ctx->Halo[halonr].FirstProgenitor;
+  return top;
+}
+
+
+
+// Fills ctx->FoFOrder with the first halo of every FoF group of the tree, in the order
+// the groups have to be evolved: a group comes after the groups of all progenitors of
+// its halos. Walks the tree from halo 0 upwards with an explicit stack, in exactly the
+// order that construct_galaxies used to recurse in, so the galaxies come out the same.
+void build_fof_order(int nhalos, struct tree_context *ctx)
+{
+  struct halo_data *Halo = ctx->Halo;
+  struct halo_aux_data *HaloAux = ctx->HaloAux;
+  struct traversal_frame *stack, *top;
+  int halonr, prog, fofhalo;
+
+  // no halo is on the stack twice, so the tree is the deepest it can get
+  stack = arena_alloc(&ctx->Arena, sizeof(struct traversal_frame) * (nhalos + 1));
+  ctx->FoFOrder = arena_alloc(&ctx->Arena, sizeof(int) * nhalos);
+  ctx->NumFoFGroups = 0;
+
+  for(halonr = 0; halonr < nhalos; halonr++)
   {
-    HaloAux[fofhalo].HaloFlag = 1;
-    while(fofhalo >= 0)
+    if(HaloAux[halonr].DoneFlag)
+      continue;
+
+    top = push_halo(stack, halonr, ctx);
+    while(top > stack)
     {
-      prog = Halo[fofhalo].FirstProgenitor;
-      while(prog >= 0)
+      if(top->phase == 0)
       {
-        if(HaloAux[prog].DoneFlag == 0)
-          construct_galaxies(prog, tree);
-        prog = Halo[prog].NextProgenitor;
+        // progenitors of the halo itself
+        while((prog = top->prog) >= 0 && HaloAux[prog].DoneFlag)
+          top->prog = Halo[prog].NextProgenitor;
+        if(prog >= 0)
+        {
+          top->prog = Halo[prog].NextProgenitor;
+          top = push_halo(top, prog, ctx);
+          continue;
+        }
+
+        fofhalo = Halo[top->halonr].FirstHaloInFOFgroup;
+        top->phase = 2;
+        if(HaloAux[fofhalo].HaloFlag == 0)
+        {
+          HaloAux[fofhalo].HaloFlag = 1;
+          top->phase = 1;
+          top->fofhalo = fofhalo;
+          top->prog = Halo[fofhalo].FirstProgenitor;
+        }
+      }
+
+      if(top->phase == 1)
+      {
+        // progenitors of the other halos in the FoF group
+        while(top->fofhalo >= 0)
+        {
+          while((prog = top->prog) >= 0 && HaloAux[prog].DoneFlag)
+            top->prog = Halo[prog].NextProgenitor;
+          if(prog >= 0)
+            break;
+
+          top->fofhalo = Halo[top->fofhalo].NextHaloInFOFgroup;
+          if(top->fofhalo >= 0)
+            top->prog = Halo[top->fofhalo].FirstProgenitor;
+        }
+        if(top->fofhalo >= 0)
+        {
+          top->prog = Halo[prog].NextProgenitor;
+          top = push_halo(top, prog, ctx);
+          continue;
+        }
+        top->phase = 2;
       }
 
-      fofhalo = Halo[fofhalo].NextHaloInFOFgroup;
+      // At this point, the galaxies for all progenitors of this halo have been
+      // properly constructed. Also, the galaxies of the progenitors of all other
+      // halos in the same FOF group have been constructed as well. We can hence go
+      // ahead and construct all galaxies for the subhalos in this FOF halo.
+      fofhalo = Halo[top->halonr].FirstHaloInFOFgroup;
+      if(HaloAux[fofhalo].HaloFlag == 1)
+      {
+        HaloAux[fofhalo].HaloFlag = 2;
+        ctx->FoFOrder[ctx->NumFoFGroups++] = fofhalo;
+      }
+      top--;
     }
   }
+}
 
-  // At this point, the galaxies for all progenitors of this halo have been
-  // properly constructed. Also, the galaxies of the progenitors of all other 
-  // halos in the same FOF group have been constructed as well. We can hence go
-  // ahead and construct all galaxies for the subhalos in this FOF halo, and
-  // evolve them in time. 
 
-  fofhalo = Halo[halonr].FirstHaloInFOFgroup;
-  if(HaloAux[fofhalo].HaloFlag == 1)
-  {
-    ngal = 0;
-    HaloAux[fofhalo].HaloFlag = 2;
 
-    while(fofhalo >= 0)
-    {
-      ngal = join_galaxies_of_progenitors(fofhalo, ngal);
-      fofhalo = Halo[fofhalo].NextHaloInFOFgroup;
-    }
+// Constructs the galaxies of the FoF group starting at fofhalo from those of the
+// progenitors, and evolves them in time. The groups of all progenitors must be done,
+// see build_fof_order.
+void construct_galaxies(int fofhalo, struct tree_context *ctx)
+{
+  int halonr, ngal;
+  struct halo_data *Halo = ctx->Halo;
 
-    evolve_galaxies(Halo[halonr].FirstHaloInFOFgroup, ngal, tree);
-  }
+  ngal = 0;
+
+  TIMING_START(timing_join_progenitors);
+  for(halonr = fofhalo; halonr >= 0; halonr = Halo[halonr].NextHaloInFOFgroup)
+    ngal = join_galaxies_of_progenitors(halonr, ngal, ctx);
+  TIMING_STOP(timing_join_progenitors);
+
+  TIMING_START(timing_evolve_galaxies);
+  evolve_galaxies(fofhalo, ngal, ctx);
+  TIMING_STOP(timing_evolve_galaxies);
+
+  TIMING_START(timing_attach_galaxies);
+  attach_galaxies(ngal, ctx->Gal, ctx->GalHistory, ctx);
+  TIMING_STOP(timing_attach_galaxies);
+}
 
+
+
+// makes Gal, GalHistory and MergeRank hold maxgals galaxies of a FoF group
+void grow_fof_galaxies(int maxgals, struct tree_context *ctx)
+{
+  ctx->FoF_MaxGals = maxgals;
+  ctx->Gal = arena_realloc(&ctx->Arena, ctx->Gal, ctx->FoF_MaxGals * sizeof(struct GALAXY));
+  ctx->MergeRank = arena_realloc(&ctx->Arena, ctx->MergeRank, (ctx->FoF_MaxGals + 3) * sizeof(int));
+  ctx->GalHistory = arena_realloc(&ctx->Arena, ctx->GalHistory, ctx->FoF_MaxGals * sizeof(struct GALAXY_HISTORY));
+}
+
+
+
+// makes HaloGal and HaloGalHistory hold maxgals galaxies of the tree
+static void grow_halo_galaxies(int maxgals, struct tree_context *ctx)
+{
+  ctx->MaxGals = maxgals;
+  ctx->HaloGal = arena_realloc(&ctx->Arena, ctx->HaloGal, ctx->MaxGals * sizeof(struct GALAXY));
+  ctx->HaloGalHistory = arena_realloc(&ctx->Arena, ctx->HaloGalHistory, ctx->MaxGals * sizeof(struct GALAXY_HISTORY));
+}
+
+
+
+// makes GalaxySlot hold maxnr galaxy numbers
+static void grow_galaxy_slots(int maxnr, struct tree_context *ctx)
+{
+  ctx->MaxGalaxyNr = maxnr;
+  ctx->GalaxySlot = arena_realloc(&ctx->Arena, ctx->GalaxySlot, ctx->MaxGalaxyNr * sizeof(int));
 }
 
 
 
-int join_galaxies_of_progenitors(int halonr, int ngalstart)
+int join_galaxies_of_progenitors(int halonr, int ngalstart, struct tree_context *ctx)
 {
-  int ngal, prog, mother_halo=-1, i, j, first_occupied, lenmax, lenoccmax, centralgal;
+  int ngal, prog, mother_halo=-1, i, j, first_occupied, lenmax, lenoccmax, centralgal, src, newhistory;
   double previousMvir, previousVvir, previousVmax;
   int step;
+  struct halo_data *Halo = ctx->Halo;
+  struct halo_aux_data *HaloAux = ctx->HaloAux;
+  struct GALAXY *Gal = ctx->Gal, *HaloGal = ctx->HaloGal;
+  struct GALAXY_HISTORY *History = ctx->GalHistory;
 
   lenmax = 0;
   lenoccmax = 0;
@@ -112,11 +223,12 @@ int join_galaxies_of_progenitors(int halonr, int ngalstart)
   {
     for(i = 0; i < HaloAux[prog].NGalaxies; i++)
     {
-        if(ngal == (FoF_MaxGals-1)) {
-            FoF_MaxGals += 10000;
-            Gal = myrealloc(Gal, FoF_MaxGals * sizeof(struct GALAXY));
+        if(ngal == (ctx->FoF_MaxGals-1)) {
+            grow_fof_galaxies(2 * ctx->FoF_MaxGals, ctx);
+            Gal = ctx->Gal;
+            History = ctx->GalHistory;
         }
-        assert(ngal < FoF_MaxGals);
+        assert(ngal < ctx->FoF_MaxGals);
             
 
       // This is the cruical line in which the properties of the progenitor galaxies 
@@ -124,8 +236,11 @@ int join_galaxies_of_progenitors(int halonr, int ngalstart)
       // After updating their properties and evolving them 
       // they are copied to the end of the list of permanent galaxies HaloGal[xxx] 
 
-      Gal[ngal] = HaloGal[HaloAux[prog].FirstGalaxy + i];
+      // the cold side is only copied when the galaxy keeps its star formation history, see below
+      src = HaloAux[prog].FirstGalaxy + i - ctx->GalBase;
+      Gal[ngal] = HaloGal[src];
       Gal[ngal].HaloNr = halonr;
+      newhistory = 0;
 
       Gal[ngal].dT = -1.0;
 
@@ -147,7 +262,7 @@ int join_galaxies_of_progenitors(int halonr, int ngalstart)
         if(prog == first_occupied)
         {
           // update properties of this galaxy with physical properties of halo 
-          Gal[ngal].MostBoundID = Halo[halonr].MostBoundID;
+          History[ngal].MostBoundID = Halo[halonr].MostBoundID;
 
           for(j = 0; j < 3; j++)
           {
@@ -158,14 +273,14 @@ int join_galaxies_of_progenitors(int halonr, int ngalstart)
           Gal[ngal].Len = Halo[halonr].Len;
           Gal[ngal].Vmax = Halo[halonr].Vmax;
 
-					Gal[ngal].deltaMvir = get_virial_mass(halonr) - Gal[ngal].Mvir;
+					Gal[ngal].deltaMvir = get_virial_mass(halonr, Halo) - Gal[ngal].Mvir;
 
-          if(get_virial_mass(halonr) > Gal[ngal].Mvir)
+          if(get_virial_mass(halonr, Halo) > Gal[ngal].Mvir)
           {
-            Gal[ngal].Rvir = get_virial_radius(halonr);  // use the maximum Rvir in model
-            Gal[ngal].Vvir = get_virial_velocity(halonr);  // use the maximum Vvir in model
+            Gal[ngal].Rvir = get_virial_radius(halonr, Halo);  // use the maximum Rvir in model
+            Gal[ngal].Vvir = get_virial_velocity(halonr, Halo);  // use the maximum Vvir in model
           }
-          Gal[ngal].Mvir = get_virial_mass(halonr);
+          Gal[ngal].Mvir = get_virial_mass(halonr, Halo);
 
           Gal[ngal].Cooling = 0.0;
           Gal[ngal].Heating = 0.0;
@@ -174,10 +289,11 @@ int join_galaxies_of_progenitors(int halonr, int ngalstart)
 
           for(step = 0; step < STEPS; step++)
           {
-            Gal[ngal].SfrDisk[step] = Gal[ngal].SfrBulge[step] = 0.0;
-            Gal[ngal].SfrDiskColdGas[step] = Gal[ngal].SfrDiskColdGasMetals[step] = 0.0;
-            Gal[ngal].SfrBulgeColdGas[step] = Gal[ngal].SfrBulgeColdGasMetals[step] = 0.0;
+            History[ngal].SfrDisk[step] = History[ngal].SfrBulge[step] = 0.0;
+            History[ngal].SfrDiskColdGas[step] = History[ngal].SfrDiskColdGasMetals[step] = 0.0;
+            History[ngal].SfrBulgeColdGas[step] = History[ngal].SfrBulgeColdGasMetals[step] = 0.0;
           }
+          newhistory = 1;
 
           if(halonr == Halo[halonr].FirstHaloInFOFgroup)
           {
@@ -186,7 +302,7 @@ int join_galaxies_of_progenitors(int halonr, int ngalstart)
             Gal[ngal].mergeIntoID = -1;
             Gal[ngal].MergTime = 999.9;            
 
-            Gal[ngal].DiskScaleRadius = get_disk_radius(halonr, ngal);
+            Gal[ngal].DiskScaleRadius = get_disk_radius(halonr, ngal, Gal, Halo);
 
             Gal[ngal].Type = 0;
           }
@@ -205,7 +321,7 @@ int join_galaxies_of_progenitors(int halonr, int ngalstart)
 
             if(Gal[ngal].Type == 0 || Gal[ngal].MergTime > 999.0)
               // here the galaxy has gone from type 1 to type 2 or otherwise doesn't have a merging time.
-              Gal[ngal].MergTime = estimate_merging_time(halonr, Halo[halonr].FirstHaloInFOFgroup, ngal);
+              Gal[ngal].MergTime = estimate_merging_time(halonr, Halo[halonr].FirstHaloInFOFgroup, ngal, Gal, Halo);
             
             Gal[ngal].Type = 1;
           }
@@ -230,6 +346,9 @@ int join_galaxies_of_progenitors(int halonr, int ngalstart)
         }
       }
 
+      if(!newhistory)
+        History[ngal] = ctx->HaloGalHistory[src];
+
       ngal++;
 
     }
@@ -240,7 +359,7 @@ int join_galaxies_of_progenitors(int halonr, int ngalstart)
   if(ngal == 0)
   {
     // We have no progenitors with galaxies. This means we create a new galaxy. 
-    init_galaxy(ngal, halonr);
+    init_galaxy(ngal, halonr, ctx);
     ngal++;
   }
 
@@ -267,15 +386,61 @@ int join_galaxies_of_progenitors(int halonr, int ngalstart)
 
 
 
-void evolve_galaxies(int halonr, int ngal, int tree)	// Note: halonr is here the FOF-background subhalo (i.e. main halo) 
+// A Fenwick tree over the mergeIntoID of the galaxies that merged in evolve_galaxies,
+// one bucket per galaxy of the FoF group.
+// merge_rank_below(rank, k) counts the galaxies added so far in buckets 0 ... k-1.
+static void merge_rank_add(int *rank, int nbuckets, int bucket)
+{
+  for(bucket++; bucket <= nbuckets; bucket += bucket & -bucket)
+    rank[bucket]++;
+}
+
+static int merge_rank_below(const int *rank, int k)
+{
+  int n = 0;
+
+  for(; k > 0; k -= k & -k)
+    n += rank[k];
+  return n;
+}
+
+
+
+// The HaloGal slot that Gal[p] was stored in at the previous snapshot, i.e. the last
+// slot before firstgalaxy holding its GalaxyNr, relative to GalBase.
+static int find_previous_slot(int p, struct GALAXY *Gal, int firstgalaxy, struct tree_context *ctx)
 {
-  int p, i, step, centralgal, merger_centralgal, currenthalo, offset;
+  struct GALAXY *HaloGal = ctx->HaloGal;
+  int i, nr = Gal[p].GalaxyNr;
+
+  firstgalaxy -= ctx->GalBase;
+  i = nr < ctx->MaxGalaxyNr ? ctx->GalaxySlot[nr] - ctx->GalBase : -1;
+  if(i >= 0 && i < firstgalaxy && HaloGal[i].GalaxyNr == nr)
+    return i;
+
+  // the galaxy has been stored again since (or never), look for it the slow way
+  for(i = firstgalaxy - 1; i >= 0; i--)
+    if(HaloGal[i].GalaxyNr == nr)
+      break;
+  return i;
+}
+
+
+
+void evolve_galaxies(int halonr, int ngal, struct tree_context *ctx)	// Note: halonr is here the FOF-background subhalo (i.e. main halo) 
+{
+  int p, step, centralgal, merger_centralgal;
   double infallingGas, coolingGas, deltaT, time, galaxyBaryons, currentMvir;
+  struct halo_data *Halo = ctx->Halo;
+  struct GALAXY *Gal = ctx->Gal;
+  struct GALAXY_HISTORY *History = ctx->GalHistory;
 
   centralgal = Gal[0].CentralGal;
 	assert(Gal[centralgal].Type == 0 && Gal[centralgal].HaloNr == halonr);
 
-  infallingGas = infall_recipe(centralgal, ngal, ZZ[Halo[halonr].SnapNum]);
+  TIMING_START(timing_infall);
+  infallingGas = infall_recipe(centralgal, ngal, ZZ[Halo[halonr].SnapNum], Gal);
+  TIMING_STOP(timing_infall);
 
   // We integrate things forward by using a number of intervals equal to STEPS 
   for(step = 0; step < STEPS; step++)
@@ -295,23 +460,27 @@ void evolve_galaxies(int halonr, int ngal, int tree)	// Note: halonr is here the
         Gal[p].dT = deltaT;
 
       // For the central galaxy only 
+      TIMING_START_SAMPLED(timing_reincorporation);
       if(p == centralgal)
       {
-        add_infall_to_hot(centralgal, infallingGas / STEPS);
+        add_infall_to_hot(centralgal, infallingGas / STEPS, Gal);
 
         if(ReIncorporationFactor > 0.0)
-          reincorporate_gas(centralgal, deltaT / STEPS);
+          reincorporate_gas(centralgal, deltaT / STEPS, Gal);
       }
 			else 
 				if(Gal[p].Type == 1 && Gal[p].HotGas > 0.0)
-					strip_from_satellite(halonr, centralgal, p);
+					strip_from_satellite(halonr, centralgal, p, Gal, Halo);
 
       // Determine the cooling gas given the halo properties 
-      coolingGas = cooling_recipe(p, deltaT / STEPS);
-      cool_gas_onto_galaxy(p, coolingGas);
+      TIMING_SWITCH_SAMPLED(timing_reincorporation, timing_cooling);
+      coolingGas = cooling_recipe(p, deltaT / STEPS, Gal);
+      cool_gas_onto_galaxy(p, coolingGas, Gal);
 
       // stars form and then explode! 
-      starformation_and_feedback(p, centralgal, time, deltaT / STEPS, halonr, step);
+      TIMING_SWITCH_SAMPLED(timing_cooling, timing_starformation);
+      starformation_and_feedback(p, centralgal, time, deltaT / STEPS, halonr, step, Gal, History);
+      TIMING_STOP_SAMPLED(timing_starformation);
     }
 
     // check for satellite disruption and merger events 
@@ -339,18 +508,22 @@ void evolve_galaxies(int halonr, int ngal, int tree)	// Note: halonr is here the
           if(Gal[merger_centralgal].mergeType > 0) 
             merger_centralgal = Gal[merger_centralgal].CentralGal;
 
-          Gal[p].mergeIntoID = NumGals + merger_centralgal;  // position in output 
+          Gal[p].mergeIntoID = merger_centralgal;  // position in Gal[], attach_galaxies makes it the position in output 
 
           if(Gal[p].MergTime > 0.0)  // disruption has occured!
           {
-            disrupt_satellite_to_ICS(merger_centralgal, p);
+            TIMING_START(timing_disruption);
+            disrupt_satellite_to_ICS(merger_centralgal, p, Gal);
+            TIMING_STOP(timing_disruption);
           }
           else
           {
             if(Gal[p].MergTime <= 0.0)  // a merger has occured! 
             {
               time = Age[Gal[p].SnapNum] - (step + 0.5) * (deltaT / STEPS);   
-              deal_with_galaxy_merger(p, merger_centralgal, centralgal, time, deltaT / STEPS, halonr, step);
+              TIMING_START(timing_mergers);
+              deal_with_galaxy_merger(p, merger_centralgal, centralgal, time, deltaT / STEPS, halonr, step, Gal, History);
+              TIMING_STOP(timing_mergers);
             }
           } 
         }
@@ -362,7 +535,7 @@ void evolve_galaxies(int halonr, int ngal, int tree)	// Note: halonr is here the
 
 
   // Extra miscellaneous stuff before finishing this halo
-	Gal[centralgal].TotalSatelliteBaryons = 0.0;
+	Gal[centralgal].TotalSatelliteBaryons = sum_satellite_baryons(Gal, ngal, centralgal);
   deltaT = Age[Gal[0].SnapNum] - Age[Halo[halonr].SnapNum];
 	
   for(p = 0; p < ngal; p++)
@@ -375,65 +548,159 @@ void evolve_galaxies(int halonr, int ngal, int tree)	// Note: halonr is here the
     Gal[p].Cooling /= deltaT;
     Gal[p].Heating /= deltaT;
     Gal[p].OutflowRate /= deltaT;    
-		
-    if(p != centralgal)
-			Gal[centralgal].TotalSatelliteBaryons += 
-				(Gal[p].StellarMass + Gal[p].BlackHoleMass + Gal[p].ColdGas + Gal[p].HotGas);
   }
 
 
+}
+
+
+
+// Appends the galaxies of an evolved FoF group to HaloGal and records the galaxies
+// that merged in their last stored slot. Gal[] and History[] need not be ctx->Gal and
+// ctx->GalHistory, see core_fof_parallel.c.
+void attach_galaxies(int ngal, struct GALAXY *Gal, struct GALAXY_HISTORY *History, struct tree_context *ctx)
+{
+  int p, i, currenthalo, offset, firstoutput, held;
+  struct halo_data *Halo = ctx->Halo;
+  struct halo_aux_data *HaloAux = ctx->HaloAux;
+  struct GALAXY *HaloGal;
+
+  if(ngal >= ctx->FoF_MaxGals)
+    grow_fof_galaxies(ngal + 1, ctx);   // for the MergeRank
+
+  // doubling keeps the copies down to about one per galaxy, however far off MAXGALFAC is
+  held = ctx->NumGals - ctx->GalBase;
+  if(held + ngal > ctx->MaxGals)
+    grow_halo_galaxies(held + ngal > 2 * ctx->MaxGals ? held + ngal : 2 * ctx->MaxGals, ctx);
+  if(ctx->GalaxyCounter + ngal > ctx->MaxGalaxyNr)
+    grow_galaxy_slots(ctx->GalaxyCounter + ngal > 2 * ctx->MaxGalaxyNr ? ctx->GalaxyCounter + ngal : 2 * ctx->MaxGalaxyNr, ctx);
+  HaloGal = ctx->HaloGal;
+
   // Attach final galaxy list to halo 
-  offset = 0;
+  firstoutput = ctx->NumGals;   // where Gal[0] will be in the output
+  for(i = 0; i <= ngal; i++)
+    ctx->MergeRank[i] = 0;
+
   for(p = 0, currenthalo = -1; p < ngal; p++)
   {
     if(Gal[p].HaloNr != currenthalo)
     {
       currenthalo = Gal[p].HaloNr;
-      HaloAux[currenthalo].FirstGalaxy = NumGals;
+      HaloAux[currenthalo].FirstGalaxy = ctx->NumGals;
       HaloAux[currenthalo].NGalaxies = 0;
     }
 
     // Merged galaxies won't be output. So go back through its history and find it
     // in the previous timestep. Then copy the current merger info there.
-    offset = 0;
-    i = p-1;
-    while(i >= 0)
-    {
-     if(Gal[i].mergeType > 0) 
-       if(Gal[p].mergeIntoID > Gal[i].mergeIntoID)
-         offset++;  // these galaxies won't be kept so offset mergeIntoID below
-     i--;
-    }
-    
-    i = -1;
     if(Gal[p].mergeType > 0)
     {
-      i = HaloAux[currenthalo].FirstGalaxy - 1;
-      while(i >= 0)
-      {
-        if(HaloGal[i].GalaxyNr == Gal[p].GalaxyNr)
-          break;
-        else
-          i--;
-      }
+      // the merged galaxies before this one with a smaller mergeIntoID won't be kept, so offset mergeIntoID below
+      offset = merge_rank_below(ctx->MergeRank, Gal[p].mergeIntoID);
+      merge_rank_add(ctx->MergeRank, ngal, Gal[p].mergeIntoID);
+
+      i = find_previous_slot(p, Gal, HaloAux[currenthalo].FirstGalaxy, ctx);
       
 			assert(i >= 0);
       
       HaloGal[i].mergeType = Gal[p].mergeType;
-      HaloGal[i].mergeIntoID = Gal[p].mergeIntoID - offset;
+      HaloGal[i].mergeIntoID = firstoutput + Gal[p].mergeIntoID - offset;
       HaloGal[i].mergeIntoSnapNum = Halo[currenthalo].SnapNum;
     }
     
     if(Gal[p].mergeType == 0)
     {
-			assert(NumGals < MaxGals);
+      // new galaxies are numbered in the order they are stored
+      if(Gal[p].GalaxyNr < 0)
+        Gal[p].GalaxyNr = ctx->GalaxyCounter++;
 
       Gal[p].SnapNum = Halo[currenthalo].SnapNum;
-      HaloGal[NumGals++] = Gal[p];
+      ctx->GalaxySlot[Gal[p].GalaxyNr] = ctx->NumGals;
+      ctx->HaloGalHistory[ctx->NumGals - ctx->GalBase] = History[p];
+      HaloGal[ctx->NumGals++ - ctx->GalBase] = Gal[p];
       HaloAux[currenthalo].NGalaxies++;
     }
   }
+}
+
+
+
+
+int is_streamed_tree(int treenr)
+{
+  return StreamTreesMinHalos > 0 && TreeNHalos[treenr] >= StreamTreesMinHalos;
+}
+
+
+
+// Writes out and drops the FoF groups at the start of HaloGal whose halos all have
+// their descendant at snapshot lastsnap or before, i.e. evolved already; the galaxies
+// of such a group will not change any more. Groups are only taken whole, since the
+// output of every galaxy looks at the central of its group.
+static void retire_galaxies(int filenr, int treenr, int lastsnap, const int *SnapFirstSlot, struct tree_context *ctx)
+{
+  struct halo_data *Halo = ctx->Halo;
+  int last, fofhalo, halonr, desc, held;
+
+  for(last = ctx->GalBase; last < ctx->NumGals; )
+  {
+    fofhalo = Halo[ctx->HaloGal[last - ctx->GalBase].HaloNr].FirstHaloInFOFgroup;
+    for(halonr = fofhalo; halonr >= 0; halonr = Halo[halonr].NextHaloInFOFgroup)
+      if((desc = Halo[halonr].Descendant) >= 0 && Halo[desc].SnapNum > lastsnap)
+        break;
+    if(halonr >= 0)
+      break;
+
+    // the galaxies of a group are stored one after the other
+    while(last < ctx->NumGals && Halo[ctx->HaloGal[last - ctx->GalBase].HaloNr].FirstHaloInFOFgroup == fofhalo)
+      last++;
+  }
 
+  if(last == ctx->GalBase)
+    return;
 
+  save_streamed_galaxies(filenr, treenr, last, SnapFirstSlot, ctx);
+
+  held = ctx->NumGals - last;
+  memmove(ctx->HaloGal, ctx->HaloGal + (last - ctx->GalBase), held * sizeof(struct GALAXY));
+  memmove(ctx->HaloGalHistory, ctx->HaloGalHistory + (last - ctx->GalBase), held * sizeof(struct GALAXY_HISTORY));
+  ctx->GalBase = last;
 }
 
+
+
+// Evolves a tree snapshot by snapshot instead of in the order of build_fof_order, and
+// writes its galaxies as soon as all their descendants are done, so HaloGal only holds
+// the galaxies of the last few snapshots. Within a snapshot the groups keep the order
+// of FoFOrder, so the galaxies of every snapshot are stored, and written, exactly as in
+// a normal run; only the GalaxyNr of new galaxies are handed out in another order.
+// The galaxies of all earlier trees of the file must be saved already.
+void stream_tree_galaxies(int filenr, int treenr, struct tree_context *ctx)
+{
+  struct halo_data *Halo = ctx->Halo;
+  int SnapFirstSlot[MAXSNAPS], first[MAXSNAPS + 1];
+  int *order, g, snap;
+
+  // the groups sorted by snapshot, keeping their order within a snapshot
+  order = arena_alloc(&ctx->Arena, sizeof(int) * (ctx->NumFoFGroups + 1));
+  for(snap = 0; snap <= MAXSNAPS; snap++)
+    first[snap] = 0;
+  for(g = 0; g < ctx->NumFoFGroups; g++)
+    first[Halo[ctx->FoFOrder[g]].SnapNum + 1]++;
+  for(snap = 1; snap <= MAXSNAPS; snap++)
+    first[snap] += first[snap - 1];
+  for(g = 0; g < ctx->NumFoFGroups; g++)
+    order[first[Halo[ctx->FoFOrder[g]].SnapNum]++] = ctx->FoFOrder[g];
+
+  for(g = 0; g < ctx->NumFoFGroups; )
+  {
+    snap = Halo[order[g]].SnapNum;
+    SnapFirstSlot[snap] = ctx->NumGals;
+    for(; g < ctx->NumFoFGroups && Halo[order[g]].SnapNum == snap; g++)
+      construct_galaxies(order[g], ctx);
+
+    retire_galaxies(filenr, treenr, snap, SnapFirstSlot, ctx);
+  }
+
+  // the rest has no descendants left to wait for
+  retire_galaxies(filenr, treenr, MAXSNAPS, SnapFirstSlot, ctx);
+}
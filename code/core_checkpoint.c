@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "core_allvars.h"
+#include "core_proto.h"
+
+// Restart points for the binary galaxy files (sage_binary and sage_columns).
+// A checkpoint of tree file filenr is <OutputDir>/<FileNameGalaxies>_checkpoint_<filenr>:
+//
+//   int      filenr, Ntrees, NOUT, OutputFormat, last tree saved
+//   int      ListOutputSnaps[NOUT]
+//   int      TotGalaxies[NOUT]
+//   int64_t  bytes of every galaxy file, with all galaxies up to the last tree written
+//   int      TreeNgals[n][0 ... last tree], for every output snapshot n
+//
+// It is written between two trees in the ordered section, so it describes the
+// output of trees 0 ... last tree exactly; a new run of the same parameter file
+// truncates the galaxy files to those sizes and carries on with the next tree.
+// A first checkpoint with last tree -1 is written before the galaxy files are even
+// created, so a file that has one but whose run died, however hard, is never taken
+// for finished: a new run starts it again from the first tree.
+// The checkpoint is replaced atomically and removed once the file is finished.
+
+#define CHECKPOINT_HEADER 5
+
+
+
+static void checkpoint_name(char *buf, int filenr)
+{
+  path_printf(buf, MAX_STRING_LEN, "%s/%s_checkpoint_%d", OutputDir, FileNameGalaxies, filenr);
+}
+
+
+
+// only the binary galaxy files of one tree file can be resumed
+int checkpoints_enabled(void)
+{
+  return !HDF5Output && !SharedOutput && !HistoryOutput && CatalogOutput;
+}
+
+
+
+int checkpoint_exists(int filenr)
+{
+  char buf[MAX_STRING_LEN];
+  struct stat filestatus;
+
+  if(!checkpoints_enabled())
+    return 0;
+
+  checkpoint_name(buf, filenr);
+  return stat(buf, &filestatus) == 0;
+}
+
+
+
+void write_checkpoint(int filenr, int lasttree)
+{
+  char buf[MAX_STRING_LEN], tmp[MAX_STRING_LEN + 4];
+  int header[CHECKPOINT_HEADER], n, ok;
+  int64_t offset[ABSOLUTEMAXSNAPS];
+  FILE *fd;
+
+  // before the first tree the galaxy files are not open yet, and the restart creates them anew
+  if(lasttree >= 0)
+    sync_galaxy_files(offset);
+  else
+    for(n = 0; n < NOUT; n++)
+      offset[n] = 0;
+
+  checkpoint_name(buf, filenr);
+  snprintf(tmp, sizeof(tmp), "%s.tmp", buf);
+  if(!(fd = fopen(tmp, "w")))
+  {
+    fprintf(stderr, "can't open checkpoint file `%s'\n", tmp);
+    ABORT(0);
+  }
+
+  header[0] = filenr;
+  header[1] = Ntrees;
+  header[2] = NOUT;
+  header[3] = OutputFormat;
+  header[4] = lasttree;
+
+  ok = fwrite(header, sizeof(int), CHECKPOINT_HEADER, fd) == CHECKPOINT_HEADER;
+  ok = ok && fwrite(ListOutputSnaps, sizeof(int), NOUT, fd) == (size_t) NOUT;
+  ok = ok && fwrite(TotGalaxies, sizeof(int), NOUT, fd) == (size_t) NOUT;
+  ok = ok && fwrite(offset, sizeof(int64_t), NOUT, fd) == (size_t) NOUT;
+  for(n = 0; n < NOUT; n++)
+    ok = ok && fwrite(TreeNgals[n], sizeof(int), lasttree + 1, fd) == (size_t) (lasttree + 1);
+  ok = (fclose(fd) == 0) && ok;
+
+  if(!ok || rename(tmp, buf) != 0)
+  {
+    fprintf(stderr, "Error: Could not write checkpoint file `%s'\n", buf);
+    ABORT(0);
+  }
+}
+
+
+
+// Restores the galaxy counts and the galaxy files of filenr from its checkpoint and
+// returns the first tree still to do. Needs the tree table of the file.
+int read_checkpoint(int filenr)
+{
+  char buf[MAX_STRING_LEN];
+  int header[CHECKPOINT_HEADER], snaps[ABSOLUTEMAXSNAPS], n, ok;
+  int64_t offset[ABSOLUTEMAXSNAPS];
+  FILE *fd;
+
+  checkpoint_name(buf, filenr);
+  if(!(fd = fopen(buf, "r")))
+  {
+    fprintf(stderr, "can't open checkpoint file `%s'\n", buf);
+    ABORT(0);
+  }
+
+  ok = fread(header, sizeof(int), CHECKPOINT_HEADER, fd) == CHECKPOINT_HEADER;
+  ok = ok && header[0] == filenr && header[1] == Ntrees && header[2] == NOUT && header[3] == (int) OutputFormat
+    && header[4] >= -1 && header[4] < Ntrees;
+  ok = ok && fread(snaps, sizeof(int), NOUT, fd) == (size_t) NOUT
+    && memcmp(snaps, ListOutputSnaps, sizeof(int) * NOUT) == 0;
+  if(!ok)
+  {
+    fprintf(stderr, "Error: checkpoint file `%s' does not belong to these trees and outputs.\n", buf);
+    fprintf(stderr, "Remove it together with the galaxy files of tree file %d to start the file again.\n", filenr);
+    ABORT(0);
+  }
+
+  ok = fread(TotGalaxies, sizeof(int), NOUT, fd) == (size_t) NOUT;
+  ok = ok && fread(offset, sizeof(int64_t), NOUT, fd) == (size_t) NOUT;
+  for(n = 0; n < NOUT; n++)
+    ok = ok && fread(TreeNgals[n], sizeof(int), header[4] + 1, fd) == (size_t) (header[4] + 1);
+  fclose(fd);
+
+  if(!ok)
+  {
+    fprintf(stderr, "Error: checkpoint file `%s' is incomplete\n", buf);
+    ABORT(0);
+  }
+
+  if(header[4] >= 0)
+    resume_galaxy_files(filenr, offset);
+
+  return header[4] + 1;
+}
+
+
+
+void remove_checkpoint(int filenr)
+{
+  char buf[MAX_STRING_LEN];
+
+  checkpoint_name(buf, filenr);
+  unlink(buf);
+}
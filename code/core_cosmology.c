@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "core_allvars.h"
+#include "core_proto.h"
+
+// Cosmology tables, built once by init_cosmology() before any tree is read and only
+// read afterwards, so all threads share them.
+//
+// The time since the big bang is tabulated together with its derivative on a grid
+// in u = sqrt(a), where dt/du = 2 u^2 / (H0 sqrt(Omega + Omega_k u^2 + Omega_L u^6))
+// is smooth right down to a = 0. The cells are integrated with Simpson's rule and
+// interpolated with cubic Hermite polynomials, both good to about 1e-12 with
+// COSMO_NGRID cells, far better than the snapshot list itself. Age[] is not bit-identical
+// to the qag integration it replaced (which stopped at epsabs = 1/Hubble), and through
+// the thresholds of the recipes the galaxy output shifts by up to a few 1e-3 relative.
+//
+// H(z) and rho_crit(z) only ever come in at the snapshots, so they are kept per
+// snapshot (HubbleOfZ[], RhoCritOfZ[]) from the same expressions as before.
+
+#define COSMO_NGRID 4096
+#define COSMO_UMAX  1.2          /* grid reaches a = 1.44, past the present */
+
+static double CosmicTime[COSMO_NGRID + 1];   /* t(u) in internal units */
+static double CosmicRate[COSMO_NGRID + 1];   /* dt/du */
+
+
+
+static double dtime_du(double u)
+{
+  double u2 = u * u;
+
+  return 2 * u2 / (Hubble * sqrt(Omega + (1 - Omega - OmegaLambda) * u2 + OmegaLambda * u2 * u2 * u2));
+}
+
+
+
+// time since the big bang at scale factor a
+double cosmic_time(double a)
+{
+  double u, x, h, t, t2, t3;
+  int i;
+
+  u = sqrt(a);
+  if(!(u >= 0.0 && u <= COSMO_UMAX))
+  {
+    printf("cosmic_time: scale factor %g is outside of the table (0 ... %g)\n", a, COSMO_UMAX * COSMO_UMAX);
+    ABORT(0);
+  }
+
+  h = COSMO_UMAX / COSMO_NGRID;
+  x = u / h;
+  i = (int) x;
+  if(i >= COSMO_NGRID)
+    i = COSMO_NGRID - 1;
+  t = x - i;
+  t2 = t * t;
+  t3 = t2 * t;
+
+  return (2 * t3 - 3 * t2 + 1) * CosmicTime[i] + (t3 - 2 * t2 + t) * h * CosmicRate[i]
+    + (-2 * t3 + 3 * t2) * CosmicTime[i + 1] + (t3 - t2) * h * CosmicRate[i + 1];
+}
+
+
+
+double time_to_present(double z)
+{
+  // return time to present as a function of redshift
+  return cosmic_time(1.0) - cosmic_time(1.0 / (1.0 + z));
+}
+
+
+
+// needs Hubble, Omega and OmegaLambda (set_units) and the snapshot list
+void init_cosmology(void)
+{
+  double h, u, zplus1, hubble_of_z_sq;
+  int i;
+
+  h = COSMO_UMAX / COSMO_NGRID;
+  CosmicTime[0] = 0.0;
+  CosmicRate[0] = dtime_du(0.0);
+  for(i = 0; i < COSMO_NGRID; i++)
+  {
+    u = i * h;
+    CosmicRate[i + 1] = dtime_du(u + h);
+    CosmicTime[i + 1] = CosmicTime[i] + h / 6.0 * (CosmicRate[i] + 4 * dtime_du(u + 0.5 * h) + CosmicRate[i + 1]);
+  }
+
+  for(i = 0; i < Snaplistlen; i++)
+  {
+    zplus1 = 1 + ZZ[i];
+    hubble_of_z_sq =
+      Hubble * Hubble *(Omega * zplus1 * zplus1 * zplus1 + (1 - Omega - OmegaLambda) * zplus1 * zplus1 +
+      OmegaLambda);
+
+    HubbleOfZ[i] = sqrt(hubble_of_z_sq);
+    RhoCritOfZ[i] = 3 * hubble_of_z_sq / (8 * M_PI * G);
+  }
+}
@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include <omp.h>
+
+#include "core_allvars.h"
+#include "core_proto.h"
+
+// Evolves the FoF groups of one big tree on several threads (USE-OPENMP and
+// FoFParallelMinHalos). A group can be joined and evolved as soon as the groups of
+// all progenitors of its halos are in HaloGal, since it reads nothing else that
+// other groups write. Every round, the threads of a nested team take the ready groups,
+// evolves each in a tree_context of its own and keeps the result; then the results
+// are attached in the order of ctx->FoFOrder for as far as they are complete. HaloGal,
+// GalaxyNr and mergeIntoID therefore come out exactly as in a serial run.
+//
+// The nested team only ever takes cores that would sit idle otherwise: the threads of
+// the outer team that have no tree of the file left. Each round claims those that are
+// idle at that moment and hands them back at its end, so a big tree picks up more
+// threads as the rest of the file runs out. While there are none, the lowest ready
+// group is evolved in place by construct_galaxies, as without the mode.
+
+#define GROUPS_PER_THREAD 4   /* most groups per thread and round */
+
+static int IdleThreads = 0;   /* outer threads of the current file without a tree left */
+
+struct fof_result
+{
+  int ngal;
+  struct GALAXY *Gal;              /* NULL until the group is evolved */
+  struct GALAXY_HISTORY *History;
+};
+
+
+
+// min-heap of the group numbers that can be evolved, the lowest is attached first
+static void heap_push(int *heap, int *n, int g)
+{
+  int i, t;
+
+  for(i = (*n)++, heap[i] = g; i > 0 && heap[(i - 1) / 2] > heap[i]; i = (i - 1) / 2)
+  {
+    t = heap[i];
+    heap[i] = heap[(i - 1) / 2];
+    heap[(i - 1) / 2] = t;
+  }
+}
+
+static int heap_pop(int *heap, int *n)
+{
+  int i, c, t, g = heap[0];
+
+  heap[0] = heap[--(*n)];
+  for(i = 0; (c = 2 * i + 1) < *n; i = c)
+  {
+    if(c + 1 < *n && heap[c + 1] < heap[c])
+      c++;
+    if(heap[i] <= heap[c])
+      break;
+    t = heap[i];
+    heap[i] = heap[c];
+    heap[c] = t;
+  }
+  return g;
+}
+
+
+
+// before the trees of a file are handed out, all threads are busy
+void reset_idle_threads(void)
+{
+  IdleThreads = 0;
+}
+
+
+
+// an outer thread that has no tree of the file left lends itself to the FoF groups
+void mark_thread_idle(void)
+{
+#pragma omp atomic
+  IdleThreads++;
+}
+
+
+
+// takes up to max of the idle threads for one round, returns how many
+static int claim_idle_threads(int max)
+{
+  int n;
+
+#pragma omp atomic read
+  n = IdleThreads;
+  if(n == 0 || max == 0)
+    return 0;
+
+#pragma omp critical (fof_idle_threads)
+  {
+    n = IdleThreads < max ? IdleThreads : max;
+    IdleThreads -= n;
+  }
+  return n;
+}
+
+
+
+static void release_idle_threads(int n)
+{
+#pragma omp atomic
+  IdleThreads += n;
+}
+
+
+
+// joins and evolves group g in the private context w, and copies the result out
+static void evolve_group(int g, struct tree_context *w, struct tree_context *ctx, struct fof_result *r)
+{
+  int halonr, ngal = 0, fofhalo = ctx->FoFOrder[g];
+
+  // the tree itself is shared, and only read until the results are attached
+  w->Halo = ctx->Halo;
+  w->HaloAux = ctx->HaloAux;
+  w->HaloGal = ctx->HaloGal;
+  w->HaloGalHistory = ctx->HaloGalHistory;
+  w->GalaxySlot = ctx->GalaxySlot;
+  w->MaxGalaxyNr = ctx->MaxGalaxyNr;
+  w->GalBase = ctx->GalBase;
+  w->MaxGals = ctx->MaxGals;
+  w->TreeID = ctx->TreeID;
+  w->FileNum = ctx->FileNum;
+
+  arena_reset(&w->Arena);
+  if(w->FoF_MaxGals < 10000)
+    w->FoF_MaxGals = 10000;
+  w->Gal = arena_alloc(&w->Arena, sizeof(struct GALAXY) * w->FoF_MaxGals);
+  w->GalHistory = arena_alloc(&w->Arena, sizeof(struct GALAXY_HISTORY) * w->FoF_MaxGals);
+  w->MergeRank = arena_alloc(&w->Arena, sizeof(int) * (w->FoF_MaxGals + 3));
+
+  TIMING_START(timing_join_progenitors);
+  for(halonr = fofhalo; halonr >= 0; halonr = ctx->Halo[halonr].NextHaloInFOFgroup)
+    ngal = join_galaxies_of_progenitors(halonr, ngal, w);
+  TIMING_STOP(timing_join_progenitors);
+
+  TIMING_START(timing_evolve_galaxies);
+  evolve_galaxies(fofhalo, ngal, w);
+  TIMING_STOP(timing_evolve_galaxies);
+
+  r->History = malloc(sizeof(struct GALAXY_HISTORY) * ngal);
+  r->Gal = malloc(sizeof(struct GALAXY) * ngal);
+  if(r->Gal == NULL || r->History == NULL)
+  {
+    fprintf(stderr, "Error: Could not allocate memory for the %d galaxies of FoF group %d\n", ngal, g);
+    ABORT(0);
+  }
+  memcpy(r->Gal, w->Gal, sizeof(struct GALAXY) * ngal);
+  memcpy(r->History, w->GalHistory, sizeof(struct GALAXY_HISTORY) * ngal);
+  r->ngal = ngal;
+}
+
+
+
+// does what the loop over construct_galaxies in main.c does, for the whole tree
+void construct_galaxies_parallel(struct tree_context *ctx)
+{
+  struct halo_data *Halo = ctx->Halo;
+  int ngroups = ctx->NumFoFGroups, nhalos = TreeNHalos[ctx->TreeID];
+  int *groupof, *maxdep, *first, *bydep, *heap, *batch;
+  int g, h, prog, d, nready, nbatch, b, committed, released, maxteam, nextra;
+  struct fof_result *result;
+  struct tree_context *worker;
+
+  // the most threads a round can have: this one and all others of the outer team
+  maxteam = omp_get_num_threads();
+  if(maxteam == 1)
+  {
+    for(g = 0; g < ngroups; g++)
+      construct_galaxies(ctx->FoFOrder[g], ctx);
+    return;
+  }
+
+  // which group every halo is in, and the last group that each group has to wait for
+  groupof = arena_alloc(&ctx->Arena, sizeof(int) * nhalos);
+  maxdep = arena_alloc(&ctx->Arena, sizeof(int) * ngroups);
+  for(g = 0; g < ngroups; g++)
+    for(h = ctx->FoFOrder[g]; h >= 0; h = Halo[h].NextHaloInFOFgroup)
+      groupof[h] = g;
+
+  for(g = 0; g < ngroups; g++)
+  {
+    maxdep[g] = -1;
+    for(h = ctx->FoFOrder[g]; h >= 0; h = Halo[h].NextHaloInFOFgroup)
+      for(prog = Halo[h].FirstProgenitor; prog >= 0; prog = Halo[prog].NextProgenitor)
+        if(groupof[prog] > maxdep[g])
+          maxdep[g] = groupof[prog];
+    assert(maxdep[g] < g);
+  }
+
+  // the groups sorted by maxdep + 1; those of bucket d are bydep[first[d] ... first[d + 1] - 1]
+  // and can be evolved once d groups are attached
+  first = arena_alloc(&ctx->Arena, sizeof(int) * (ngroups + 2));
+  bydep = arena_alloc(&ctx->Arena, sizeof(int) * ngroups);
+  for(d = 0; d <= ngroups + 1; d++)
+    first[d] = 0;
+  for(g = 0; g < ngroups; g++)
+    first[maxdep[g] + 2]++;
+  for(d = 1; d <= ngroups + 1; d++)
+    first[d] += first[d - 1];
+  for(g = 0; g < ngroups; g++)
+    bydep[first[maxdep[g] + 1]++] = g;   // moves every first[d] on to first[d + 1]
+  for(d = ngroups; d > 0; d--)
+    first[d] = first[d - 1];
+  first[0] = 0;
+
+  heap = arena_alloc(&ctx->Arena, sizeof(int) * ngroups);
+  batch = arena_alloc(&ctx->Arena, sizeof(int) * maxteam * GROUPS_PER_THREAD);
+  result = arena_alloc(&ctx->Arena, sizeof(struct fof_result) * ngroups);
+  for(g = 0; g < ngroups; g++)
+    result[g].Gal = NULL;
+
+  worker = arena_alloc(&ctx->Arena, sizeof(struct tree_context) * maxteam);
+  for(b = 0; b < maxteam; b++)
+    init_tree_context(&worker[b]);
+
+  nready = 0;
+  for(b = first[0]; b < first[1]; b++)   // the groups without progenitors
+    heap_push(heap, &nready, bydep[b]);
+  released = 0;    // the buckets up to this one are in the heap or done
+  committed = 0;   // groups attached to HaloGal
+
+  while(committed < ngroups)
+  {
+    nextra = claim_idle_threads(maxteam - 1);
+
+    if(nextra == 0)
+    {
+      // the lowest ready group is always the next one to attach, so it can go in place
+      g = heap_pop(heap, &nready);
+      assert(g == committed);
+      construct_galaxies(ctx->FoFOrder[g], ctx);
+      committed++;
+    }
+    else
+    {
+      for(nbatch = 0; nready > 0 && nbatch < (nextra + 1) * GROUPS_PER_THREAD; nbatch++)
+        batch[nbatch] = heap_pop(heap, &nready);
+
+#pragma omp parallel num_threads(nextra + 1)
+      {
+#pragma omp for schedule(dynamic, 1)
+        for(b = 0; b < nbatch; b++)
+          evolve_group(batch[b], &worker[omp_get_thread_num()], ctx, &result[batch[b]]);
+
+        // thread 0 is this one, which merges at the end of the file; the lent ones don't
+        if(omp_get_thread_num() > 0)
+          TIMING_MERGE_THREAD();
+      }
+
+      release_idle_threads(nextra);
+    }
+
+    if(committed < ngroups && result[committed].Gal != NULL)
+    {
+      TIMING_START(timing_attach_galaxies);
+      for(; committed < ngroups && result[committed].Gal != NULL; committed++)
+      {
+        attach_galaxies(result[committed].ngal, result[committed].Gal, result[committed].History, ctx);
+        free(result[committed].Gal);
+        free(result[committed].History);
+      }
+      TIMING_STOP(timing_attach_galaxies);
+    }
+
+    for(; released < committed; released++)
+      for(g = first[released + 1]; g < first[released + 2]; g++)
+        heap_push(heap, &nready, bydep[g]);
+  }
+
+  for(b = 0; b < maxteam; b++)
+    free_tree_context(&worker[b]);
+}
@@ -6,9 +6,10 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <unistd.h>
-#include <gsl/gsl_rng.h>
-#include <gsl/gsl_math.h>
-#include <gsl/gsl_integration.h>
+
+#ifdef MPI
+#include <mpi.h>
+#endif
 
 #include "core_allvars.h"
 #include "core_proto.h"
@@ -21,24 +22,31 @@ void init(void)
 
   Age = mymalloc(ABSOLUTEMAXSNAPS*sizeof(*Age));
   
-  random_generator = gsl_rng_alloc(gsl_rng_ranlxd1);
-  gsl_rng_set(random_generator, 42);	 // start-up seed 
-
   set_units();
-  srand((unsigned) time(NULL));
 
-  read_snap_list();
+  // the snapshot list is the same for every task, so only task 0 reads it
+#ifdef MPI
+  if(ThisTask == 0)
+#endif
+    read_snap_list();
+
+#ifdef MPI
+  MPI_Bcast(&Snaplistlen, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  MPI_Bcast(AA, Snaplistlen, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+#endif
+
+  for(i = 0; i < Snaplistlen; i++)
+    ZZ[i] = 1 / AA[i] - 1;
+
+  init_cosmology();
 
   //Hack to fix deltaT for snapshot 0
   //This way, galsnapnum = -1 will not segfault.
   Age[0] = time_to_present(1000.0);//lookback time from z=1000
-  Age++;
-  
+
   for(i = 0; i < Snaplistlen; i++)
-  {
-    ZZ[i] = 1 / AA[i] - 1;
-    Age[i] = time_to_present(ZZ[i]);
-  }
+    Age[i + 1] = time_to_present(ZZ[i]);
+  Age++;
 
   a0 = 1.0 / (1.0 + Reionization_z0);
   ar = 1.0 / (1.0 + Reionization_zr);
@@ -103,36 +111,3 @@ void read_snap_list(void)
 #endif
     printf("found %d defined times in snaplist\n", Snaplistlen);
 }
-
-
-
-double time_to_present(double z)
-{
-#define WORKSIZE 1000
-  gsl_function F;
-  gsl_integration_workspace *workspace;
-  double time, result, abserr;
-
-  workspace = gsl_integration_workspace_alloc(WORKSIZE);
-  F.function = &integrand_time_to_present;
-
-  gsl_integration_qag(&F, 1.0 / (z + 1), 1.0, 1.0 / Hubble,
-    1.0e-8, WORKSIZE, GSL_INTEG_GAUSS21, workspace, &result, &abserr);
-
-  time = 1 / Hubble * result;
-
-  gsl_integration_workspace_free(workspace);
-
-  // return time to present as a function of redshift 
-  return time;
-}
-
-
-
-double integrand_time_to_present(double a, void *param)
-{
-  return 1 / sqrt(Omega / a + (1 - Omega - OmegaLambda) + OmegaLambda * a * a);
-}
-
-
-
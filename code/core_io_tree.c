@@ -7,6 +7,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <assert.h>
+#include <stdarg.h>
 
 #include "core_allvars.h"
 #include "core_proto.h"
@@ -19,8 +20,6 @@
 void load_tree_table(int filenr, enum Valid_TreeTypes my_TreeType)
 {
   int i, n;
-  FILE *fd;
-  char buf[MAX_STRING_LEN];
 
   switch (my_TreeType)
   {
@@ -31,6 +30,7 @@ void load_tree_table(int filenr, enum Valid_TreeTypes my_TreeType)
 #endif
       
     case lhalo_binary:
+    case lhalo_binary_mmap:
       load_tree_table_binary(filenr);
       break;
 
@@ -46,19 +46,33 @@ void load_tree_table(int filenr, enum Valid_TreeTypes my_TreeType)
     for(i = 0; i < Ntrees; i++)
       TreeNgals[n][i] = 0;
 
-    sprintf(buf, "%s/%s_z%1.3f_%d", OutputDir, FileNameGalaxies, ZZ[ListOutputSnaps[n]], filenr);
-
-    if(!(fd = fopen(buf, "w")))
-    {
-      printf("can't open file `%s'\n", buf);
-      ABORT(0);
-    }
-    fclose(fd);
     TotGalaxies[n] = 0;
   }
 
 }
 
+int64_t get_tree_file_nhalos(int filenr, enum Valid_TreeTypes my_TreeType)
+{
+  switch (my_TreeType)
+  {
+#ifdef HDF5
+    case genesis_lhalo_hdf5:
+      return read_tree_file_nhalos_hdf5(filenr);
+#endif
+      
+    case lhalo_binary:
+    case lhalo_binary_mmap:
+      return read_tree_file_nhalos_binary(filenr);
+
+    default:
+      fprintf(stderr, "Your tree type has not been included in the switch statement for ``get_tree_file_nhalos`` in ``core_io_tree.c``.\n");
+      fprintf(stderr, "Please add it there.\n");
+      ABORT(EXIT_FAILURE);
+  }
+
+  return -1;
+}
+
 void free_tree_table(enum Valid_TreeTypes my_TreeType)
 {
   int n;
@@ -80,6 +94,7 @@ void free_tree_table(enum Valid_TreeTypes my_TreeType)
 #endif
       
     case lhalo_binary:
+    case lhalo_binary_mmap:
       close_binary_file();
       break;
 
@@ -92,55 +107,120 @@ void free_tree_table(enum Valid_TreeTypes my_TreeType)
 
 }
 
-void load_tree(int filenr, int treenr, enum Valid_TreeTypes my_TreeType)
+void read_tree_halos(int filenr, int treenr, enum Valid_TreeTypes my_TreeType, struct halo_data *Halo)
 {
-  int32_t i;
-
   switch (my_TreeType)
   {
 
 #ifdef HDF5
   case genesis_lhalo_hdf5:
-      load_tree_hdf5(filenr, treenr);
+      load_tree_hdf5(filenr, treenr, Halo);
       break;
 #endif
     case lhalo_binary:
-      load_tree_binary(filenr, treenr);
+    case lhalo_binary_mmap:
+      load_tree_binary(filenr, treenr, Halo);
       break;
 
     default:
-      fprintf(stderr, "Your tree type has not been included in the switch statement for ``load_tree`` in ``core_io_tree.c``.\n");
+      fprintf(stderr, "Your tree type has not been included in the switch statement for ``read_tree_halos`` in ``core_io_tree.c``.\n");
       fprintf(stderr, "Please add it there.\n");
       ABORT(EXIT_FAILURE);
 
   }
+}
 
-  MaxGals = (int)(MAXGALFAC * TreeNHalos[treenr]);
-  if(MaxGals < 10000)
-    MaxGals = 10000;
+void load_tree(int filenr, int treenr, enum Valid_TreeTypes my_TreeType, struct tree_context *ctx)
+{
+  ctx->HaloMapped = 0;
 
-  FoF_MaxGals = 10000;
+  // the background reader may already have this tree waiting for us
+  if(take_prefetched_tree(treenr, ctx) == 0)
+  {
+    // the tree files are shared by all worker threads; only one of them reads at a time
+#ifdef OPENMP
+#pragma omp critical (tree_io)
+#endif
+    {
+      if(my_TreeType == lhalo_binary_mmap && (ctx->Halo = map_tree_binary(filenr, treenr)) != NULL)
+        ctx->HaloMapped = 1;
+      else
+      {
+        ctx->Halo = arena_alloc(&ctx->Arena, sizeof(struct halo_data) * TreeNHalos[treenr]);
+        read_tree_halos(filenr, treenr, my_TreeType, ctx->Halo);
+      }
+    }
+  }
+
+  init_tree_galaxies(filenr, treenr, ctx);
+}
+
+// sets up the galaxy arrays of tree treenr, whose halos are already in ctx->Halo
+void init_tree_galaxies(int filenr, int treenr, struct tree_context *ctx)
+{
+  int32_t i;
 
-  HaloAux = mymalloc(sizeof(struct halo_aux_data) * TreeNHalos[treenr]);
-  HaloGal = mymalloc(sizeof(struct GALAXY) * MaxGals);
-  Gal = mymalloc(sizeof(struct GALAXY) * FoF_MaxGals);
+  ctx->TreeID = treenr;
+  ctx->FileNum = filenr;
+  ctx->NumGals = 0;
+  ctx->GalaxyCounter = 0;
+
+  ctx->GalBase = 0;
+  ctx->MaxGals = (int)(MAXGALFAC * TreeNHalos[treenr]);
+  if(ctx->MaxGals < 10000 || is_streamed_tree(treenr))
+    ctx->MaxGals = 10000;   // a streamed tree only holds the galaxies of a few snapshots
+  ctx->MaxGalaxyNr = ctx->MaxGals;
+
+  // the scratch of a FoF group starts as big as the last tree needed it
+  if(ctx->FoF_MaxGals < 10000)
+    ctx->FoF_MaxGals = 10000;
+
+  ctx->HaloAux = arena_alloc(&ctx->Arena, sizeof(struct halo_aux_data) * TreeNHalos[treenr]);
+  ctx->HaloGal = arena_alloc(&ctx->Arena, sizeof(struct GALAXY) * ctx->MaxGals);
+  ctx->HaloGalHistory = arena_alloc(&ctx->Arena, sizeof(struct GALAXY_HISTORY) * ctx->MaxGals);
+  ctx->GalaxySlot = arena_alloc(&ctx->Arena, sizeof(int) * ctx->MaxGals);
+  ctx->MergeRank = arena_alloc(&ctx->Arena, sizeof(int) * (ctx->FoF_MaxGals + 3));
+  ctx->GalHistory = arena_alloc(&ctx->Arena, sizeof(struct GALAXY_HISTORY) * ctx->FoF_MaxGals);
+  ctx->Gal = arena_alloc(&ctx->Arena, sizeof(struct GALAXY) * ctx->FoF_MaxGals);
 
   for(i = 0; i < TreeNHalos[treenr]; i++)
   {
-    HaloAux[i].DoneFlag = 0;
-    HaloAux[i].HaloFlag = 0;
-    HaloAux[i].NGalaxies = 0;
+    ctx->HaloAux[i].DoneFlag = 0;
+    ctx->HaloAux[i].HaloFlag = 0;
+    ctx->HaloAux[i].NGalaxies = 0;
   }
 
 
 }
 
-void free_galaxies_and_tree(void)
+void free_galaxies_and_tree(struct tree_context *ctx)
+{
+  // everything the tree allocated goes at once, the arena keeps the memory for the next tree
+  arena_reset(&ctx->Arena);
+  if(ctx->PrefetchSlot >= 0)
+    release_prefetched_tree(ctx);
+  ctx->Halo = NULL;
+  ctx->HaloAux = NULL;
+  ctx->HaloGal = NULL;
+  ctx->HaloGalHistory = NULL;
+  ctx->GalHistory = NULL;
+  ctx->GalaxySlot = NULL;
+  ctx->MergeRank = NULL;
+  ctx->FoFOrder = NULL;
+  ctx->NumFoFGroups = 0;
+  ctx->Gal = NULL;
+}
+
+void init_tree_context(struct tree_context *ctx)
 {
-  myfree(Gal);
-  myfree(HaloGal);
-  myfree(HaloAux);
-  myfree(Halo);
+  memset(ctx, 0, sizeof(struct tree_context));
+  ctx->PrefetchSlot = -1;
+  arena_init(&ctx->Arena);
+}
+
+void free_tree_context(struct tree_context *ctx)
+{
+  arena_free(&ctx->Arena);
 }
 
 size_t myfread(void *ptr, size_t size, size_t nmemb, FILE * stream)
@@ -157,3 +237,22 @@ int myfseek(FILE * stream, long offset, int whence)
 {
   return fseek(stream, offset, whence);
 }
+
+
+
+// snprintf for the name of a file; one that doesn't fit into buf is an error, not cut short
+void path_printf(char *buf, size_t size, const char *format, ...)
+{
+  va_list args;
+  int len;
+
+  va_start(args, format);
+  len = vsnprintf(buf, size, format, args);
+  va_end(args);
+
+  if(len < 0 || (size_t) len >= size)
+  {
+    fprintf(stderr, "Error: the file name `%s...' is longer than %zu characters\n", buf, size - 1);
+    ABORT(0);
+  }
+}
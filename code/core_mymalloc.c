@@ -14,6 +14,32 @@ static void *Table[MAXBLOCKS];
 static size_t SizeTable[MAXBLOCKS];
 static size_t TotMem = 0, HighMarkMem = 0, OldPrintedHighMark = 0;
 
+#ifdef OPENMP
+// every thread keeps its own stack of blocks so the LIFO rule holds per thread;
+// the memory totals stay shared across all threads
+#pragma omp threadprivate(Nblocks, Table, SizeTable)
+#endif
+
+static void account_memory(size_t nold, size_t nnew)
+{
+#ifdef OPENMP
+#pragma omp critical (mymalloc_totals)
+#endif
+  {
+    TotMem -= nold;
+    TotMem += nnew;
+    if(TotMem > HighMarkMem)
+    {
+      HighMarkMem = TotMem;
+      if(HighMarkMem > OldPrintedHighMark + 10 * 1024.0 * 1024.0)
+      {
+        printf("new high mark = %g MB\n", HighMarkMem / (1024.0 * 1024.0));
+        OldPrintedHighMark = HighMarkMem;
+      }
+    }
+  }
+}
+
 
 
 void *mymalloc(size_t n)
@@ -31,16 +57,7 @@ void *mymalloc(size_t n)
   }
 
   SizeTable[Nblocks] = n;
-  TotMem += n;
-  if(TotMem > HighMarkMem)
-  {
-    HighMarkMem = TotMem;
-    if(HighMarkMem > OldPrintedHighMark + 10 * 1024.0 * 1024.0)
-    {
-      printf("new high mark = %g MB\n", HighMarkMem / (1024.0 * 1024.0));
-      OldPrintedHighMark = HighMarkMem;
-    }
-  }
+  account_memory(0, n);
 
   if(!(Table[Nblocks] = malloc(n)))
   {
@@ -75,19 +92,8 @@ void *myrealloc(void *p, size_t n)
    }
   Table[Nblocks-1] = newp;
   
-  TotMem -= SizeTable[Nblocks-1];
-  TotMem += n;
+  account_memory(SizeTable[Nblocks-1], n);
   SizeTable[Nblocks-1] = n;
-  
-  if(TotMem > HighMarkMem)
-  {
-    HighMarkMem = TotMem;
-    if(HighMarkMem > OldPrintedHighMark + 10 * 1024.0 * 1024.0)
-    {
-      printf("new high mark = %g MB\n", HighMarkMem / (1024.0 * 1024.0));
-      OldPrintedHighMark = HighMarkMem;
-    }
-  }
 
   return Table[Nblocks - 1];
 }
@@ -107,13 +113,169 @@ void myfree(void *p)
 
   Nblocks -= 1;
 
-  TotMem -= SizeTable[Nblocks];
+  account_memory(SizeTable[Nblocks], 0);
 }
 
 
 
+// Per-tree arena. All the arrays of a tree come out of one region that is kept by
+// its tree_context and reused for the next tree, so in the steady state a tree costs
+// no calls to malloc at all. Allocations can be grown in any order; when the last one
+// can't be extended in place it is copied and the old space is only reclaimed by
+// arena_reset(). Chunks are counted in the same totals as mymalloc().
+
+#define ARENA_MIN_CHUNK (1024 * 1024)   /* bytes */
+#define ARENA_HEADER 8                  /* size of each allocation, keeps 8-byte alignment */
+
+struct arena_chunk
+{
+  struct arena_chunk *next;   /* older chunk */
+  size_t size;                /* usable bytes after this header */
+  size_t used;
+  size_t pad;                 /* keeps the data 8-byte aligned */
+};
+
+static struct arena_chunk *arena_add_chunk(struct arena *a, size_t size)
+{
+  struct arena_chunk *c;
+
+  if(!(c = malloc(sizeof(struct arena_chunk) + size)))
+  {
+    printf("Failed to allocate memory for %g MB in the tree arena\n", size / (1024.0 * 1024.0));
+    ABORT(0);
+  }
+  account_memory(0, size);
+
+  c->size = size;
+  c->used = 0;
+  c->next = a->chunks;
+  a->chunks = c;
+  a->capacity += size;
+
+  return c;
+}
+
+
+
+void arena_init(struct arena *a)
+{
+  a->chunks = NULL;
+  a->capacity = 0;
+  a->last = NULL;
+}
+
+
+
+void *arena_alloc(struct arena *a, size_t n)
+{
+  struct arena_chunk *c = a->chunks;
+  char *p;
+
+  if((n % 8) > 0)
+    n = (n / 8 + 1) * 8;
+
+  // a new chunk at least doubles the arena, so a growing tree needs few of them
+  if(c == NULL || c->used + ARENA_HEADER + n > c->size)
+  {
+    size_t size = 2 * a->capacity;
+
+    if(size < ARENA_MIN_CHUNK)
+      size = ARENA_MIN_CHUNK;
+    if(size < ARENA_HEADER + n)
+      size = ARENA_HEADER + n;
+    c = arena_add_chunk(a, size);
+  }
+
+  p = (char *) (c + 1) + c->used;
+  *(size_t *) p = n;
+  c->used += ARENA_HEADER + n;
+
+  a->last = p + ARENA_HEADER;
+  return a->last;
+}
+
+
+
+void *arena_realloc(struct arena *a, void *p, size_t n)
+{
+  struct arena_chunk *c = a->chunks;
+  size_t oldn = *(size_t *) ((char *) p - ARENA_HEADER);
+  void *newp;
+
+  if((n % 8) > 0)
+    n = (n / 8 + 1) * 8;
+
+  if(n <= oldn)
+    return p;
+
+  // the newest allocation can simply be extended if its chunk still has room
+  if(p == a->last && c->used - oldn + n <= c->size)
+  {
+    c->used += n - oldn;
+    *(size_t *) ((char *) p - ARENA_HEADER) = n;
+    return p;
+  }
+
+  newp = arena_alloc(a, n);
+  memcpy(newp, p, oldn);
+  return newp;
+}
+
+
+
+// Forgets every allocation. If the last tree needed more than one chunk they are
+// merged into a single one, so the next tree of that size fits without new chunks.
+void arena_reset(struct arena *a)
+{
+  if(a->chunks != NULL && a->chunks->next != NULL)
+  {
+    size_t capacity = a->capacity;
+
+    arena_free(a);
+    arena_add_chunk(a, capacity);
+  }
+  else if(a->chunks != NULL)
+    a->chunks->used = 0;
+
+  a->last = NULL;
+}
+
+
+
+void arena_free(struct arena *a)
+{
+  struct arena_chunk *c, *next;
+
+  for(c = a->chunks; c != NULL; c = next)
+  {
+    next = c->next;
+    account_memory(c->size, 0);
+    free(c);
+  }
+  arena_init(a);
+}
+
+#undef ARENA_MIN_CHUNK
+#undef ARENA_HEADER
+
+
+
 void print_allocated(void)
 {
   printf("allocated = %g MB\n", TotMem / (1024.0 * 1024.0));
 }
 
+
+
+size_t get_high_mark_memory(void)
+{
+  size_t mem;
+
+#ifdef OPENMP
+#pragma omp critical (mymalloc_totals)
+#endif
+  mem = HighMarkMem;
+
+  return mem;
+}
+
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "core_allvars.h"
+#include "core_proto.h"
+
+// One entry per member of struct GALAXY_OUTPUT, in the order of the struct.
+// The columnar and the HDF5 writers both work from this table, so a new output
+// property only has to be added here (and to prepare_galaxy_for_output).
+
+#define OUTPUT_FIELD(name, type) \
+  { #name, offsetof(struct GALAXY_OUTPUT, name), sizeof(((struct GALAXY_OUTPUT *) 0)->name), type }
+
+static const struct output_field AllOutputFields[] =
+{
+  OUTPUT_FIELD(SnapNum, output_int32),
+  OUTPUT_FIELD(Type, output_int32),
+
+  OUTPUT_FIELD(GalaxyIndex, output_int64),
+  OUTPUT_FIELD(CentralGalaxyIndex, output_int64),
+  OUTPUT_FIELD(SAGEHaloIndex, output_int32),
+  OUTPUT_FIELD(SAGETreeIndex, output_int32),
+  OUTPUT_FIELD(SimulationHaloIndex, output_int64),
+
+  OUTPUT_FIELD(mergeType, output_int32),
+  OUTPUT_FIELD(mergeIntoID, output_int32),
+  OUTPUT_FIELD(mergeIntoSnapNum, output_int32),
+  OUTPUT_FIELD(dT, output_float32),
+
+  /* (sub)halo properties */
+  OUTPUT_FIELD(Pos, output_float32),
+  OUTPUT_FIELD(Vel, output_float32),
+  OUTPUT_FIELD(Spin, output_float32),
+  OUTPUT_FIELD(Len, output_int32),
+  OUTPUT_FIELD(Mvir, output_float32),
+  OUTPUT_FIELD(CentralMvir, output_float32),
+  OUTPUT_FIELD(Rvir, output_float32),
+  OUTPUT_FIELD(Vvir, output_float32),
+  OUTPUT_FIELD(Vmax, output_float32),
+  OUTPUT_FIELD(VelDisp, output_float32),
+
+  /* baryonic reservoirs */
+  OUTPUT_FIELD(ColdGas, output_float32),
+  OUTPUT_FIELD(StellarMass, output_float32),
+  OUTPUT_FIELD(BulgeMass, output_float32),
+  OUTPUT_FIELD(HotGas, output_float32),
+  OUTPUT_FIELD(EjectedMass, output_float32),
+  OUTPUT_FIELD(BlackHoleMass, output_float32),
+  OUTPUT_FIELD(ICS, output_float32),
+
+  /* metals */
+  OUTPUT_FIELD(MetalsColdGas, output_float32),
+  OUTPUT_FIELD(MetalsStellarMass, output_float32),
+  OUTPUT_FIELD(MetalsBulgeMass, output_float32),
+  OUTPUT_FIELD(MetalsHotGas, output_float32),
+  OUTPUT_FIELD(MetalsEjectedMass, output_float32),
+  OUTPUT_FIELD(MetalsICS, output_float32),
+
+  /* to calculate magnitudes */
+  OUTPUT_FIELD(SfrDisk, output_float32),
+  OUTPUT_FIELD(SfrBulge, output_float32),
+  OUTPUT_FIELD(SfrDiskZ, output_float32),
+  OUTPUT_FIELD(SfrBulgeZ, output_float32),
+
+  /* misc */
+  OUTPUT_FIELD(DiskScaleRadius, output_float32),
+  OUTPUT_FIELD(Cooling, output_float32),
+  OUTPUT_FIELD(Heating, output_float32),
+  OUTPUT_FIELD(QuasarModeBHaccretionMass, output_float32),
+  OUTPUT_FIELD(TimeOfLastMajorMerger, output_float32),
+  OUTPUT_FIELD(TimeOfLastMinorMerger, output_float32),
+  OUTPUT_FIELD(OutflowRate, output_float32),
+
+  /* infall properties */
+  OUTPUT_FIELD(infallMvir, output_float32),
+  OUTPUT_FIELD(infallVvir, output_float32),
+  OUTPUT_FIELD(infallVmax, output_float32)
+};
+
+#define NALLOUTPUTFIELDS ((int) (sizeof(AllOutputFields) / sizeof(AllOutputFields[0])))
+
+#undef OUTPUT_FIELD
+
+
+
+// Fills OutputField[] from the OutputFields parameter: either "all" or a comma
+// separated list of GALAXY_OUTPUT member names. The selected fields are written
+// in the order of the struct, whatever the order of the list.
+void select_output_fields(void)
+{
+  char list[MAX_STRING_LEN], *name;
+  int selected[NALLOUTPUTFIELDS];
+  int i, errorFlag = 0;
+
+  NOutputFields = 0;
+
+  if(strcasecmp(OutputFields, "all") == 0)
+  {
+    for(i = 0; i < NALLOUTPUTFIELDS; i++)
+      OutputField[NOutputFields++] = &AllOutputFields[i];
+    return;
+  }
+
+  for(i = 0; i < NALLOUTPUTFIELDS; i++)
+    selected[i] = 0;
+
+  strncpy(list, OutputFields, MAX_STRING_LEN - 1);
+  list[MAX_STRING_LEN - 1] = 0;
+
+  for(name = strtok(list, ","); name != NULL; name = strtok(NULL, ","))
+  {
+    for(i = 0; i < NALLOUTPUTFIELDS; i++)
+      if(strcmp(name, AllOutputFields[i].name) == 0)
+        break;
+
+    if(i == NALLOUTPUTFIELDS)
+    {
+      fprintf(stderr, "OutputFields: '%s' is not a galaxy output property\n", name);
+      errorFlag = 1;
+    }
+    else
+      selected[i] = 1;
+  }
+
+  for(i = 0; i < NALLOUTPUTFIELDS; i++)
+    if(selected[i])
+      OutputField[NOutputFields++] = &AllOutputFields[i];
+
+  if(errorFlag || NOutputFields == 0)
+  {
+    fprintf(stderr, "Please give OutputFields as 'all' or a comma separated list of these properties:\n");
+    for(i = 0; i < NALLOUTPUTFIELDS; i++)
+      fprintf(stderr, "  %s\n", AllOutputFields[i].name);
+    ABORT(1);
+  }
+}
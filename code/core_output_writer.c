@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#ifdef WRITER
+#include <pthread.h>
+#endif
+
+#include "core_allvars.h"
+#include "core_proto.h"
+
+// Optional output stage on a thread of its own (compile with USE-WRITER).
+// A finished tree is handed over whole: output_tree_galaxies() swaps the tree_context
+// of the compute thread with an idle one from a small queue, so the writer owns the
+// tree's halos and galaxies while the compute thread goes on with the next tree in
+// the memory the writer gave back. The writer converts and writes the trees in the
+// order they were handed over, which is tree order, so the files come out exactly as
+// before. finalize_galaxy_file() and the checkpoints wait for the queue to drain.
+//
+// The writer only gives a borrowed prefetch slot back; the arena of a written tree is
+// reset by the compute thread that picks the context up again, so that all memory
+// accounting stays on the compute threads.
+
+#ifdef WRITER
+
+#ifndef WRITER_DEPTH
+#define WRITER_DEPTH 2   /* number of finished trees that can wait for the writer */
+#endif
+
+struct writer_job
+{
+  int filenr;
+  int treenr;
+  struct tree_context ctx;
+};
+
+static struct writer_job Jobs[WRITER_DEPTH];
+static int NextJob = 0;       /* oldest tree still to write */
+static int NJobs = 0;         /* trees handed over and not written yet */
+static int WriterActive = 0;
+static int WriterStop;
+
+static pthread_t WriterThread;
+static pthread_mutex_t JobLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t JobQueued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t JobDone = PTHREAD_COND_INITIALIZER;
+
+
+
+static void *output_writer(void *unused)
+{
+  struct writer_job *job;
+
+  pthread_mutex_lock(&JobLock);
+  for(;;)
+  {
+    while(NJobs == 0 && !WriterStop)
+      pthread_cond_wait(&JobQueued, &JobLock);
+    if(NJobs == 0)
+      break;
+    job = &Jobs[NextJob];
+    pthread_mutex_unlock(&JobLock);
+
+    // the job stays queued while it is written, so nobody else touches its context
+    save_galaxies(job->filenr, job->treenr, &job->ctx);
+    if(job->ctx.PrefetchSlot >= 0)
+      release_prefetched_tree(&job->ctx);
+
+    pthread_mutex_lock(&JobLock);
+    NextJob = (NextJob + 1) % WRITER_DEPTH;
+    NJobs--;
+    pthread_cond_broadcast(&JobDone);
+  }
+  pthread_mutex_unlock(&JobLock);
+
+  return NULL;
+}
+
+
+
+void start_output_writer(void)
+{
+  int i;
+
+  WriterActive = 0;
+
+#ifdef HDF5
+  // the writer calls HDF5 while the compute threads may be reading HDF5 trees;
+  // that is only safe with a thread-safe build of the library
+  if(HDF5Output && TreeType == genesis_lhalo_hdf5)
+  {
+    hbool_t threadsafe = 0;
+
+    H5is_library_threadsafe(&threadsafe);
+    if(!threadsafe)
+    {
+      printf("HDF5 library is not thread-safe, writing the galaxies without a writer thread\n");
+      return;
+    }
+  }
+#endif
+
+  for(i = 0; i < WRITER_DEPTH; i++)
+    init_tree_context(&Jobs[i].ctx);
+  NextJob = NJobs = 0;
+  WriterStop = 0;
+
+  if(pthread_create(&WriterThread, NULL, output_writer, NULL) != 0)
+  {
+    printf("Could not start the output writer thread\n");
+    ABORT(0);
+  }
+
+  WriterActive = 1;
+}
+
+
+
+// With OpenMP this is called from the ordered section, so only one thread at a time
+// hands over a tree.
+void output_tree_galaxies(int filenr, int treenr, struct tree_context *ctx)
+{
+  struct writer_job *job;
+  struct tree_context idle;
+
+  if(!WriterActive)
+  {
+    save_galaxies(filenr, treenr, ctx);
+    return;
+  }
+
+  pthread_mutex_lock(&JobLock);
+  while(NJobs == WRITER_DEPTH)
+    pthread_cond_wait(&JobDone, &JobLock);
+  job = &Jobs[(NextJob + NJobs) % WRITER_DEPTH];
+  pthread_mutex_unlock(&JobLock);
+
+  // a free job is only touched by the thread handing over the next tree
+  free_galaxies_and_tree(&job->ctx);
+  idle = job->ctx;
+  job->ctx = *ctx;
+  *ctx = idle;
+  job->filenr = filenr;
+  job->treenr = treenr;
+
+  pthread_mutex_lock(&JobLock);
+  NJobs++;
+  pthread_cond_signal(&JobQueued);
+  pthread_mutex_unlock(&JobLock);
+}
+
+
+
+// returns once every tree handed over has been written to the output buffers
+void wait_output_writer(void)
+{
+  if(!WriterActive)
+    return;
+
+  pthread_mutex_lock(&JobLock);
+  while(NJobs > 0)
+    pthread_cond_wait(&JobDone, &JobLock);
+  pthread_mutex_unlock(&JobLock);
+}
+
+
+
+void stop_output_writer(void)
+{
+  int i;
+
+  if(!WriterActive)
+    return;
+
+  pthread_mutex_lock(&JobLock);
+  WriterStop = 1;
+  pthread_cond_signal(&JobQueued);
+  pthread_mutex_unlock(&JobLock);
+  pthread_join(WriterThread, NULL);
+
+  for(i = WRITER_DEPTH - 1; i >= 0; i--)
+  {
+    free_galaxies_and_tree(&Jobs[i].ctx);
+    free_tree_context(&Jobs[i].ctx);
+  }
+  WriterActive = 0;
+}
+
+#else  /* WRITER */
+
+void start_output_writer(void)
+{
+}
+
+void output_tree_galaxies(int filenr, int treenr, struct tree_context *ctx)
+{
+  save_galaxies(filenr, treenr, ctx);
+}
+
+void wait_output_writer(void)
+{
+}
+
+void stop_output_writer(void)
+{
+}
+
+#endif /* WRITER */
@@ -4,69 +4,194 @@
 size_t myfread(void  *ptr,  size_t  size,  size_t  nmemb,  FILE *stream);
 size_t myfwrite(void  *ptr,  size_t  size,  size_t  nmemb,  FILE *stream);
 int myfseek(FILE *stream, long offset, int whence);
+void path_printf(char *buf, size_t size, const char *format, ...) __attribute__((format(printf, 3, 4)));
 
-void construct_galaxies(int halonr, int tree);
-void evolve_galaxies(int halonr, int ngal, int tree);
-int  join_galaxies_of_progenitors(int halonr, int nstart);
+void build_fof_order(int nhalos, struct tree_context *ctx);
+void construct_galaxies(int fofhalo, struct tree_context *ctx);
+void evolve_galaxies(int halonr, int ngal, struct tree_context *ctx);
+void attach_galaxies(int ngal, struct GALAXY *Gal, struct GALAXY_HISTORY *History, struct tree_context *ctx);
+void grow_fof_galaxies(int maxgals, struct tree_context *ctx);
+void construct_galaxies_parallel(struct tree_context *ctx);
+void reset_idle_threads(void);
+void mark_thread_idle(void);
+int is_streamed_tree(int treenr);
+void stream_tree_galaxies(int filenr, int treenr, struct tree_context *ctx);
+int  join_galaxies_of_progenitors(int halonr, int nstart, struct tree_context *ctx);
 void init(void);
 void set_units(void);
 
 void load_tree_table(int filenr, enum Valid_TreeTypes TreeType);
-void load_tree(int filenr, int treenr, enum Valid_TreeTypes TreeType);
-void save_galaxies(int filenr, int tree);
+void load_tree(int filenr, int treenr, enum Valid_TreeTypes TreeType, struct tree_context *ctx);
+void init_tree_galaxies(int filenr, int treenr, struct tree_context *ctx);
+void read_tree_halos(int filenr, int treenr, enum Valid_TreeTypes TreeType, struct halo_data *Halo);
+void save_galaxies(int filenr, int tree, struct tree_context *ctx);
+void save_galaxy_history(int filenr, int tree, const int *outputpos, struct tree_context *ctx);
+void finalize_history_file(int filenr);
+void save_streamed_galaxies(int filenr, int tree, int last, const int *SnapFirstSlot, struct tree_context *ctx);
+struct staged_galaxies *stage_galaxies(int filenr, int tree, struct tree_context *ctx);
+void save_staged_galaxies(int filenr, int tree, struct staged_galaxies *s);
+void free_staged_galaxies(struct staged_galaxies *s);
 
-void prepare_galaxy_for_output(int filenr, int tree, struct GALAXY *g, struct GALAXY_OUTPUT *o);
+void prepare_galaxy_for_output(int filenr, int tree, struct GALAXY *g, struct GALAXY_HISTORY *h, struct GALAXY_OUTPUT *o, struct tree_context *ctx);
 
-void free_galaxies_and_tree(void);
+void init_tree_context(struct tree_context *ctx);
+void philox4x32(const uint32_t counter[4], const uint32_t key[2], uint32_t out[4]);
+uint64_t random_bits(int halonr, int birthhalo, int draw, const struct tree_context *ctx);
+double random_uniform(int halonr, int birthhalo, int draw, const struct tree_context *ctx);
+void free_tree_context(struct tree_context *ctx);
+void free_galaxies_and_tree(struct tree_context *ctx);
+int64_t get_tree_file_nhalos(int filenr, enum Valid_TreeTypes TreeType);
 void free_tree_table(enum Valid_TreeTypes TreeType);
 void print_allocated(void);
+size_t get_high_mark_memory(void);
 
 void read_parameter_file(char *fname);
 void *mymalloc(size_t n);
 void *myrealloc(void *p, size_t n);
 void myfree(void *p);
+void arena_init(struct arena *a);
+void *arena_alloc(struct arena *a, size_t n);
+void *arena_realloc(struct arena *a, void *p, size_t n);
+void arena_reset(struct arena *a);
+void arena_free(struct arena *a);
 void myexit(int signum);
 
 void finalize_galaxy_file(int filenr);
+void resume_galaxy_files(int filenr, const int64_t *offset);
+void sync_galaxy_files(int64_t *offset);
+int  checkpoints_enabled(void);
+int  checkpoint_exists(int filenr);
+void write_checkpoint(int filenr, int lasttree);
+int  read_checkpoint(int filenr);
+void remove_checkpoint(int filenr);
+void open_shared_output(void);
+void write_shared_block(int filenr, int n, const char *block, int64_t size);
+void close_shared_output(void);
 
-void starformation_and_feedback(int p, int centralgal, double time, double dt, int halonr, int step);
-void add_galaxies_together(int t, int p);
-void init_galaxy(int p, int halonr);
-double infall_recipe(int centralgal, int ngal, double Zcurr);
-void add_infall_to_hot(int centralgal, double infallingGas);
-double cooling_recipe(int centralgal, double dt);
-void cool_gas_onto_galaxy(int centralgal, double coolingGas);
-void reincorporate_gas(int centralgal, double dt);
-double estimate_merging_time(int prog, int mother_halo, int ngal);
-void deal_with_galaxy_merger(int p, int merger_centralgal, int centralgal, double time, double dt, int halonr, int step);
+void read_sweep_file(void);
+void sweep_tree_file(int filenr, const int *order, int ntodo, struct tree_context *TreeContext);
+void write_sweep_results(void);
+
+void init_galaxy_stats(int nsets);
+struct galaxy_stats_tally *tally_galaxy_stats(int set, int first, int last, struct tree_context *ctx);
+void add_galaxy_stats_tally(struct galaxy_stats_tally *t);
+void add_galaxy_stats(int set, int first, int last, struct tree_context *ctx);
+void end_file_galaxy_stats(int filenr);
+void write_galaxy_stats(void);
+
+int  plan_tree_order(int filenr, int firsttree, int *order);
+void start_tree_window(int lastdone);
+void advance_tree_window(int lastdone);
+int  wait_tree_window(int treenr);
+void select_output_fields(void);
+
+void start_tree_prefetch(int filenr, const int *order, int ntodo, enum Valid_TreeTypes TreeType);
+int  take_prefetched_tree(int treenr, struct tree_context *ctx);
+void release_prefetched_tree(struct tree_context *ctx);
+void stop_tree_prefetch(void);
+
+void start_output_writer(void);
+void output_tree_galaxies(int filenr, int treenr, struct tree_context *ctx);
+void wait_output_writer(void);
+void stop_output_writer(void);
+
+#ifdef TIMING
+double timing_now(void);
+void timing_start(enum timing_phase phase);
+void timing_stop(enum timing_phase phase);
+void timing_start_sampled(enum timing_phase phase);
+void timing_switch_sampled(enum timing_phase from, enum timing_phase to);
+void timing_stop_sampled(enum timing_phase phase);
+void timing_begin_file(void);
+void timing_begin_tree(void);
+void timing_end_tree(int treenr, int ngals);
+void timing_merge_thread(void);
+void timing_end_file(int filenr);
+void timing_abort_file(void);
+void timing_end_run(void);
+
+#define TIMING_START(phase)             timing_start(phase)
+#define TIMING_STOP(phase)              timing_stop(phase)
+#define TIMING_START_SAMPLED(phase)     timing_start_sampled(phase)
+#define TIMING_SWITCH_SAMPLED(from, to) timing_switch_sampled(from, to)
+#define TIMING_STOP_SAMPLED(phase)      timing_stop_sampled(phase)
+#define TIMING_BEGIN_FILE()             timing_begin_file()
+#define TIMING_BEGIN_TREE()             timing_begin_tree()
+#define TIMING_END_TREE(treenr, ngals)  timing_end_tree(treenr, ngals)
+#define TIMING_MERGE_THREAD()           timing_merge_thread()
+#define TIMING_END_FILE(filenr)         timing_end_file(filenr)
+#define TIMING_ABORT_FILE()             timing_abort_file()
+#define TIMING_END_RUN()                timing_end_run()
+#else
+#define TIMING_START(phase)
+#define TIMING_STOP(phase)
+#define TIMING_START_SAMPLED(phase)
+#define TIMING_SWITCH_SAMPLED(from, to)
+#define TIMING_STOP_SAMPLED(phase)
+#define TIMING_BEGIN_FILE()
+#define TIMING_BEGIN_TREE()
+#define TIMING_END_TREE(treenr, ngals)
+#define TIMING_MERGE_THREAD()
+#define TIMING_END_FILE(filenr)
+#define TIMING_ABORT_FILE()
+#define TIMING_END_RUN()
+#endif
+
+// loops over a whole FoF group that may be vectorised in any order (USE-SIMD)
+#ifdef SIMD
+#define PRAGMA(...)          _Pragma(#__VA_ARGS__)
+#define SIMD_REDUCE(...)     PRAGMA(omp simd reduction(+:__VA_ARGS__))
+#else
+#define SIMD_REDUCE(...)
+#endif
+
+void init_file_schedule(void);
+int  get_next_file(void);
+void finalize_file_schedule(void);
+
+void starformation_and_feedback(int p, int centralgal, double time, double dt, int halonr, int step, struct GALAXY *Gal, struct GALAXY_HISTORY *History);
+void add_galaxies_together(int t, int p, struct GALAXY *Gal, struct GALAXY_HISTORY *History);
+void init_galaxy(int p, int halonr, struct tree_context *ctx);
+double infall_recipe(int centralgal, int ngal, double Zcurr, struct GALAXY *Gal);
+void sum_fof_baryons(const struct GALAXY *Gal, int ngal, int centralgal, struct fof_baryons *tot);
+float sum_satellite_baryons(const struct GALAXY *Gal, int ngal, int centralgal);
+void add_infall_to_hot(int centralgal, double infallingGas, struct GALAXY *Gal);
+double cooling_recipe(int centralgal, double dt, struct GALAXY *Gal);
+void cool_gas_onto_galaxy(int centralgal, double coolingGas, struct GALAXY *Gal);
+void reincorporate_gas(int centralgal, double dt, struct GALAXY *Gal);
+double estimate_merging_time(int prog, int mother_halo, int ngal, struct GALAXY *Gal, struct halo_data *Halo);
+void deal_with_galaxy_merger(int p, int merger_centralgal, int centralgal, double time, double dt, int halonr, int step, struct GALAXY *Gal, struct GALAXY_HISTORY *History);
 double dmax(double x, double y);
-double do_reionization(int centralgal, double Zcurr);
-double do_AGN_heating(double coolingGas, int centralgal, double dt, double x, double rcool);
-void collisional_starburst_recipe(double mass_ratio, int merger_centralgal, int centralgal, double time, double dt, int halonr, int mode, int step);
-void update_from_star_formation(int p, double stars, double metallicity);
-void update_from_feedback(int p, int centralgal, double reheated_mass, double ejected_mass, double metallicity);
-void make_bulge_from_burst(int p);
-void grow_black_hole(int merger_centralgal, double mass_ratio);
-void check_disk_instability(int p, int centralgal, int halonr, double time, double dt, int step);
-
-void strip_from_satellite(int halonr, int centralgal, int gal);
-void disrupt_satellite_to_ICS(int centralgal, int gal);
-void quasar_mode_wind(int gal, float BHaccrete);
+double do_reionization(int centralgal, double Zcurr, struct GALAXY *Gal);
+double do_AGN_heating(double coolingGas, int centralgal, double dt, double x, double rcool, struct GALAXY *Gal);
+void collisional_starburst_recipe(double mass_ratio, int merger_centralgal, int centralgal, double time, double dt, int halonr, int mode, int step, struct GALAXY *Gal, struct GALAXY_HISTORY *History);
+void update_from_star_formation(int p, double stars, double metallicity, struct GALAXY *Gal);
+void update_from_feedback(int p, int centralgal, double reheated_mass, double ejected_mass, double metallicity, struct GALAXY *Gal);
+void make_bulge_from_burst(int p, struct GALAXY *Gal, struct GALAXY_HISTORY *History);
+void grow_black_hole(int merger_centralgal, double mass_ratio, struct GALAXY *Gal);
+void check_disk_instability(int p, int centralgal, int halonr, double time, double dt, int step, struct GALAXY *Gal, struct GALAXY_HISTORY *History);
+
+void strip_from_satellite(int halonr, int centralgal, int gal, struct GALAXY *Gal, struct halo_data *Halo);
+void disrupt_satellite_to_ICS(int centralgal, int gal, struct GALAXY *Gal);
+void quasar_mode_wind(int gal, float BHaccrete, struct GALAXY *Gal);
 
 double get_metallicity(double gas, double metals);
-double get_virial_velocity(int halonr);
-double get_virial_radius(int halonr);
-double get_virial_mass(int halonr);
-double get_disk_radius(int halonr, int p);
+double get_virial_velocity(int halonr, struct halo_data *Halo);
+double get_virial_radius(int halonr, struct halo_data *Halo);
+double get_virial_mass(int halonr, struct halo_data *Halo);
+double get_disk_radius(int halonr, int p, struct GALAXY *Gal, struct halo_data *Halo);
 
 void read_output_snaps(void);
 void read_snap_list(void);
 void read_cooling_functions(void);
 double get_metaldependent_cooling_rate(double logTemp, double logZ);
+double get_exact_cooling_rate(double logTemp, double logZ);
+void build_cooling_table(void);
 double get_rate(int tab, double logTemp);
 
+void init_cosmology(void);
+double cosmic_time(double a);
 double time_to_present(double z);
-double integrand_time_to_present(double a, void *param);
 
 double metallicity_dependent_star_formation(int p);
 double Z_dependent_SF(float lower_limit, float upper_limit, float Sigma_c0, float Xi, float gamma);
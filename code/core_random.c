@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "core_allvars.h"
+#include "core_proto.h"
+
+// Random numbers for the recipes, without any generator state. Every number is the
+// Philox4x32-10 block cipher (Salmon et al. 2011) applied to a counter made of the halo,
+// the galaxy and the number of the draw, under a key made of the tree file and the
+// tree. The same draw of the same galaxy therefore always gives the same number, no
+// matter which thread, task or order the trees and FoF groups are done in, and a new
+// tree needs no seeding at all.
+//
+// A galaxy is identified by its BirthHalo, the halo init_galaxy() created it in. Only
+// one galaxy is ever created per halo, and the number is set at creation and carried
+// along, so it is unique within the tree and the same in every run, streamed trees
+// included. Its GalaxyNr would be neither: that is only handed out when the galaxy is
+// stored (see attach_galaxies) and comes in another order for streamed trees. The halo
+// the draw is made in tells the snapshots of a galaxy apart, and draw the draws within
+// one halo, steps included; so (file, tree, halo, BirthHalo, draw) is unique.
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u   /* golden ratio */
+#define PHILOX_W1 0xBB67AE85u   /* sqrt(3) - 1 */
+#define PHILOX_ROUNDS 10
+
+
+
+void philox4x32(const uint32_t counter[4], const uint32_t key[2], uint32_t out[4])
+{
+  uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+  uint32_t k0 = key[0], k1 = key[1];
+  uint64_t p0, p1;
+  int round;
+
+  for(round = 0; round < PHILOX_ROUNDS; round++)
+  {
+    p0 = (uint64_t) PHILOX_M0 * c0;
+    p1 = (uint64_t) PHILOX_M1 * c2;
+    c0 = (uint32_t) (p1 >> 32) ^ c1 ^ k0;
+    c1 = (uint32_t) p1;
+    c2 = (uint32_t) (p0 >> 32) ^ c3 ^ k1;
+    c3 = (uint32_t) p0;
+    k0 += PHILOX_W0;
+    k1 += PHILOX_W1;
+  }
+
+  out[0] = c0;
+  out[1] = c1;
+  out[2] = c2;
+  out[3] = c3;
+}
+
+
+
+// 64 random bits for draw number draw, in halo halonr of the current tree, of the
+// galaxy created in halo birthhalo (its BirthHalo)
+uint64_t random_bits(int halonr, int birthhalo, int draw, const struct tree_context *ctx)
+{
+  uint32_t counter[4], key[2], out[4];
+
+  counter[0] = (uint32_t) halonr;
+  counter[1] = (uint32_t) birthhalo;
+  counter[2] = (uint32_t) draw;
+  counter[3] = 0;
+  key[0] = (uint32_t) ctx->FileNum;
+  key[1] = (uint32_t) ctx->TreeID;
+  philox4x32(counter, key, out);
+
+  return ((uint64_t) out[0] << 32) | out[1];
+}
+
+
+
+// uniform in (0, 1), never exactly 0 or 1
+double random_uniform(int halonr, int birthhalo, int draw, const struct tree_context *ctx)
+{
+  return ((random_bits(halonr, birthhalo, draw, ctx) >> 11) + 0.5) * (1.0 / 9007199254740992.0);   // 2^53
+}
+
+#undef PHILOX_M0
+#undef PHILOX_M1
+#undef PHILOX_W0
+#undef PHILOX_W1
+#undef PHILOX_ROUNDS
@@ -15,7 +15,10 @@ void read_parameter_file(char *fname)
   int i, j, done;
   int errorFlag = 0;
   int *used_tag = 0;
-  char my_treetype[MAX_STRING_LEN];
+  int optional_tag[MAXTAGS] = { 0 };
+  int seen_tag[MAXTAGS] = { 0 };
+  static char my_treetype[MAX_STRING_LEN];  // ParamAddr keeps pointing here after we return
+  static char my_outputformat[MAX_STRING_LEN];
   NParam = 0;
 
 #ifdef MPI
@@ -179,9 +182,119 @@ void read_parameter_file(char *fname)
   ParamAddr[NParam] = &NOUT;
   ParamID[NParam++] = INT;
 
+  // Optional parameters: the value assigned here is kept when the tag is not in the file
+
+  OutputBufferSize = 4.0;
+  strcpy(ParamTag[NParam], "OutputBufferSize");
+  ParamAddr[NParam] = &OutputBufferSize;
+  optional_tag[NParam] = 1;
+  ParamID[NParam++] = DOUBLE;
+
+  strcpy(my_outputformat, "sage_binary");
+  strcpy(ParamTag[NParam], "OutputFormat");
+  ParamAddr[NParam] = my_outputformat;
+  optional_tag[NParam] = 1;
+  ParamID[NParam++] = STRING;
+
+  strcpy(OutputFields, "all");
+  strcpy(ParamTag[NParam], "OutputFields");
+  ParamAddr[NParam] = OutputFields;
+  optional_tag[NParam] = 1;
+  ParamID[NParam++] = STRING;
+
+  CatalogOutput = 1;
+  strcpy(ParamTag[NParam], "CatalogOutput");
+  ParamAddr[NParam] = &CatalogOutput;
+  optional_tag[NParam] = 1;
+  ParamID[NParam++] = INT;
+
+  GalaxyStats = 0;
+  strcpy(ParamTag[NParam], "GalaxyStats");
+  ParamAddr[NParam] = &GalaxyStats;
+  optional_tag[NParam] = 1;
+  ParamID[NParam++] = INT;
+
+  HistoryOutput = 0;
+  strcpy(ParamTag[NParam], "HistoryOutput");
+  ParamAddr[NParam] = &HistoryOutput;
+  optional_tag[NParam] = 1;
+  ParamID[NParam++] = INT;
+
+  SharedOutput = 0;
+  strcpy(ParamTag[NParam], "SharedOutput");
+  ParamAddr[NParam] = &SharedOutput;
+  optional_tag[NParam] = 1;
+  ParamID[NParam++] = INT;
+
+  CheckpointEveryTrees = 0;
+  strcpy(ParamTag[NParam], "CheckpointEveryTrees");
+  ParamAddr[NParam] = &CheckpointEveryTrees;
+  optional_tag[NParam] = 1;
+  ParamID[NParam++] = INT;
+
+  CoolingTable = 0;
+  strcpy(ParamTag[NParam], "CoolingTable");
+  ParamAddr[NParam] = &CoolingTable;
+  optional_tag[NParam] = 1;
+  ParamID[NParam++] = INT;
+
+  strcpy(CoolingCacheFile, "none");
+  strcpy(ParamTag[NParam], "CoolingCacheFile");
+  ParamAddr[NParam] = CoolingCacheFile;
+  optional_tag[NParam] = 1;
+  ParamID[NParam++] = STRING;
+
+  FoFParallelMinHalos = 0;
+  strcpy(ParamTag[NParam], "FoFParallelMinHalos");
+  ParamAddr[NParam] = &FoFParallelMinHalos;
+  optional_tag[NParam] = 1;
+  ParamID[NParam++] = INT;
+
+  strcpy(SweepFile, "none");
+  strcpy(ParamTag[NParam], "SweepFile");
+  ParamAddr[NParam] = SweepFile;
+  optional_tag[NParam] = 1;
+  ParamID[NParam++] = STRING;
+
+  StreamTreesMinHalos = 0;
+  strcpy(ParamTag[NParam], "StreamTreesMinHalos");
+  ParamAddr[NParam] = &StreamTreesMinHalos;
+  optional_tag[NParam] = 1;
+  ParamID[NParam++] = INT;
+
+  TreeOrder = 0;
+  strcpy(ParamTag[NParam], "TreeOrder");
+  ParamAddr[NParam] = &TreeOrder;
+  optional_tag[NParam] = 1;
+  ParamID[NParam++] = INT;
+
+  TreeOrderWindow = 1000;
+  strcpy(ParamTag[NParam], "TreeOrderWindow");
+  ParamAddr[NParam] = &TreeOrderWindow;
+  optional_tag[NParam] = 1;
+  ParamID[NParam++] = INT;
+
+  HDF5Output = 0;
+  strcpy(ParamTag[NParam], "HDF5Output");
+  ParamAddr[NParam] = &HDF5Output;
+  optional_tag[NParam] = 1;
+  ParamID[NParam++] = INT;
+
+  HDF5ChunkSize = 8192;
+  strcpy(ParamTag[NParam], "HDF5ChunkSize");
+  ParamAddr[NParam] = &HDF5ChunkSize;
+  optional_tag[NParam] = 1;
+  ParamID[NParam++] = INT;
+
+  HDF5Compression = 0;
+  strcpy(ParamTag[NParam], "HDF5Compression");
+  ParamAddr[NParam] = &HDF5Compression;
+  optional_tag[NParam] = 1;
+  ParamID[NParam++] = INT;
+
   used_tag = mymalloc(sizeof(int) * NParam);
   for(i=0; i<NParam; i++)
-    used_tag[i]=1;
+    used_tag[i] = !optional_tag[i];
 
   fd = fopen(fname, "r");
   if (fd == NULL) {
@@ -194,7 +307,7 @@ void read_parameter_file(char *fname)
     while(!feof(fd))
       {
 	*buf = 0;
-	fgets(buf, 200, fd);
+	fgets(buf, MAX_STRING_LEN, fd);  // long enough for a list of OutputFields
 	if(sscanf(buf, "%s%s%s", buf1, buf2, buf3) < 2)
 	  continue;
 	
@@ -202,10 +315,10 @@ void read_parameter_file(char *fname)
 	  continue;
 	
 	for(i = 0, j = -1; i < NParam; i++)
-	  if(strcmp(buf1, ParamTag[i]) == 0)
+	  if(!seen_tag[i] && strcmp(buf1, ParamTag[i]) == 0)
 	    {
 	      j = i;
-	      ParamTag[i][0] = 0;
+	      seen_tag[i] = 1;  // the tag names are kept, they are stored with the HDF5 output
 	      used_tag[i] = 0;
 	      break;
 	    }
@@ -309,7 +422,7 @@ void read_parameter_file(char *fname)
     }
   
   // Check file type is valid. 
-  if (strncmp(my_treetype, "lhalo_binary", 511) != 0) // strncmp returns 0 if the two strings are equal. Only available options are HDF5 or binary files. 
+  if (strncmp(my_treetype, "lhalo_binary", 511) != 0 && strncmp(my_treetype, "lhalo_binary_mmap", 511) != 0) // strncmp returns 0 if the two strings are equal. Only available options are HDF5 or binary files. 
   {
     snprintf(TreeExtension, 511, ".hdf5");
 #ifndef HDF5
@@ -329,12 +442,113 @@ void read_parameter_file(char *fname)
   {
     TreeType = lhalo_binary;
   }
+  else if (strcasecmp(my_treetype, "lhalo_binary_mmap") == 0)
+  {
+    TreeType = lhalo_binary_mmap;
+  }
   else
   {
     fprintf(stderr, "TreeType %s is not supported\n", my_treetype);
     ABORT(0);
   }
 
+  if (strcasecmp(my_outputformat, "sage_binary") == 0)
+  {
+    OutputFormat = sage_binary;
+  }
+  else if (strcasecmp(my_outputformat, "sage_columns") == 0)
+  {
+    OutputFormat = sage_columns;
+  }
+  else
+  {
+    fprintf(stderr, "OutputFormat %s is not supported\n", my_outputformat);
+    ABORT(0);
+  }
+
+  select_output_fields();
+
+#ifdef FIXED_RECIPES
+  if(SFprescription != FIXED_SF || AGNrecipeOn != FIXED_AGN || SupernovaRecipeOn != FIXED_SN
+     || ReionizationOn != FIXED_REIONIZATION || DiskInstabilityOn != FIXED_DISK_INSTABILITY)
+  {
+    fprintf(stderr, "This build has the recipes compiled in as SFprescription %d, AGNrecipeOn %d, SupernovaRecipeOn %d, ReionizationOn %d, DiskInstabilityOn %d.\n",
+            FIXED_SF, FIXED_AGN, FIXED_SN, FIXED_REIONIZATION, FIXED_DISK_INSTABILITY);
+    fprintf(stderr, "Please set the same values in the parameter file, or rebuild with a different RECIPES.\n");
+    ABORT(1);
+  }
+#endif
+
+  if(HistoryOutput && StreamTreesMinHalos > 0)
+  {
+    fprintf(stderr, "HistoryOutput needs the whole tree at once, it can't be used with StreamTreesMinHalos\n");
+    ABORT(0);
+  }
+
+  if(TreeOrder < 0 || TreeOrder > 2)
+  {
+    fprintf(stderr, "TreeOrder must be 0 (trees in file order), 1 (the most expensive first) or 2 (only write the schedules)\n");
+    ABORT(0);
+  }
+
+  if(TreeOrder > 0 && (StreamTreesMinHalos > 0 || HistoryOutput))
+  {
+    fprintf(stderr, "TreeOrder keeps the galaxies of a tree until the trees before it are written, it can't be used with StreamTreesMinHalos or HistoryOutput\n");
+    ABORT(0);
+  }
+
+  if(TreeOrderWindow < 0)
+  {
+    fprintf(stderr, "TreeOrderWindow must be 0 (no limit) or a number of trees\n");
+    ABORT(0);
+  }
+
+  if(TreeOrder == 1 && TreeOrderWindow == 0 && CheckpointEveryTrees > 0)
+    printf("Warning: with TreeOrder 1 and TreeOrderWindow 0 the checkpoints only get as far as the trees written in tree order, often not past the start of a file\n");
+
+  if(!CatalogOutput && (HDF5Output || SharedOutput || HistoryOutput))
+  {
+    fprintf(stderr, "CatalogOutput 0 writes no galaxy files, please switch HDF5Output, SharedOutput and HistoryOutput off\n");
+    ABORT(0);
+  }
+
+  if(!CatalogOutput && !GalaxyStats && strcmp(SweepFile, "none") == 0)
+  {
+    fprintf(stderr, "CatalogOutput 0 without GalaxyStats 1 would write nothing at all\n");
+    ABORT(0);
+  }
+
+  if(strcmp(SweepFile, "none") != 0 && (HDF5Output || SharedOutput || HistoryOutput))
+  {
+    fprintf(stderr, "A parameter sweep (SweepFile) writes no galaxy files, please switch HDF5Output, SharedOutput and HistoryOutput off\n");
+    ABORT(0);
+  }
+
+  if(SharedOutput && HDF5Output)
+  {
+    fprintf(stderr, "SharedOutput collects the binary galaxy files, it can't be used with HDF5Output\n");
+    ABORT(0);
+  }
+
+  if(HDF5Output)
+  {
+    if(OutputFormat != sage_binary)
+    {
+      fprintf(stderr, "HDF5Output writes its own tables, please leave OutputFormat at sage_binary\n");
+      ABORT(0);
+    }
+#ifndef HDF5
+    fprintf(stderr, "You have asked for HDF5 output but have not compiled with the HDF5 option enabled.\n");
+    fprintf(stderr, "Please check your parameter file and compiler options.\n");
+    ABORT(0);
+#endif
+    if(HDF5ChunkSize < 1)
+    {
+      fprintf(stderr, "HDF5ChunkSize = %d must be at least one galaxy\n", HDF5ChunkSize);
+      ABORT(1);
+    }
+  }
+
   myfree(used_tag);
   
 }
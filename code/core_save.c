@@ -3,24 +3,47 @@
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#include <unistd.h>
 #include <assert.h>
 
 #include "core_allvars.h"
 #include "core_proto.h"
 
+#ifdef HDF5
+#include "io/io_save_hdf5.h"
+#endif
+
 #define TREE_MUL_FAC        (1000000000LL)
 #define FILENR_MUL_FAC      (1000000000000000LL)
 
 // keep a static file handle to remove the need to do constant seeking.
 FILE* save_fd[ABSOLUTEMAXSNAPS] = { 0 };
 
-
-void save_galaxies(int filenr, int tree)
+// galaxies are collected per output snapshot and written in large blocks;
+// the buffers live for the whole file and are flushed when full or at the end.
+static struct GALAXY_OUTPUT *OutputBuffer[ABSOLUTEMAXSNAPS] = { 0 };
+static int OutputBufferCount[ABSOLUTEMAXSNAPS];
+static int OutputBufferLength = 0;   /* galaxies per buffer */
+static char *ColumnScratch = NULL;   /* one property of a full buffer, for the sage_columns format */
+
+// with SharedOutput the galaxy file of a snapshot is built in memory and then
+// written into the shared file of that snapshot (core_save_shared.c)
+static char *SharedBlock[ABSOLUTEMAXSNAPS];
+static size_t SharedBlockSize[ABSOLUTEMAXSNAPS];
+
+static void open_galaxy_file(int filenr, int n);
+static void setup_output_buffer(int n);
+static void flush_output_buffer(int n);
+static void write_column_descriptors(int n);
+static void write_column_block(int n);
+
+
+// Numbers the galaxies of a tree within the output of their snapshot: returns the place
+// of every galaxy (-1 if it is not written, malloc'd) and fills the number per output
+// snapshot and the output snapshot of every snapshot (-1 if none).
+static int *number_output_galaxies(int NumGals, const struct GALAXY *HaloGal, int *OutputGalCount, int *OutputSnapIndex)
 {
-  char buf[MAX_STRING_LEN];
-  int i, n;
-  struct GALAXY_OUTPUT galaxy_output = {0};
-  int OutputGalCount[MAXSNAPS], *OutputGalOrder, nwritten;
+  int i, n, *OutputGalOrder;
 
   OutputGalOrder = (int*)malloc( NumGals*sizeof(int) );
   if(OutputGalOrder == NULL) {
@@ -30,77 +53,74 @@ void save_galaxies(int filenr, int tree)
 
   // reset the output galaxy count and order
   for(i = 0; i < MAXSNAPS; i++)
+  {
     OutputGalCount[i] = 0;
+    OutputSnapIndex[i] = -1;
+  }
   for(i = 0; i < NumGals; i++)
     OutputGalOrder[i] = -1;
+
+  for(n = 0; n < NOUT; n++)
+    OutputSnapIndex[ListOutputSnaps[n]] = n;
   
   // first update mergeIntoID to point to the correct galaxy in the output
-  for(n = 0; n < NOUT; n++)
+  for(i = 0; i < NumGals; i++)
+  {
+    n = OutputSnapIndex[HaloGal[i].SnapNum];
+    if(n >= 0)
     {
-      for(i = 0; i < NumGals; i++)
-	{
-	  if(HaloGal[i].SnapNum == ListOutputSnaps[n])
-	    {
-	      OutputGalOrder[i] = OutputGalCount[n];
-	      OutputGalCount[n]++;
-	    }
-	}
+      OutputGalOrder[i] = OutputGalCount[n];
+      OutputGalCount[n]++;
     }
+  }
+
+  return OutputGalOrder;
+}
+
+
+
+void save_galaxies(int filenr, int tree, struct tree_context *ctx)
+{
+  int i, n;
+  int NumGals = ctx->NumGals;
+  struct GALAXY *HaloGal = ctx->HaloGal;
+  int OutputGalCount[MAXSNAPS], *OutputGalOrder, OutputSnapIndex[MAXSNAPS];
+
+  if(GalaxyStats)
+    add_galaxy_stats(0, 0, NumGals, ctx);
+  if(!CatalogOutput)
+    return;
+
+  OutputGalOrder = number_output_galaxies(NumGals, HaloGal, OutputGalCount, OutputSnapIndex);
   
+  // the histories also need the slots that the galaxies merged into
+  if(HistoryOutput)
+    save_galaxy_history(filenr, tree, OutputGalOrder, ctx);
+
   for(i = 0; i < NumGals; i++)
     if(HaloGal[i].mergeIntoID > -1)
       HaloGal[i].mergeIntoID = OutputGalOrder[HaloGal[i].mergeIntoID];    
   
-  // now prepare and write galaxies
+  // only open the files if they are not already open.
   for(n = 0; n < NOUT; n++)
+    if( !OutputBuffer[n] )
+      open_galaxy_file(filenr, n);
+
+  // now prepare the galaxies straight into the buffer of their output snapshot
+  for(i = 0; i < NumGals; i++)
   {
-      // only open the file if it is not already open.
-      if( !save_fd[n] )
-	    {
-        snprintf(buf, MAX_STRING_LEN - 1, "%s/%s_z%1.3f_%d", OutputDir, FileNameGalaxies, ZZ[ListOutputSnaps[n]], filenr);
-       
-        save_fd[n] = fopen(buf, "r+");
-        if (save_fd[n] == NULL) 
-        {
-          fprintf(stderr, "can't open file `%s'\n", buf);
-          ABORT(0);
-        }
-        
-        // write out placeholders for the header data.
-        size_t size = (Ntrees + 2)*sizeof(int); /* Extra two inegers are for saving the total number of trees and total number of galaxies in this file */
-        int* tmp_buf = (int*)malloc( size );
-        if (tmp_buf == NULL)
-        {
-          fprintf(stderr, "Error: Could not allocate memory for header information for file %d\n", n);
-          ABORT(10);
-        }
-
-        memset( tmp_buf, 0, size );
-        nwritten = fwrite( tmp_buf, sizeof(int), Ntrees + 2, save_fd[n] );
-        if (nwritten != Ntrees + 2)
-        {
-          fprintf(stderr, "Error: Failed to write out %d elements for header information for file %d.  Only wrote %d elements.\n", Ntrees + 2, n, nwritten);
-        }
-        free( tmp_buf );
-	    }
-      
-      for(i = 0; i < NumGals; i++)
-	    {
-        if(HaloGal[i].SnapNum == ListOutputSnaps[n])
-	      {        
-          prepare_galaxy_for_output(filenr, tree, &HaloGal[i], &galaxy_output);
-   
-          nwritten = myfwrite(&galaxy_output, sizeof(struct GALAXY_OUTPUT), 1, save_fd[n]);
-          if (nwritten != 1)
-          {
-            fprintf(stderr, "Error: Failed to write out the galaxy struct for galaxy %d within file %d.  Meant to write 1 element but only wrote %d elements.\n", i, n, nwritten); 
-          }
-          
-          TotGalaxies[n]++;
-          TreeNgals[n][tree]++;	      
-	      }
-	    }
-      
+    n = OutputSnapIndex[HaloGal[i].SnapNum];
+    if(n < 0)
+      continue;
+
+    if(OutputBufferCount[n] == OutputBufferLength)
+      flush_output_buffer(n);
+
+    prepare_galaxy_for_output(filenr, tree, &HaloGal[i], &ctx->HaloGalHistory[i], &OutputBuffer[n][OutputBufferCount[n]], ctx);
+    OutputBufferCount[n]++;
+
+    TotGalaxies[n]++;
+    TreeNgals[n][tree]++;	      
   }
 
   // don't forget to free the workspace.
@@ -110,9 +130,423 @@ void save_galaxies(int filenr, int tree)
 
 
 
-void prepare_galaxy_for_output(int filenr, int tree, struct GALAXY *g, struct GALAXY_OUTPUT *o)
+// Writes the galaxies in slots GalBase ... last - 1 of a tree that is streamed (see
+// stream_tree_galaxies), whose descendants are all done. The slots of every snapshot
+// follow each other from SnapFirstSlot[snap] on, in the order a normal run stores them,
+// so a slot's place in the output is its distance from the first slot of the snapshot.
+void save_streamed_galaxies(int filenr, int tree, int last, const int *SnapFirstSlot, struct tree_context *ctx)
+{
+  int i, n, OutputSnapIndex[MAXSNAPS];
+  struct GALAXY *g;
+
+  if(GalaxyStats)
+    add_galaxy_stats(0, ctx->GalBase, last, ctx);
+  if(!CatalogOutput)
+    return;
+
+  for(i = 0; i < MAXSNAPS; i++)
+    OutputSnapIndex[i] = -1;
+  for(n = 0; n < NOUT; n++)
+    OutputSnapIndex[ListOutputSnaps[n]] = n;
+
+  for(n = 0; n < NOUT; n++)
+    if( !OutputBuffer[n] )
+      open_galaxy_file(filenr, n);
+
+  for(i = ctx->GalBase; i < last; i++)
+  {
+    g = &ctx->HaloGal[i - ctx->GalBase];
+    n = OutputSnapIndex[g->SnapNum];
+    if(n < 0)
+      continue;
+
+    if(g->mergeIntoID > -1)
+      g->mergeIntoID = OutputSnapIndex[g->mergeIntoSnapNum] >= 0 ? g->mergeIntoID - SnapFirstSlot[g->mergeIntoSnapNum] : -1;
+
+    if(OutputBufferCount[n] == OutputBufferLength)
+      flush_output_buffer(n);
+
+    prepare_galaxy_for_output(filenr, tree, g, &ctx->HaloGalHistory[i - ctx->GalBase], &OutputBuffer[n][OutputBufferCount[n]], ctx);
+    OutputBufferCount[n]++;
+
+    TotGalaxies[n]++;
+    TreeNgals[n][tree]++;
+  }
+}
+
+
+
+// With TreeOrder the trees are not evolved in the order their galaxies are written.
+// A tree that is done converts its galaxies into output records at once, in the
+// thread that evolved it, and they wait here until all trees before it are written.
+struct staged_galaxies
+{
+  struct galaxy_stats_tally *stats;   /* with GalaxyStats, added when the tree is written */
+  struct GALAXY_OUTPUT *gal;   /* those of output snapshot 0, then of 1, ... */
+  int count[];                 /* galaxies of every output snapshot */
+};
+
+
+
+struct staged_galaxies *stage_galaxies(int filenr, int tree, struct tree_context *ctx)
+{
+  int i, n, first[ABSOLUTEMAXSNAPS], total = 0;
+  int NumGals = ctx->NumGals;
+  struct GALAXY *HaloGal = ctx->HaloGal;
+  int OutputGalCount[MAXSNAPS], *OutputGalOrder, OutputSnapIndex[MAXSNAPS];
+  struct staged_galaxies *s;
+
+  if(!(s = calloc(1, sizeof(struct staged_galaxies) + NOUT * sizeof(int))))
+  {
+    fprintf(stderr, "Error: Could not allocate memory for the galaxies of tree %d\n", tree);
+    ABORT(10);
+  }
+  if(GalaxyStats)
+    s->stats = tally_galaxy_stats(0, 0, NumGals, ctx);
+  if(!CatalogOutput)
+    return s;
+
+  OutputGalOrder = number_output_galaxies(NumGals, HaloGal, OutputGalCount, OutputSnapIndex);
+
+  for(i = 0; i < NumGals; i++)
+    if(HaloGal[i].mergeIntoID > -1)
+      HaloGal[i].mergeIntoID = OutputGalOrder[HaloGal[i].mergeIntoID];
+
+  for(n = 0; n < NOUT; n++)
+  {
+    s->count[n] = OutputGalCount[n];
+    first[n] = total;
+    total += s->count[n];
+  }
+
+  // calloc, the padding of the records is zero in the files as well
+  if(!(s->gal = calloc(total > 0 ? total : 1, sizeof(struct GALAXY_OUTPUT))))
+  {
+    fprintf(stderr, "Error: Could not allocate memory for the %d galaxies of tree %d\n", total, tree);
+    ABORT(10);
+  }
+
+  for(i = 0; i < NumGals; i++)
+  {
+    n = OutputSnapIndex[HaloGal[i].SnapNum];
+    if(n >= 0)
+      prepare_galaxy_for_output(filenr, tree, &HaloGal[i], &ctx->HaloGalHistory[i], &s->gal[first[n] + OutputGalOrder[i]], ctx);
+  }
+
+  free( OutputGalOrder );
+
+  return s;
+}
+
+
+
+// writes the staged galaxies of a tree, once those of all trees before it are written, and frees them
+void save_staged_galaxies(int filenr, int tree, struct staged_galaxies *s)
+{
+  int k, n;
+  struct GALAXY_OUTPUT *o = s->gal;
+
+  if(s->stats)
+  {
+    add_galaxy_stats_tally(s->stats);
+    s->stats = NULL;
+  }
+
+  for(n = 0; n < NOUT && CatalogOutput; n++)
+  {
+    if( !OutputBuffer[n] )
+      open_galaxy_file(filenr, n);
+
+    for(k = 0; k < s->count[n]; k++, o++)
+    {
+      if(OutputBufferCount[n] == OutputBufferLength)
+        flush_output_buffer(n);
+
+      OutputBuffer[n][OutputBufferCount[n]++] = *o;
+    }
+
+    TotGalaxies[n] += s->count[n];
+    TreeNgals[n][tree] += s->count[n];
+  }
+
+  free_staged_galaxies(s);
+}
+
+
+
+void free_staged_galaxies(struct staged_galaxies *s)
+{
+  free(s->stats);
+  free(s->gal);
+  free(s);
+}
+
+
+
+static void open_binary_galaxy_file(int filenr, int n)
+{
+  char buf[MAX_STRING_LEN];
+  int nwritten;
+
+  snprintf(buf, MAX_STRING_LEN - 1, "%s/%s_z%1.3f_%d", OutputDir, FileNameGalaxies, ZZ[ListOutputSnaps[n]], filenr);
+       
+  if(SharedOutput)
+    save_fd[n] = open_memstream(&SharedBlock[n], &SharedBlockSize[n]);
+  else
+    save_fd[n] = fopen(buf, "w");
+  if (save_fd[n] == NULL) 
+  {
+    fprintf(stderr, "can't open file `%s'\n", buf);
+    ABORT(0);
+  }
+        
+  // write out placeholders for the header data.
+  size_t size = (Ntrees + 2)*sizeof(int); /* Extra two inegers are for saving the total number of trees and total number of galaxies in this file */
+  int* tmp_buf = (int*)malloc( size );
+  if (tmp_buf == NULL)
+  {
+    fprintf(stderr, "Error: Could not allocate memory for header information for file %d\n", n);
+    ABORT(10);
+  }
+
+  memset( tmp_buf, 0, size );
+  nwritten = fwrite( tmp_buf, sizeof(int), Ntrees + 2, save_fd[n] );
+  if (nwritten != Ntrees + 2)
+  {
+    fprintf(stderr, "Error: Failed to write out %d elements for header information for file %d.  Only wrote %d elements.\n", Ntrees + 2, n, nwritten);
+  }
+  free( tmp_buf );
+}
+
+
+
+static void open_galaxy_file(int filenr, int n)
+{
+#ifdef HDF5
+  // one HDF5 file holds the tables of all output snapshots
+  if(HDF5Output)
+  {
+    if(n == 0)
+    {
+#ifdef OPENMP
+#pragma omp critical (tree_io)
+#endif
+      prep_hdf5_file(filenr);
+    }
+  }
+  else
+#endif
+  {
+    open_binary_galaxy_file(filenr, n);
+    if(OutputFormat == sage_columns)
+      write_column_descriptors(n);
+  }
+
+  setup_output_buffer(n);
+}
+
+
+
+// Puts the galaxy files of a checkpointed tree file back where the checkpoint left them.
+// Whatever a killed run wrote after the checkpoint is cut off, so the galaxies of the
+// following trees are appended exactly as if the run had never stopped.
+void resume_galaxy_files(int filenr, const int64_t *offset)
+{
+  char buf[MAX_STRING_LEN];
+  int n;
+
+  for(n = 0; n < NOUT; n++)
+  {
+    path_printf(buf, MAX_STRING_LEN, "%s/%s_z%1.3f_%d", OutputDir, FileNameGalaxies, ZZ[ListOutputSnaps[n]], filenr);
+
+    save_fd[n] = fopen(buf, "r+");
+    if (save_fd[n] == NULL)
+    {
+      fprintf(stderr, "can't open file `%s' to resume it\n", buf);
+      ABORT(0);
+    }
+
+    if(ftruncate(fileno(save_fd[n]), (off_t) offset[n]) != 0 || fseeko(save_fd[n], (off_t) offset[n], SEEK_SET) != 0)
+    {
+      fprintf(stderr, "Error: Could not go back to byte %lld of file `%s'\n", (long long) offset[n], buf);
+      ABORT(0);
+    }
+
+    setup_output_buffer(n);
+  }
+}
+
+
+
+// writes out the buffered galaxies and returns how far each galaxy file has got
+void sync_galaxy_files(int64_t *offset)
+{
+  int n;
+
+  wait_output_writer();
+
+  for(n = 0; n < NOUT; n++)
+  {
+    assert( save_fd[n] );
+
+    flush_output_buffer(n);
+    if(fflush(save_fd[n]) != 0)
+    {
+      fprintf(stderr, "Error: Could not write out the galaxies of output snapshot %d\n", n);
+      ABORT(0);
+    }
+    offset[n] = (int64_t) ftello(save_fd[n]);
+  }
+}
+
+
+
+static void setup_output_buffer(int n)
+{
+  // set up the staging buffer; calloc keeps the struct padding zeroed just like the records written before
+  if(OutputBuffer[n] == NULL)
+  {
+    OutputBufferLength = (int) (OutputBufferSize * 1024.0 * 1024.0 / sizeof(struct GALAXY_OUTPUT));
+    if(OutputBufferLength < 1)
+      OutputBufferLength = 1;
+
+    OutputBuffer[n] = calloc(OutputBufferLength, sizeof(struct GALAXY_OUTPUT));
+    if(OutputBuffer[n] == NULL)
+    {
+      fprintf(stderr, "Error: Could not allocate %g MB for the output buffer of file %d\n", OutputBufferSize, n);
+      ABORT(10);
+    }
+  }
+  if(OutputFormat == sage_columns && ColumnScratch == NULL)
+  {
+    ColumnScratch = malloc((size_t) OutputBufferLength * 3 * sizeof(float));  // the widest properties are the 3-vectors
+    if(ColumnScratch == NULL)
+    {
+      fprintf(stderr, "Error: Could not allocate the column buffer of file %d\n", n);
+      ABORT(10);
+    }
+  }
+  OutputBufferCount[n] = 0;
+}
+
+
+
+// The sage_columns format has the same header as sage_binary (Ntrees, TotGalaxies,
+// TreeNgals[Ntrees]), followed by the number of properties stored and one 40 byte
+// descriptor per property: its name (char[32]), numpy-style type code (char[4]:
+// "i4", "i8" or "f4") and the number of elements per galaxy (int).
+// Then come blocks of galaxies, one per flush of the staging buffer: the number
+// of galaxies in the block (int) and, property after property, the contiguous
+// array of their values. A block holds at most OutputBufferSize MB worth of
+// GALAXY_OUTPUT records (18078 galaxies with the default 4 MB), so the snapshot of
+// a production tree file takes many blocks, and a reader has to walk all of them
+// until it has TotGalaxies.
+static void write_column_descriptors(int n)
+{
+  int i, count;
+  char name[32], dtype[4];
+
+  myfwrite(&NOutputFields, sizeof(int), 1, save_fd[n]);
+
+  for(i = 0; i < NOutputFields; i++)
+  {
+    memset(name, 0, sizeof(name));
+    memset(dtype, 0, sizeof(dtype));
+    strncpy(name, OutputField[i]->name, sizeof(name) - 1);
+
+    switch (OutputField[i]->type)
+    {
+      case output_int32:
+        strcpy(dtype, "i4");
+        count = OutputField[i]->size / 4;
+        break;
+      case output_int64:
+        strcpy(dtype, "i8");
+        count = OutputField[i]->size / 8;
+        break;
+      default:
+        strcpy(dtype, "f4");
+        count = OutputField[i]->size / 4;
+        break;
+    }
+
+    myfwrite(name, sizeof(name), 1, save_fd[n]);
+    myfwrite(dtype, sizeof(dtype), 1, save_fd[n]);
+    myfwrite(&count, sizeof(int), 1, save_fd[n]);
+  }
+}
+
+
+
+static void write_column_block(int n)
+{
+  int i, k, nwritten;
+  int ngals = OutputBufferCount[n];
+  const char *rec = (const char *) OutputBuffer[n];
+
+  myfwrite(&ngals, sizeof(int), 1, save_fd[n]);
+
+  for(i = 0; i < NOutputFields; i++)
+  {
+    size_t offset = OutputField[i]->offset, size = OutputField[i]->size;
+
+    for(k = 0; k < ngals; k++)
+      memcpy(ColumnScratch + k * size, rec + k * sizeof(struct GALAXY_OUTPUT) + offset, size);
+
+    nwritten = myfwrite(ColumnScratch, size, ngals, save_fd[n]);
+    if (nwritten != ngals)
+    {
+      fprintf(stderr, "Error: Failed to write out %d values of %s within file %d.  Only wrote %d elements.\n", ngals, OutputField[i]->name, n, nwritten);
+    }
+  }
+}
+
+
+
+static void flush_output_buffer(int n)
+{
+  int nwritten;
+
+  if(OutputBufferCount[n] == 0)
+    return;
+
+#ifdef HDF5
+  if(HDF5Output)
+  {
+    // the library is not re-entrant and other threads may be reading HDF5 trees
+#ifdef OPENMP
+#pragma omp critical (tree_io)
+#endif
+    write_hdf5_galaxies(n, OutputBuffer[n], OutputBufferCount[n]);
+    OutputBufferCount[n] = 0;
+    return;
+  }
+#endif
+
+  if(OutputFormat == sage_columns)
+  {
+    write_column_block(n);
+    OutputBufferCount[n] = 0;
+    return;
+  }
+
+  nwritten = myfwrite(OutputBuffer[n], sizeof(struct GALAXY_OUTPUT), OutputBufferCount[n], save_fd[n]);
+  if (nwritten != OutputBufferCount[n])
+  {
+    fprintf(stderr, "Error: Failed to write out %d galaxy structs within file %d.  Only wrote %d elements.\n", OutputBufferCount[n], n, nwritten); 
+  }
+
+  OutputBufferCount[n] = 0;
+}
+
+
+
+void prepare_galaxy_for_output(int filenr, int tree, struct GALAXY *g, struct GALAXY_HISTORY *h, struct GALAXY_OUTPUT *o, struct tree_context *ctx)
 {
   int j, step;
+  struct halo_data *Halo = ctx->Halo;
+  struct halo_aux_data *HaloAux = ctx->HaloAux;
+  struct GALAXY *HaloGal = ctx->HaloGal;
 
   o->SnapNum = g->SnapNum;
   o->Type = g->Type;
@@ -127,7 +561,7 @@ void prepare_galaxy_for_output(int filenr, int tree, struct GALAXY *g, struct GA
       assert( (o->GalaxyIndex - g->GalaxyNr - TREE_MUL_FAC*tree)/(FILENR_MUL_FAC/10) == filenr );
       assert( (o->GalaxyIndex - g->GalaxyNr -(FILENR_MUL_FAC/10)*filenr) / TREE_MUL_FAC == tree );
       assert( o->GalaxyIndex - TREE_MUL_FAC*tree - (FILENR_MUL_FAC/10)*filenr == g->GalaxyNr );
-      o->CentralGalaxyIndex = HaloGal[HaloAux[Halo[g->HaloNr].FirstHaloInFOFgroup].FirstGalaxy].GalaxyNr + TREE_MUL_FAC * tree + (FILENR_MUL_FAC/10) * filenr;
+      o->CentralGalaxyIndex = HaloGal[HaloAux[Halo[g->HaloNr].FirstHaloInFOFgroup].FirstGalaxy - ctx->GalBase].GalaxyNr + TREE_MUL_FAC * tree + (FILENR_MUL_FAC/10) * filenr;
   }
   else
   {
@@ -137,7 +571,7 @@ void prepare_galaxy_for_output(int filenr, int tree, struct GALAXY *g, struct GA
       assert( (o->GalaxyIndex - g->GalaxyNr - TREE_MUL_FAC*tree)/FILENR_MUL_FAC == filenr );
       assert( (o->GalaxyIndex - g->GalaxyNr -FILENR_MUL_FAC*filenr) / TREE_MUL_FAC == tree );
       assert( o->GalaxyIndex - TREE_MUL_FAC*tree - FILENR_MUL_FAC*filenr == g->GalaxyNr );
-      o->CentralGalaxyIndex = HaloGal[HaloAux[Halo[g->HaloNr].FirstHaloInFOFgroup].FirstGalaxy].GalaxyNr + TREE_MUL_FAC * tree + FILENR_MUL_FAC * filenr;
+      o->CentralGalaxyIndex = HaloGal[HaloAux[Halo[g->HaloNr].FirstHaloInFOFgroup].FirstGalaxy - ctx->GalBase].GalaxyNr + TREE_MUL_FAC * tree + FILENR_MUL_FAC * filenr;
   }
     
   o->SAGEHaloIndex = g->HaloNr;
@@ -158,9 +592,9 @@ void prepare_galaxy_for_output(int filenr, int tree, struct GALAXY *g, struct GA
 
   o->Len = g->Len;
   o->Mvir = g->Mvir;
-  o->CentralMvir = get_virial_mass(Halo[g->HaloNr].FirstHaloInFOFgroup);
-  o->Rvir = get_virial_radius(g->HaloNr);  // output the actual Rvir, not the maximum Rvir
-  o->Vvir = get_virial_velocity(g->HaloNr);  // output the actual Vvir, not the maximum Vvir
+  o->CentralMvir = get_virial_mass(Halo[g->HaloNr].FirstHaloInFOFgroup, Halo);
+  o->Rvir = get_virial_radius(g->HaloNr, Halo);  // output the actual Rvir, not the maximum Rvir
+  o->Vvir = get_virial_velocity(g->HaloNr, Halo);  // output the actual Vvir, not the maximum Vvir
   o->Vmax = g->Vmax;
   o->VelDisp = Halo[g->HaloNr].VelDisp;
 
@@ -187,14 +621,14 @@ void prepare_galaxy_for_output(int filenr, int tree, struct GALAXY *g, struct GA
   // NOTE: in Msun/yr 
   for(step = 0; step < STEPS; step++)
   {
-    o->SfrDisk += g->SfrDisk[step] * UnitMass_in_g / UnitTime_in_s * SEC_PER_YEAR / SOLAR_MASS / STEPS;
-    o->SfrBulge += g->SfrBulge[step] * UnitMass_in_g / UnitTime_in_s * SEC_PER_YEAR / SOLAR_MASS / STEPS;
+    o->SfrDisk += h->SfrDisk[step] * UnitMass_in_g / UnitTime_in_s * SEC_PER_YEAR / SOLAR_MASS / STEPS;
+    o->SfrBulge += h->SfrBulge[step] * UnitMass_in_g / UnitTime_in_s * SEC_PER_YEAR / SOLAR_MASS / STEPS;
     
-    if(g->SfrDiskColdGas[step] > 0.0)
-      o->SfrDiskZ += g->SfrDiskColdGasMetals[step] / g->SfrDiskColdGas[step] / STEPS;
+    if(h->SfrDiskColdGas[step] > 0.0)
+      o->SfrDiskZ += h->SfrDiskColdGasMetals[step] / h->SfrDiskColdGas[step] / STEPS;
 
-    if(g->SfrBulgeColdGas[step] > 0.0)
-      o->SfrBulgeZ += g->SfrBulgeColdGasMetals[step] / g->SfrBulgeColdGas[step] / STEPS;
+    if(h->SfrBulgeColdGas[step] > 0.0)
+      o->SfrBulgeZ += h->SfrBulgeColdGasMetals[step] / h->SfrBulgeColdGas[step] / STEPS;
   }
 
   o->DiskScaleRadius = g->DiskScaleRadius;
@@ -236,12 +670,45 @@ void prepare_galaxy_for_output(int filenr, int tree, struct GALAXY *g, struct GA
 void finalize_galaxy_file(int filenr)
 {
   int n, nwritten;
+  off_t size;
+
+  // everything handed to the writer thread goes into the buffers before they are sealed
+  wait_output_writer();
+
+  if(!CatalogOutput)
+    return;
+
+  if(HistoryOutput)
+    finalize_history_file(filenr);
+
+#ifdef HDF5
+  if(HDF5Output)
+  {
+    for(n = 0; n < NOUT; n++)
+    {
+      // file must already be open.
+      assert( OutputBuffer[n] );
+
+      flush_output_buffer(n);
+      write_hdf5_attrs(n, filenr);
+
+      free( OutputBuffer[n] );
+      OutputBuffer[n] = NULL;
+    }
+    close_hdf5_galaxy_file();
+    return;
+  }
+#endif
 
   for(n = 0; n < NOUT; n++)
   {
     // file must already be open.
     assert( save_fd[n] );
 
+    // write whatever is still waiting in the buffer before going back to the header
+    flush_output_buffer(n);
+    size = ftello( save_fd[n] );
+
     // seek to the beginning.
     fseek( save_fd[n], 0, SEEK_SET );
 
@@ -265,9 +732,26 @@ void finalize_galaxy_file(int filenr)
 
 
     // close the file and clear handle after everything has been written
-    fclose( save_fd[n] );
+    if(SharedOutput)
+    {
+      // a memory stream reports only up to where it was last written, here the header,
+      // but the galaxies behind it are still in the block
+      fflush( save_fd[n] );
+      write_shared_block(filenr, n, SharedBlock[n], size);
+      fclose( save_fd[n] );
+      free( SharedBlock[n] );
+      SharedBlock[n] = NULL;
+    }
+    else
+      fclose( save_fd[n] );
     save_fd[n] = NULL;
+
+    free( OutputBuffer[n] );
+    OutputBuffer[n] = NULL;
   }
+
+  free( ColumnScratch );
+  ColumnScratch = NULL;
   
 }
 
@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "core_allvars.h"
+#include "core_proto.h"
+
+// Galaxy histories (HistoryOutput 1): every galaxy of every snapshot, not only the
+// output snapshots, in <OutputDir>/<FileNameGalaxies>_history_<filenr>:
+//
+//   int      Ntrees, number of galaxies (distinct GalaxyIndex)
+//   int64_t  number of records, byte of the tree table, byte of the galaxy table
+//   record   ...
+//   int64_t  first record of every tree, and the number of records after the last one
+//   struct history_galaxy   for every galaxy, in increasing GalaxyIndex
+//
+// The records are tree after tree, and within a tree galaxy after galaxy from its
+// first to its last snapshot, so the history of a galaxy is one read, at the record
+// its galaxy table entry points to. Each record is a struct GALAXY_OUTPUT followed by
+// the record numbers of its descendant (the same galaxy one snapshot later, or the
+// galaxy it merged into) and of its main progenitor (the same galaxy one snapshot
+// earlier), -1 for none.
+
+#define HISTORY_HEADER 32   /* bytes */
+
+struct history_record
+{
+  struct GALAXY_OUTPUT Galaxy;
+  long long Descendant;
+  long long MainProgenitor;
+};
+
+struct history_galaxy
+{
+  long long GalaxyIndex;
+  long long FirstRecord;
+  int NRecords;
+  int pad;
+};
+
+static FILE *HistoryFile = NULL;
+static long long NHistoryRecords;
+static long long *TreeFirstRecord = NULL;
+static struct history_galaxy *HistoryGalaxy = NULL;
+static int NHistoryGalaxies, MaxHistoryGalaxies;
+
+
+
+static void open_history_file(int filenr)
+{
+  char buf[MAX_STRING_LEN], header[HISTORY_HEADER];
+  int i;
+
+  path_printf(buf, MAX_STRING_LEN, "%s/%s_history_%d", OutputDir, FileNameGalaxies, filenr);
+  if(!(HistoryFile = fopen(buf, "w")))
+  {
+    fprintf(stderr, "can't open file `%s'\n", buf);
+    ABORT(0);
+  }
+
+  // the header is written once the file is complete
+  memset(header, 0, HISTORY_HEADER);
+  if(fwrite(header, HISTORY_HEADER, 1, HistoryFile) != 1)
+  {
+    fprintf(stderr, "Error: Failed to write the header of the history file `%s'\n", buf);
+    ABORT(0);
+  }
+
+  TreeFirstRecord = malloc(sizeof(long long) * (Ntrees + 1));
+  MaxHistoryGalaxies = 10000;
+  HistoryGalaxy = malloc(sizeof(struct history_galaxy) * MaxHistoryGalaxies);
+  if(TreeFirstRecord == NULL || HistoryGalaxy == NULL)
+  {
+    fprintf(stderr, "Error: Could not allocate memory for the index of the history file `%s'\n", buf);
+    ABORT(0);
+  }
+  for(i = 0; i <= Ntrees; i++)
+    TreeFirstRecord[i] = 0;
+
+  NHistoryRecords = 0;
+  NHistoryGalaxies = 0;
+}
+
+
+
+// Writes the history of every galaxy of the tree. Called by save_galaxies before the
+// mergeIntoID are turned into positions in the output snapshots; outputpos[] is that
+// position for every slot, -1 if the slot is not at an output snapshot.
+void save_galaxy_history(int filenr, int tree, const int *outputpos, struct tree_context *ctx)
+{
+  struct GALAXY *HaloGal = ctx->HaloGal, g;
+  struct history_record *rec;
+  int *first, *order, *recnr, i, j, s, nr, ngals = ctx->NumGals, ncounter = ctx->GalaxyCounter;
+
+  assert(ctx->GalBase == 0);   // the whole tree is needed, see StreamTreesMinHalos
+
+  if(HistoryFile == NULL)
+    open_history_file(filenr);
+
+  // the slots sorted by GalaxyNr; the slots of one galaxy are already in time order
+  first = malloc(sizeof(int) * (ncounter + 1));
+  order = malloc(sizeof(int) * (ngals + 1));
+  recnr = malloc(sizeof(int) * (ngals + 1));
+  rec = calloc(ngals + 1, sizeof(struct history_record));   // zero padding, as in the galaxy files
+  if(first == NULL || order == NULL || recnr == NULL || rec == NULL)
+  {
+    fprintf(stderr, "Error: Could not allocate memory for the history of the %d galaxies of tree %d\n", ngals, tree);
+    ABORT(0);
+  }
+
+  for(nr = 0; nr <= ncounter; nr++)
+    first[nr] = 0;
+  for(i = 0; i < ngals; i++)
+    first[HaloGal[i].GalaxyNr + 1]++;
+  for(nr = 1; nr <= ncounter; nr++)
+    first[nr] += first[nr - 1];
+  for(i = 0; i < ngals; i++)
+  {
+    order[first[HaloGal[i].GalaxyNr]] = i;
+    recnr[i] = first[HaloGal[i].GalaxyNr]++;
+  }
+
+  for(j = 0; j < ngals; j++)
+  {
+    s = order[j];
+    g = HaloGal[s];
+    if(g.mergeIntoID > -1)
+      g.mergeIntoID = outputpos[g.mergeIntoID];
+    prepare_galaxy_for_output(filenr, tree, &g, &ctx->HaloGalHistory[s], &rec[j].Galaxy, ctx);
+
+    rec[j].MainProgenitor = -1;
+    rec[j].Descendant = -1;
+    if(j > 0 && HaloGal[order[j - 1]].GalaxyNr == g.GalaxyNr)
+      rec[j].MainProgenitor = NHistoryRecords + j - 1;
+    if(j + 1 < ngals && HaloGal[order[j + 1]].GalaxyNr == g.GalaxyNr)
+      rec[j].Descendant = NHistoryRecords + j + 1;
+    else if(HaloGal[s].mergeType > 0 && HaloGal[s].mergeIntoID > -1)
+      rec[j].Descendant = NHistoryRecords + recnr[HaloGal[s].mergeIntoID];
+
+    if(rec[j].MainProgenitor < 0)
+    {
+      // the first record of a galaxy
+      if(NHistoryGalaxies == MaxHistoryGalaxies)
+      {
+        MaxHistoryGalaxies *= 2;
+        if(!(HistoryGalaxy = realloc(HistoryGalaxy, sizeof(struct history_galaxy) * MaxHistoryGalaxies)))
+        {
+          fprintf(stderr, "Error: Could not allocate memory for the index of %d galaxies of the history file\n", MaxHistoryGalaxies);
+          ABORT(0);
+        }
+      }
+      HistoryGalaxy[NHistoryGalaxies].GalaxyIndex = rec[j].Galaxy.GalaxyIndex;
+      HistoryGalaxy[NHistoryGalaxies].FirstRecord = NHistoryRecords + j;
+      HistoryGalaxy[NHistoryGalaxies].NRecords = 0;
+      HistoryGalaxy[NHistoryGalaxies].pad = 0;
+      NHistoryGalaxies++;
+    }
+    HistoryGalaxy[NHistoryGalaxies - 1].NRecords++;
+  }
+
+  if(myfwrite(rec, sizeof(struct history_record), ngals, HistoryFile) != (size_t) ngals)
+  {
+    fprintf(stderr, "Error: Failed to write the history of the %d galaxies of tree %d\n", ngals, tree);
+    ABORT(0);
+  }
+
+  TreeFirstRecord[tree] = NHistoryRecords;
+  NHistoryRecords += ngals;
+  for(i = tree + 1; i <= Ntrees; i++)   // trees without galaxies start where the next one does
+    TreeFirstRecord[i] = NHistoryRecords;
+
+  free(rec);
+  free(recnr);
+  free(order);
+  free(first);
+}
+
+
+
+void finalize_history_file(int filenr)
+{
+  int header[2];
+  long long offsets[3];
+  int ok;
+
+  if(HistoryFile == NULL)
+    return;
+
+  offsets[0] = NHistoryRecords;
+  offsets[1] = HISTORY_HEADER + NHistoryRecords * (long long) sizeof(struct history_record);
+  offsets[2] = offsets[1] + (Ntrees + 1) * (long long) sizeof(long long);
+  header[0] = Ntrees;
+  header[1] = NHistoryGalaxies;
+
+  ok = myfwrite(TreeFirstRecord, sizeof(long long), Ntrees + 1, HistoryFile) == (size_t) (Ntrees + 1);
+  ok = ok && myfwrite(HistoryGalaxy, sizeof(struct history_galaxy), NHistoryGalaxies, HistoryFile) == (size_t) NHistoryGalaxies;
+  ok = ok && fseek(HistoryFile, 0, SEEK_SET) == 0;
+  ok = ok && myfwrite(header, sizeof(int), 2, HistoryFile) == 2;
+  ok = ok && myfwrite(offsets, sizeof(long long), 3, HistoryFile) == 3;
+  ok = (fclose(HistoryFile) == 0) && ok;
+  HistoryFile = NULL;
+  if(!ok)
+  {
+    fprintf(stderr, "Error: Failed to write the index of the history file of tree file %d\n", filenr);
+    ABORT(0);
+  }
+
+  free(HistoryGalaxy);
+  HistoryGalaxy = NULL;
+  free(TreeFirstRecord);
+  TreeFirstRecord = NULL;
+}
+
+#undef HISTORY_HEADER
@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#ifdef MPI
+#include <mpi.h>
+#endif
+
+#include "core_allvars.h"
+#include "core_proto.h"
+
+// One galaxy file per output snapshot for the whole run (SharedOutput 1), instead of
+// one per snapshot and tree file. Each tree file still produces exactly the bytes of
+// its own sage_binary or sage_columns file, but in memory; finalize_galaxy_file()
+// then hands that block to write_shared_block(), which reserves room for it at the
+// end of the shared file and writes it there. Under MPI the end of every shared file
+// is a counter on task 0 that is advanced with MPI_Fetch_and_op, so the tasks never
+// wait for each other while the files are handed out dynamically.
+//
+// <OutputDir>/<FileNameGalaxies>_z<redshift> holds
+//
+//   int      number of tree files, LastFile - FirstFile + 1
+//   int      FirstFile
+//   int64_t  offset[number of tree files]   where the block of tree file FirstFile + i
+//                                            starts, -1 if that file was not done
+//   block    ...                             in the order the tree files were finished
+//
+// The offset table is put together from all tasks once the last file is done.
+
+#define SHARED_MAXWRITE (1 << 30)   /* bytes per write call, well inside an int */
+
+static int NSharedFiles = 0;
+static int64_t *SharedOffset[ABSOLUTEMAXSNAPS];   /* the offset table of each snapshot, this task's part */
+
+#ifdef MPI
+static MPI_File SharedFile[ABSOLUTEMAXSNAPS];
+static MPI_Win SharedEndWin;          /* end of every shared file, on task 0 */
+static int64_t *SharedEnd;
+#else
+static int SharedFile[ABSOLUTEMAXSNAPS];
+static int64_t SharedEnd[ABSOLUTEMAXSNAPS];
+#endif
+
+
+
+static void shared_file_name(char *buf, int n)
+{
+  path_printf(buf, MAX_STRING_LEN, "%s/%s_z%1.3f", OutputDir, FileNameGalaxies, ZZ[ListOutputSnaps[n]]);
+}
+
+
+
+static void write_shared_bytes(int n, int64_t offset, const char *buf, int64_t size)
+{
+  int64_t done;
+  int chunk;
+
+  for(done = 0; done < size; done += chunk)
+  {
+    chunk = size - done < SHARED_MAXWRITE ? (int) (size - done) : SHARED_MAXWRITE;
+
+#ifdef MPI
+    MPI_Status status;
+    int nwritten;
+
+    if(MPI_File_write_at(SharedFile[n], (MPI_Offset) (offset + done), (void *) (buf + done), chunk, MPI_BYTE, &status) != MPI_SUCCESS
+       || MPI_Get_count(&status, MPI_BYTE, &nwritten) != MPI_SUCCESS || nwritten != chunk)
+#else
+    if(pwrite(SharedFile[n], buf + done, chunk, (off_t) (offset + done)) != chunk)
+#endif
+    {
+      fprintf(stderr, "Error: Failed to write %d bytes at byte %lld of the shared file of output snapshot %d\n", chunk, (long long) (offset + done), n);
+      ABORT(0);
+    }
+  }
+}
+
+
+
+void open_shared_output(void)
+{
+  char buf[MAX_STRING_LEN];
+  int64_t header;
+  int n, i;
+
+  NSharedFiles = LastFile - FirstFile + 1;
+  if(NSharedFiles < 0)
+    NSharedFiles = 0;
+  header = 2 * sizeof(int) + NSharedFiles * sizeof(int64_t);
+
+  for(n = 0; n < NOUT; n++)
+  {
+    SharedOffset[n] = mymalloc(sizeof(int64_t) * NSharedFiles);
+    for(i = 0; i < NSharedFiles; i++)
+      SharedOffset[n][i] = -1;
+
+    shared_file_name(buf, n);
+#ifdef MPI
+    // start from empty files, whatever an earlier run left there
+    if(ThisTask == 0)
+      MPI_File_delete(buf, MPI_INFO_NULL);
+    MPI_Barrier(MPI_COMM_WORLD);
+    if(MPI_File_open(MPI_COMM_WORLD, buf, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &SharedFile[n]) != MPI_SUCCESS)
+#else
+    if((SharedFile[n] = open(buf, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+#endif
+    {
+      fprintf(stderr, "can't open shared output file `%s'\n", buf);
+      ABORT(0);
+    }
+#ifndef MPI
+    SharedEnd[n] = header;
+#endif
+  }
+
+#ifdef MPI
+  MPI_Win_allocate(ThisTask == 0 ? sizeof(int64_t) * NOUT : 0, sizeof(int64_t), MPI_INFO_NULL, MPI_COMM_WORLD, &SharedEnd, &SharedEndWin);
+  if(ThisTask == 0)
+  {
+    MPI_Win_lock(MPI_LOCK_EXCLUSIVE, 0, 0, SharedEndWin);
+    for(n = 0; n < NOUT; n++)
+      SharedEnd[n] = header;
+    MPI_Win_unlock(0, SharedEndWin);
+  }
+  MPI_Barrier(MPI_COMM_WORLD);
+#endif
+}
+
+
+
+// writes the finished block of tree file filenr for output snapshot n
+void write_shared_block(int filenr, int n, const char *block, int64_t size)
+{
+  int64_t offset;
+
+#ifdef MPI
+  MPI_Win_lock(MPI_LOCK_SHARED, 0, 0, SharedEndWin);
+  MPI_Fetch_and_op(&size, &offset, MPI_INT64_T, 0, n, MPI_SUM, SharedEndWin);
+  MPI_Win_unlock(0, SharedEndWin);
+#else
+  offset = SharedEnd[n];
+  SharedEnd[n] += size;
+#endif
+
+  write_shared_bytes(n, offset, block, size);
+  SharedOffset[n][filenr - FirstFile] = offset;
+}
+
+
+
+void close_shared_output(void)
+{
+  int header[2] = { NSharedFiles, FirstFile };
+  int n;
+
+  for(n = NOUT - 1; n >= 0; n--)
+  {
+    // every tree file was done by one task, the others still have -1 for it
+#ifdef MPI
+    MPI_Allreduce(MPI_IN_PLACE, SharedOffset[n], NSharedFiles, MPI_INT64_T, MPI_MAX, MPI_COMM_WORLD);
+    if(ThisTask == 0)
+#endif
+    {
+      write_shared_bytes(n, 0, (const char *) header, sizeof(header));
+      write_shared_bytes(n, sizeof(header), (const char *) SharedOffset[n], sizeof(int64_t) * NSharedFiles);
+    }
+
+#ifdef MPI
+    MPI_File_close(&SharedFile[n]);
+#else
+    close(SharedFile[n]);
+#endif
+    myfree(SharedOffset[n]);
+  }
+
+#ifdef MPI
+  MPI_Win_free(&SharedEndWin);
+#endif
+}
+
+#undef SHARED_MAXWRITE
@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+#include <assert.h>
+
+#ifdef MPI
+#include <mpi.h>
+#endif
+
+#include "core_allvars.h"
+#include "core_proto.h"
+
+// The tree files between FirstFile and LastFile are handed out one at a time.
+// With MPI every rank asks for its next file as soon as it is done with the previous
+// one; the files are sorted by their number of halos so the big ones go first and the
+// small ones fill the gaps at the end. Without MPI the files are processed in order.
+
+static int NScheduledFiles = 0;
+static int *ScheduledFile;         /* file numbers in the order they are handed out */
+static int64_t *ScheduledNHalos;   /* matching halo counts, -1 for missing files */
+
+#ifdef MPI
+static MPI_Win ScheduleWin;        /* one shared counter on task 0 */
+static int *ScheduleCounter;
+#else
+static int NextLocalFile = 0;
+#endif
+
+/* timing summary */
+static int CurrentFile = -1;
+static int NFilesDone = 0;
+static int64_t NHalosDone = 0;
+static double TimeStart, TimeFileStart, TimeBusy = 0.0;
+
+
+
+static double schedule_wtime(void)
+{
+#ifdef MPI
+  return MPI_Wtime();
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1.0e-6 * tv.tv_usec;
+#endif
+}
+
+
+
+#ifdef MPI
+static int compare_file_cost(const void *a, const void *b)
+{
+  const int64_t *ca = (const int64_t *) a, *cb = (const int64_t *) b;
+
+  // largest first, ties by file number so that every run uses the same order
+  if(ca[0] > cb[0])
+    return -1;
+  if(ca[0] < cb[0])
+    return 1;
+  return (ca[1] > cb[1]) - (ca[1] < cb[1]);
+}
+#endif
+
+
+
+void init_file_schedule(void)
+{
+  int i;
+
+  NScheduledFiles = LastFile - FirstFile + 1;
+  if(NScheduledFiles < 0)
+    NScheduledFiles = 0;
+
+  ScheduledFile = mymalloc(sizeof(int) * NScheduledFiles);
+  ScheduledNHalos = mymalloc(sizeof(int64_t) * NScheduledFiles);
+
+#ifdef MPI
+  if(ThisTask == 0)
+  {
+    int64_t *cost = mymalloc(2 * sizeof(int64_t) * NScheduledFiles);
+
+    for(i = 0; i < NScheduledFiles; i++)
+    {
+      cost[2 * i] = get_tree_file_nhalos(FirstFile + i, TreeType);
+      cost[2 * i + 1] = FirstFile + i;
+    }
+
+    qsort(cost, NScheduledFiles, 2 * sizeof(int64_t), compare_file_cost);
+
+    for(i = 0; i < NScheduledFiles; i++)
+    {
+      ScheduledNHalos[i] = cost[2 * i];
+      ScheduledFile[i] = (int) cost[2 * i + 1];
+    }
+
+    myfree(cost);
+  }
+
+  MPI_Bcast(ScheduledFile, NScheduledFiles, MPI_INT, 0, MPI_COMM_WORLD);
+  MPI_Bcast(ScheduledNHalos, NScheduledFiles, MPI_INT64_T, 0, MPI_COMM_WORLD);
+
+  MPI_Win_allocate(ThisTask == 0 ? sizeof(int) : 0, sizeof(int), MPI_INFO_NULL, MPI_COMM_WORLD, &ScheduleCounter, &ScheduleWin);
+  if(ThisTask == 0)
+  {
+    MPI_Win_lock(MPI_LOCK_EXCLUSIVE, 0, 0, ScheduleWin);
+    *ScheduleCounter = 0;
+    MPI_Win_unlock(0, ScheduleWin);
+  }
+  MPI_Barrier(MPI_COMM_WORLD);
+#else
+  for(i = 0; i < NScheduledFiles; i++)
+  {
+    ScheduledFile[i] = FirstFile + i;
+    ScheduledNHalos[i] = -1;  // not needed to decide the order, so don't read the headers
+  }
+#endif
+
+  TimeStart = schedule_wtime();
+}
+
+
+
+// Returns the next file to work on, or -1 once every file has been handed out.
+// Calling it also closes the timing interval of the previously returned file.
+int get_next_file(void)
+{
+  int idx;
+  double now = schedule_wtime();
+
+  if(CurrentFile >= 0)
+  {
+    TimeBusy += now - TimeFileStart;
+    NFilesDone++;
+    if(ScheduledNHalos[CurrentFile] > 0)
+      NHalosDone += ScheduledNHalos[CurrentFile];
+    CurrentFile = -1;
+  }
+
+#ifdef MPI
+  int one = 1;
+
+  MPI_Win_lock(MPI_LOCK_SHARED, 0, 0, ScheduleWin);
+  MPI_Fetch_and_op(&one, &idx, MPI_INT, 0, 0, MPI_SUM, ScheduleWin);
+  MPI_Win_unlock(0, ScheduleWin);
+#else
+  idx = NextLocalFile++;
+#endif
+
+  if(idx >= NScheduledFiles)
+    return -1;
+
+  CurrentFile = idx;
+  TimeFileStart = now;
+
+  return ScheduledFile[idx];
+}
+
+
+
+void finalize_file_schedule(void)
+{
+  double total;
+
+#ifdef MPI
+  double mystats[4], *allstats = NULL;
+  int task;
+
+  MPI_Barrier(MPI_COMM_WORLD);  // the time spent here is the load imbalance
+  total = schedule_wtime() - TimeStart;
+
+  mystats[0] = NFilesDone;
+  mystats[1] = (double) NHalosDone;
+  mystats[2] = TimeBusy;
+  mystats[3] = total;
+
+  if(ThisTask == 0)
+    allstats = mymalloc(4 * sizeof(double) * NTask);
+
+  MPI_Gather(mystats, 4, MPI_DOUBLE, allstats, 4, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+
+  if(ThisTask == 0)
+  {
+    double maxbusy = 0.0, sumbusy = 0.0;
+
+    printf("\nFile schedule summary (%d files over %d tasks)\n", NScheduledFiles, NTask);
+    printf("%6s %8s %14s %12s %12s\n", "task", "files", "halos", "busy [s]", "idle [s]");
+    for(task = 0; task < NTask; task++)
+    {
+      printf("%6d %8d %14.0f %12.2f %12.2f\n", task, (int) allstats[4 * task], allstats[4 * task + 1],
+             allstats[4 * task + 2], allstats[4 * task + 3] - allstats[4 * task + 2]);
+      sumbusy += allstats[4 * task + 2];
+      if(allstats[4 * task + 2] > maxbusy)
+        maxbusy = allstats[4 * task + 2];
+    }
+    if(sumbusy > 0.0)
+      printf("load balance: max/mean busy time = %.3f\n\n", maxbusy / (sumbusy / NTask));
+
+    myfree(allstats);
+  }
+
+  MPI_Win_free(&ScheduleWin);
+#else
+  total = schedule_wtime() - TimeStart;
+  printf("\nprocessed %d files in %.2f s\n\n", NFilesDone, total);
+#endif
+
+  myfree(ScheduledNHalos);
+  myfree(ScheduledFile);
+}
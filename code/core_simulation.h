@@ -23,8 +23,7 @@ struct halo_data
   int FileNr;
   int SubhaloIndex;
   float SubHalfMass;
-}
-*Halo;
+};
 
 
 
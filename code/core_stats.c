@@ -0,0 +1,475 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+
+#ifdef MPI
+#include <mpi.h>
+#endif
+
+#include "core_allvars.h"
+#include "core_proto.h"
+
+// Binned statistics of the galaxies at the output snapshots, collected while the run
+// goes (GalaxyStats 1, and for every parameter set of a SweepFile): the mass functions
+// and scaling relations that output/allresults.py gets from the catalogs. Every
+// statistic has STATS_NBINS bins of STATS_DX dex in log10 of a mass in Msun, and every
+// bin the number of galaxies N in it and the sums of a quantity Y and of Y^2 over them,
+// so means and scatters follow; for the mass functions Y is the mass itself. They are
+// added up over all tree files and tasks and written to
+// <OutputDir>/<FileNameGalaxies>_stats.txt, one line per statistic, set, output
+// snapshot and bin with galaxies in it; read with read_sagestats in
+// output/plot_read_routines.py.
+//
+// The sums are the same bit for bit whatever the number of threads and tasks: a tree
+// adds its galaxies in the order they are stored (see tally_galaxy_stats), the trees of
+// a file are added in tree order into the sums of the file, and the files are added up
+// in file order, under MPI by task 0 at the end (see end_file_galaxy_stats).
+
+#define STATS_NBINS 60
+#define STATS_DX 0.1
+#define SSFR_PASSIVE 1.0e-11   /* 1/yr, the cut of allresults.py */
+
+enum galaxy_stat_nr
+{
+  stat_stellar_mass_function,
+  stat_passive_mass_function,
+  stat_baryonic_mass_function,
+  stat_gas_mass_function,
+  stat_black_hole_bulge,
+  stat_specific_sfr,
+  stat_bulge_fraction,
+  stat_gas_fraction,
+  stat_metallicity,
+  stat_baryon_fraction,   /* the FoF group sums, see add_galaxy_stats */
+  stat_stellar_fraction,
+  stat_cold_gas_fraction,
+  stat_hot_gas_fraction,
+  stat_ejected_fraction,
+  stat_ics_fraction,
+  stat_black_hole_fraction,
+  NSTATS
+};
+
+#define NGROUPSUMS (NSTATS - stat_baryon_fraction)
+
+static const struct
+{
+  const char *name;
+  double xmin;   /* lower edge of the first bin */
+  const char *desc;
+} Stats[NSTATS] = {
+  { "StellarMassFunction", 7.0, "X StellarMass, Y StellarMass" },
+  { "PassiveMassFunction", 7.0, "X StellarMass, Y StellarMass, galaxies with sSFR below 1e-11 / yr" },
+  { "BaryonicMassFunction", 7.0, "X StellarMass + ColdGas, Y StellarMass + ColdGas" },
+  { "GasMassFunction", 7.0, "X ColdGas, Y ColdGas" },
+  { "BlackHoleBulge", 7.0, "X BulgeMass, Y log10 BlackHoleMass (BulgeMass > 1e8 Msun/h, BlackHoleMass > 1e5 Msun/h)" },
+  { "SpecificSFR", 7.0, "X StellarMass, Y log10 sSFR / yr (StellarMass > 1e8 Msun/h, star forming)" },
+  { "BulgeFraction", 7.0, "X StellarMass, Y BulgeMass / StellarMass" },
+  { "GasFraction", 7.0, "X StellarMass, Y ColdGas / (StellarMass + ColdGas), centrals with bulges of 0.1 to 0.5 of the stars" },
+  { "Metallicity", 7.0, "X StellarMass, Y 12 + log10(O/H) of the cold gas, centrals with more than 10% gas (StellarMass > 1e8 Msun/h)" },
+  { "BaryonFraction", 10.0, "X Mvir of centrals, Y all baryons of the FoF group / Mvir" },
+  { "StellarFraction", 10.0, "X Mvir of centrals, Y StellarMass of the FoF group / Mvir" },
+  { "ColdGasFraction", 10.0, "X Mvir of centrals, Y ColdGas of the FoF group / Mvir" },
+  { "HotGasFraction", 10.0, "X Mvir of centrals, Y HotGas of the FoF group / Mvir" },
+  { "EjectedFraction", 10.0, "X Mvir of centrals, Y EjectedMass of the FoF group / Mvir" },
+  { "ICSFraction", 10.0, "X Mvir of centrals, Y ICS of the FoF group / Mvir" },
+  { "BlackHoleFraction", 10.0, "X Mvir of centrals, Y BlackHoleMass of the FoF group / Mvir" },
+};
+
+static int NStatsSets = 0;
+static long long *StatsCount = NULL;   /* [set][output snapshot][statistic][bin], all files */
+static double *StatsSum, *StatsSum2;
+static long long *FileCount;           /* the same for the tree file being done */
+static double *FileSum, *FileSum2;
+
+#ifdef MPI
+struct stats_record   /* one bin of one file, kept until write_galaxy_stats */
+{
+  int filenr;
+  size_t k;
+  long long count;
+  double sum, sum2;
+};
+
+static struct stats_record *FileRecord = NULL;
+static size_t NFileRecords = 0, MaxFileRecords = 0;
+#endif
+
+// the bins a tree adds galaxies to, in the order it adds them
+struct galaxy_stats_tally
+{
+  int n, max;
+  struct
+  {
+    size_t k;
+    double y;
+  } entry[];
+};
+
+
+
+// one set of statistics for a normal run, one per parameter set for a sweep
+void init_galaxy_stats(int nsets)
+{
+  size_t n = (size_t) nsets * NOUT * NSTATS * STATS_NBINS;
+
+  NStatsSets = nsets;
+  StatsCount = calloc(n, sizeof(long long));
+  StatsSum = calloc(n, sizeof(double));
+  StatsSum2 = calloc(n, sizeof(double));
+  FileCount = calloc(n, sizeof(long long));
+  FileSum = calloc(n, sizeof(double));
+  FileSum2 = calloc(n, sizeof(double));
+  if(StatsCount == NULL || StatsSum == NULL || StatsSum2 == NULL || FileCount == NULL || FileSum == NULL || FileSum2 == NULL)
+  {
+    printf("Error: Could not allocate memory for the galaxy statistics of %d sets\n", nsets);
+    ABORT(0);
+  }
+}
+
+
+
+// x is the mass in Msun
+static void add_to_bin(struct galaxy_stats_tally **tally, int set, int n, int s, double x, double y)
+{
+  struct galaxy_stats_tally *t = *tally;
+  int bin;
+
+  if(!(x > 0.0))
+    return;
+  bin = (int) floor((log10(x) - Stats[s].xmin) / STATS_DX);
+  if(bin < 0 || bin >= STATS_NBINS)
+    return;
+
+  if(t->n == t->max)
+  {
+    if(!(t = realloc(t, sizeof(struct galaxy_stats_tally) + 2 * (size_t) t->max * sizeof(t->entry[0]))))
+    {
+      fprintf(stderr, "Error: Could not allocate memory for the galaxy statistics of a tree\n");
+      ABORT(0);
+    }
+    t->max *= 2;
+    *tally = t;
+  }
+
+  t->entry[t->n].k = (((size_t) set * NOUT + n) * NSTATS + s) * STATS_NBINS + bin;
+  t->entry[t->n].y = y;
+  t->n++;
+}
+
+
+
+static void add_galaxy(struct galaxy_stats_tally **t, int set, int n, const struct GALAXY *g, const struct GALAXY_HISTORY *h)
+{
+  double mstars = g->StellarMass * 1.0e10 / Hubble_h, mcold = g->ColdGas * 1.0e10 / Hubble_h;
+  double mbulge = g->BulgeMass * 1.0e10 / Hubble_h, sfr = 0.0, ssfr;
+  int step;
+
+  for(step = 0; step < STEPS; step++)
+    sfr += (h->SfrDisk[step] + h->SfrBulge[step]) * UnitMass_in_g / UnitTime_in_s * SEC_PER_YEAR / SOLAR_MASS / STEPS;
+  ssfr = g->StellarMass > 0.0 ? sfr / mstars : 0.0;
+
+  add_to_bin(t, set, n, stat_stellar_mass_function, mstars, mstars);
+  if(ssfr < SSFR_PASSIVE)
+    add_to_bin(t, set, n, stat_passive_mass_function, mstars, mstars);
+  add_to_bin(t, set, n, stat_baryonic_mass_function, mstars + mcold, mstars + mcold);
+  add_to_bin(t, set, n, stat_gas_mass_function, mcold, mcold);
+
+  if(g->BulgeMass > 0.01 && g->BlackHoleMass > 0.00001)
+    add_to_bin(t, set, n, stat_black_hole_bulge, mbulge, log10(g->BlackHoleMass * 1.0e10 / Hubble_h));
+  if(g->StellarMass > 0.01 && ssfr > 0.0)
+    add_to_bin(t, set, n, stat_specific_sfr, mstars, log10(ssfr));
+  if(g->StellarMass > 0.0)
+    add_to_bin(t, set, n, stat_bulge_fraction, mstars, g->BulgeMass / g->StellarMass);
+
+  if(g->Type == 0 && g->StellarMass > 0.0 && g->BulgeMass > 0.1 * g->StellarMass && g->BulgeMass < 0.5 * g->StellarMass)
+    add_to_bin(t, set, n, stat_gas_fraction, mstars, g->ColdGas / (g->StellarMass + g->ColdGas));
+  if(g->Type == 0 && g->StellarMass > 0.01 && g->ColdGas > 0.1 * (g->StellarMass + g->ColdGas) && g->MetalsColdGas > 0.0)
+    add_to_bin(t, set, n, stat_metallicity, mstars, log10(g->MetalsColdGas / g->ColdGas / 0.02) + 9.0);
+}
+
+
+
+// What the galaxies in slots first ... last - 1 of the tree add to the statistics of
+// set; add_galaxy_stats_tally adds it. Those slots hold whole FoF groups at every
+// snapshot, as in save_galaxies and save_streamed_galaxies, so the group sums are
+// complete. Only reads the tree, so trees may be tallied by several threads at once.
+struct galaxy_stats_tally *tally_galaxy_stats(int set, int first, int last, struct tree_context *ctx)
+{
+  struct GALAXY *HaloGal = ctx->HaloGal, *g;
+  struct galaxy_stats_tally *t;
+  double *groupsum, m;
+  int i, c, n, OutputSnapIndex[MAXSNAPS];
+
+  if(!(t = malloc(sizeof(struct galaxy_stats_tally) + 64 * sizeof(t->entry[0]))))
+  {
+    fprintf(stderr, "Error: Could not allocate memory for the galaxy statistics of a tree\n");
+    ABORT(0);
+  }
+  t->n = 0;
+  t->max = 64;
+  if(last <= first)
+    return t;
+
+  for(i = 0; i < MAXSNAPS; i++)
+    OutputSnapIndex[i] = -1;
+  for(n = 0; n < NOUT; n++)
+    OutputSnapIndex[ListOutputSnaps[n]] = n;
+
+  groupsum = calloc((size_t) (last - first) * NGROUPSUMS, sizeof(double));
+  if(groupsum == NULL)
+  {
+    fprintf(stderr, "Error: Could not allocate memory for the FoF group sums of %d galaxies\n", last - first);
+    ABORT(0);
+  }
+
+  for(i = first; i < last; i++)
+  {
+    g = &HaloGal[i - ctx->GalBase];
+    if((n = OutputSnapIndex[g->SnapNum]) < 0)
+      continue;
+
+    add_galaxy(&t, set, n, g, &ctx->HaloGalHistory[i - ctx->GalBase]);
+
+    // the central of the FoF group, as CentralGalaxyIndex in the output
+    c = ctx->HaloAux[ctx->Halo[g->HaloNr].FirstHaloInFOFgroup].FirstGalaxy;
+    if(c < first || c >= last)
+      continue;
+    c = (c - first) * NGROUPSUMS;
+    groupsum[c + stat_stellar_fraction - stat_baryon_fraction] += g->StellarMass;
+    groupsum[c + stat_cold_gas_fraction - stat_baryon_fraction] += g->ColdGas;
+    groupsum[c + stat_hot_gas_fraction - stat_baryon_fraction] += g->HotGas;
+    groupsum[c + stat_ejected_fraction - stat_baryon_fraction] += g->EjectedMass;
+    groupsum[c + stat_ics_fraction - stat_baryon_fraction] += g->ICS;
+    groupsum[c + stat_black_hole_fraction - stat_baryon_fraction] += g->BlackHoleMass;
+    groupsum[c] += g->StellarMass + g->ColdGas + g->HotGas + g->EjectedMass + g->ICS + g->BlackHoleMass;
+  }
+
+  for(i = first; i < last; i++)
+  {
+    g = &HaloGal[i - ctx->GalBase];
+    if((n = OutputSnapIndex[g->SnapNum]) < 0 || g->Type != 0 || !(g->Mvir > 0.0))
+      continue;
+
+    m = g->Mvir * 1.0e10 / Hubble_h;
+    for(c = 0; c < NGROUPSUMS; c++)
+      add_to_bin(&t, set, n, stat_baryon_fraction + c, m, groupsum[(i - first) * NGROUPSUMS + c] / g->Mvir);
+  }
+
+  free(groupsum);
+
+  return t;
+}
+
+
+
+// Adds a tally to the sums of the tree file and frees it. The trees of a file must come
+// here one at a time and in tree order.
+void add_galaxy_stats_tally(struct galaxy_stats_tally *t)
+{
+  int i;
+  size_t k;
+
+  for(i = 0; i < t->n; i++)
+  {
+    k = t->entry[i].k;
+    FileCount[k]++;
+    FileSum[k] += t->entry[i].y;
+    FileSum2[k] += t->entry[i].y * t->entry[i].y;
+  }
+
+  free(t);
+}
+
+
+
+// tally_galaxy_stats and add_galaxy_stats_tally in one, for trees that are already in order
+void add_galaxy_stats(int set, int first, int last, struct tree_context *ctx)
+{
+  add_galaxy_stats_tally(tally_galaxy_stats(set, first, last, ctx));
+}
+
+
+
+// Once all trees of filenr are added, moves the sums of the file to those of the run;
+// under MPI task 0 does that for all files in write_galaxy_stats.
+void end_file_galaxy_stats(int filenr)
+{
+  size_t k, nbins = (size_t) NStatsSets * NOUT * NSTATS * STATS_NBINS;
+
+  if(StatsCount == NULL)
+    return;
+
+  for(k = 0; k < nbins; k++)
+  {
+    if(FileCount[k] == 0)
+      continue;
+
+#ifdef MPI
+    if(NFileRecords == MaxFileRecords)
+    {
+      MaxFileRecords = MaxFileRecords > 0 ? 2 * MaxFileRecords : 1024;
+      if(!(FileRecord = realloc(FileRecord, MaxFileRecords * sizeof(struct stats_record))))
+      {
+        printf("Error: Could not allocate memory for the galaxy statistics of %zu bins\n", MaxFileRecords);
+        ABORT(0);
+      }
+    }
+    FileRecord[NFileRecords].filenr = filenr;
+    FileRecord[NFileRecords].k = k;
+    FileRecord[NFileRecords].count = FileCount[k];
+    FileRecord[NFileRecords].sum = FileSum[k];
+    FileRecord[NFileRecords].sum2 = FileSum2[k];
+    NFileRecords++;
+#else
+    StatsCount[k] += FileCount[k];
+    StatsSum[k] += FileSum[k];
+    StatsSum2[k] += FileSum2[k];
+#endif
+
+    FileCount[k] = 0;
+    FileSum[k] = FileSum2[k] = 0.0;
+  }
+}
+
+
+
+#ifdef MPI
+static int compare_stats_record(const void *a, const void *b)
+{
+  const struct stats_record *ra = (const struct stats_record *) a, *rb = (const struct stats_record *) b;
+
+  if(ra->filenr != rb->filenr)
+    return ra->filenr < rb->filenr ? -1 : 1;
+  return (ra->k > rb->k) - (ra->k < rb->k);
+}
+
+
+
+// task 0 collects the bins of every file and adds them up in file order, as a run without MPI does
+static void gather_galaxy_stats(void)
+{
+  struct stats_record *all = NULL;
+  int *count = NULL, *displ = NULL, mycount, i;
+  size_t n = 0, k;
+
+  if(NFileRecords * sizeof(struct stats_record) > INT_MAX)
+  {
+    printf("Error: Too many galaxy statistics bins on task %d to collect them\n", ThisTask);
+    ABORT(0);
+  }
+  mycount = (int) (NFileRecords * sizeof(struct stats_record));
+
+  if(ThisTask == 0)
+  {
+    count = malloc(NTask * sizeof(int));
+    displ = malloc(NTask * sizeof(int));
+  }
+  MPI_Gather(&mycount, 1, MPI_INT, count, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+  if(ThisTask == 0)
+  {
+    for(i = 0; i < NTask; i++)
+    {
+      displ[i] = (int) n;
+      n += count[i];
+      if(n > INT_MAX)
+      {
+        printf("Error: Too many galaxy statistics bins to collect them on task 0\n");
+        ABORT(0);
+      }
+    }
+    if(!(all = malloc(n > 0 ? n : 1)))
+    {
+      printf("Error: Could not allocate memory for the galaxy statistics of %zu bins\n", n / sizeof(struct stats_record));
+      ABORT(0);
+    }
+  }
+  MPI_Gatherv(FileRecord, mycount, MPI_BYTE, all, count, displ, MPI_BYTE, 0, MPI_COMM_WORLD);
+
+  if(ThisTask == 0)
+  {
+    n /= sizeof(struct stats_record);
+    qsort(all, n, sizeof(struct stats_record), compare_stats_record);
+    for(k = 0; k < n; k++)
+    {
+      StatsCount[all[k].k] += all[k].count;
+      StatsSum[all[k].k] += all[k].sum;
+      StatsSum2[all[k].k] += all[k].sum2;
+    }
+    free(all);
+    free(displ);
+    free(count);
+  }
+
+  free(FileRecord);
+  FileRecord = NULL;
+  NFileRecords = MaxFileRecords = 0;
+}
+#endif
+
+
+
+// collective under MPI: adds up the statistics of all tasks and writes them
+void write_galaxy_stats(void)
+{
+  char buf[MAX_STRING_LEN];
+  int set, n, s, bin;
+  size_t k;
+  FILE *fd;
+
+  if(StatsCount == NULL)
+    return;
+
+#ifdef MPI
+  gather_galaxy_stats();
+  if(ThisTask == 0)
+#endif
+  {
+    path_printf(buf, MAX_STRING_LEN, "%s/%s_stats.txt", OutputDir, FileNameGalaxies);
+    if(!(fd = fopen(buf, "w")))
+    {
+      fprintf(stderr, "can't open file `%s'\n", buf);
+      ABORT(0);
+    }
+
+    fprintf(fd, "# galaxy statistics of tree files %d to %d at the output snapshots, %d set(s)\n", FirstFile, LastFile, NStatsSets);
+    fprintf(fd, "# bins of %g dex in log10(X / Msun) from XMin on; N galaxies, SumY and SumY2 the sums of Y and Y^2 over them\n", STATS_DX);
+    for(s = 0; s < NSTATS; s++)
+      fprintf(fd, "#   %s: %s\n", Stats[s].name, Stats[s].desc);
+    fprintf(fd, "# Set Statistic SnapNum Redshift XMin N SumY SumY2\n");
+
+    for(set = 0; set < NStatsSets; set++)
+      for(s = 0; s < NSTATS; s++)
+        for(n = 0; n < NOUT; n++)
+          for(bin = 0; bin < STATS_NBINS; bin++)
+          {
+            k = (((size_t) set * NOUT + n) * NSTATS + s) * STATS_NBINS + bin;
+            if(StatsCount[k] > 0)
+              fprintf(fd, "%d %s %d %g %.2f %lld %.8g %.8g\n", set, Stats[s].name, ListOutputSnaps[n], ZZ[ListOutputSnaps[n]],
+                      Stats[s].xmin + bin * STATS_DX, StatsCount[k], StatsSum[k], StatsSum2[k]);
+          }
+
+    if(fclose(fd) != 0)
+    {
+      fprintf(stderr, "Error: Failed to write the galaxy statistics to `%s'\n", buf);
+      ABORT(0);
+    }
+    printf("galaxy statistics written to %s\n", buf);
+  }
+
+  free(FileSum2);
+  free(FileSum);
+  free(FileCount);
+  free(StatsSum2);
+  free(StatsSum);
+  free(StatsCount);
+  StatsCount = NULL;
+}
+
+#undef STATS_NBINS
+#undef STATS_DX
+#undef SSFR_PASSIVE
+#undef NGROUPSUMS
@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef OPENMP
+#include <omp.h>
+#endif
+#ifdef MPI
+#include <mpi.h>
+#endif
+
+#include "core_allvars.h"
+#include "core_proto.h"
+
+// Parameter sweeps (SweepFile): one run evaluates many sets of recipe parameters on the
+// same trees and writes only their galaxy statistics. The sweep file is a table,
+//
+//   % comment lines start with % or #
+//   SfrEfficiency   FeedbackReheatingEpsilon   RadioModeEfficiency
+//   0.05            3.0                        0.08
+//   0.10            3.0                        0.08
+//   ...
+//
+// with the names of the parameters in the first line and one parameter set in each
+// line after it; everything else comes from the parameter file. The halos of a tree
+// file are read once and kept in memory while all sets are evolved on them, one set
+// after the other and the trees of a set in parallel, and the snapshot list, the
+// cosmology tables and the cooling functions are set up only once for the whole run.
+// No galaxy files are written; every set gets its own statistics in
+// <FileNameGalaxies>_stats.txt (see core_stats.c), and <FileNameGalaxies>_sweep.txt
+// lists the sets with their parameter values.
+
+#define SWEEP_MAXPARAMS 32
+#define SWEEP_MAXLINE 4096
+
+// the parameters that only enter the recipes, and the derived values set from them below
+static const char *SweepableParams[] = {
+  "SfrEfficiency", "FeedbackReheatingEpsilon", "FeedbackEjectionEfficiency", "ReIncorporationFactor",
+  "RadioModeEfficiency", "QuasarModeEfficiency", "BlackHoleGrowthRate", "ThreshMajorMerger",
+  "ThresholdSatDisruption", "Yield", "RecycleFraction", "FracZleaveDisk", "Reionization_z0",
+  "Reionization_zr", "EnergySN", "EtaSN", "BaryonFrac",
+#ifndef FIXED_RECIPES
+  "SFprescription", "AGNrecipeOn", "SupernovaRecipeOn", "ReionizationOn", "DiskInstabilityOn",
+#endif
+  NULL
+};
+
+static int NSweepSets = 0;
+static int NSweepParams = 0;
+static int SweepParam[SWEEP_MAXPARAMS];   /* their entries in ParamTag */
+static double *SweepValue;                /* [set][parameter] */
+
+
+
+static int is_sweep_comment(const char *line)
+{
+  line += strspn(line, " \t\r\n");
+  return *line == 0 || *line == '%' || *line == '#';
+}
+
+
+
+static int find_sweep_param(const char *name)
+{
+  int i, j;
+
+  for(i = 0; SweepableParams[i] != NULL; i++)
+    if(strcmp(name, SweepableParams[i]) == 0)
+      break;
+  if(SweepableParams[i] == NULL)
+    return -1;
+
+  for(j = 0; j < NParam; j++)
+    if(strcmp(name, ParamTag[j]) == 0 && (ParamID[j] == DOUBLE || ParamID[j] == INT))
+      return j;
+  return -1;
+}
+
+
+
+// reads SweepFile; called after init(), every task reads the file itself
+void read_sweep_file(void)
+{
+  char line[SWEEP_MAXLINE], *tok;
+  int maxsets = 64, lineno = 0, i, j;
+  FILE *fd;
+
+  if(!(fd = fopen(SweepFile, "r")))
+  {
+    printf("can't read parameter sweep file `%s'\n", SweepFile);
+    ABORT(0);
+  }
+
+  NSweepParams = 0;
+  while(fgets(line, SWEEP_MAXLINE, fd))
+  {
+    lineno++;
+    if(is_sweep_comment(line))
+      continue;
+
+    for(tok = strtok(line, " \t\r\n"); tok != NULL; tok = strtok(NULL, " \t\r\n"))
+    {
+      if(NSweepParams == SWEEP_MAXPARAMS)
+      {
+        printf("Error in file %s: more than %d parameters to sweep\n", SweepFile, SWEEP_MAXPARAMS);
+        ABORT(1);
+      }
+      if((j = find_sweep_param(tok)) < 0)
+      {
+        printf("Error in file %s: '%s' is not a parameter that can be swept\n", SweepFile, tok);
+        ABORT(1);
+      }
+      for(i = 0; i < NSweepParams; i++)
+        if(SweepParam[i] == j)
+        {
+          printf("Error in file %s: parameter '%s' is given twice\n", SweepFile, tok);
+          ABORT(1);
+        }
+      SweepParam[NSweepParams++] = j;
+    }
+    break;
+  }
+
+  SweepValue = malloc(sizeof(double) * maxsets * (NSweepParams + 1));
+  NSweepSets = 0;
+  while(SweepValue != NULL && fgets(line, SWEEP_MAXLINE, fd))
+  {
+    lineno++;
+    if(is_sweep_comment(line))
+      continue;
+
+    if(NSweepSets == maxsets)
+    {
+      maxsets *= 2;
+      if(!(SweepValue = realloc(SweepValue, sizeof(double) * maxsets * (NSweepParams + 1))))
+        break;
+    }
+
+    i = 0;
+    for(tok = strtok(line, " \t\r\n"); tok != NULL && i < NSweepParams; tok = strtok(NULL, " \t\r\n"))
+      SweepValue[NSweepSets * NSweepParams + i++] = atof(tok);
+    if(i != NSweepParams || tok != NULL)
+    {
+      printf("Error in file %s, line %d: a parameter set needs exactly %d values\n", SweepFile, lineno, NSweepParams);
+      ABORT(1);
+    }
+    NSweepSets++;
+  }
+  fclose(fd);
+
+  if(SweepValue == NULL)
+  {
+    printf("Error: Could not allocate memory for %d parameter sets\n", maxsets);
+    ABORT(0);
+  }
+  if(NSweepParams == 0 || NSweepSets == 0)
+  {
+    printf("Error in file %s: no parameters or no parameter sets\n", SweepFile);
+    ABORT(1);
+  }
+
+  init_galaxy_stats(NSweepSets);
+
+#ifdef MPI
+  if(ThisTask == 0)
+#endif
+    printf("Sweeping %d parameter sets of %d parameters from %s, no galaxy files are written\n", NSweepSets, NSweepParams, SweepFile);
+}
+
+
+
+static void apply_sweep_set(int set)
+{
+  int i, j;
+
+  for(i = 0; i < NSweepParams; i++)
+  {
+    j = SweepParam[i];
+    if(ParamID[j] == DOUBLE)
+      *((double *) ParamAddr[j]) = SweepValue[set * NSweepParams + i];
+    else
+      *((int *) ParamAddr[j]) = (int) SweepValue[set * NSweepParams + i];
+  }
+
+  // what init() derives from them
+  set_units();
+  a0 = 1.0 / (1.0 + Reionization_z0);
+  ar = 1.0 / (1.0 + Reionization_zr);
+}
+
+
+
+// Evolves every parameter set on the ntodo trees of filenr in order[] (see plan_tree_order).
+// Needs the tree table of the file.
+void sweep_tree_file(int filenr, const int *order, int ntodo, struct tree_context *TreeContext)
+{
+  struct halo_data *halos;
+  struct galaxy_stats_tally **tally;
+  long long nhalos = 0;
+  int set, treenr, i, lastadded;
+  time_t start = time(NULL);
+
+  // all halos of the file stay in memory for all sets
+  for(treenr = 0; treenr < Ntrees; treenr++)
+    nhalos += TreeNHalos[treenr];
+  halos = mymalloc(sizeof(struct halo_data) * nhalos);
+  for(treenr = 0; treenr < Ntrees; treenr++)
+    read_tree_halos(filenr, treenr, TreeType, halos + TreeFirstHalo[treenr]);
+
+  // the statistics of the trees done, until those of all trees before them are added
+  tally = mymalloc(sizeof(struct galaxy_stats_tally *) * (Ntrees > 0 ? Ntrees : 1));
+
+  for(set = 0; set < NSweepSets; set++)
+  {
+    apply_sweep_set(set);
+    for(treenr = 0; treenr < Ntrees; treenr++)
+      tally[treenr] = NULL;
+    lastadded = -1;
+    start_tree_window(lastadded);
+
+#ifdef OPENMP
+#pragma omp parallel for schedule(dynamic) ordered private(treenr)
+#endif
+    for(i = 0; i < ntodo; i++)
+    {
+#ifdef OPENMP
+      struct tree_context *ctx = &TreeContext[omp_get_thread_num()];
+#else
+      struct tree_context *ctx = &TreeContext[0];
+#endif
+      struct galaxy_stats_tally *t;
+      int group;
+
+      treenr = order[i];
+      while(!wait_tree_window(treenr))
+        ;
+
+      // the halos are only read by the recipes, so every set can start from the same copy
+      ctx->Halo = halos + TreeFirstHalo[treenr];
+      ctx->HaloMapped = 1;
+      init_tree_galaxies(filenr, treenr, ctx);
+
+      build_fof_order(TreeNHalos[treenr], ctx);
+      for(group = 0; group < ctx->NumFoFGroups; group++)
+        construct_galaxies(ctx->FoFOrder[group], ctx);
+
+      t = tally_galaxy_stats(set, 0, ctx->NumGals, ctx);
+      free_galaxies_and_tree(ctx);
+
+      // the trees are added in tree order, whatever the order they are evolved in
+#ifdef OPENMP
+#pragma omp ordered
+#endif
+      {
+        tally[treenr] = t;
+        while(lastadded + 1 < Ntrees && tally[lastadded + 1])
+        {
+          lastadded++;
+          add_galaxy_stats_tally(tally[lastadded]);
+          tally[lastadded] = NULL;
+        }
+        advance_tree_window(lastadded);
+      }
+    }
+  }
+
+  myfree(tally);
+  myfree(halos);
+  end_file_galaxy_stats(filenr);
+
+#ifdef MPI
+  printf("\ttask: %d\tnode: %s\tfile: %i\t%d trees, %d parameter sets in %ld s\n", ThisTask, ThisNode, filenr, Ntrees, NSweepSets, (long) (time(NULL) - start));
+#else
+  printf("\tfile: %i\t%d trees, %d parameter sets in %ld s\n", filenr, Ntrees, NSweepSets, (long) (time(NULL) - start));
+#endif
+  fflush(stdout);
+}
+
+
+
+// the parameter values of every set, for the statistics of the sets in _stats.txt
+void write_sweep_results(void)
+{
+  char buf[MAX_STRING_LEN];
+  int set, i;
+  FILE *fd;
+
+#ifdef MPI
+  if(ThisTask == 0)
+#endif
+  {
+    path_printf(buf, MAX_STRING_LEN, "%s/%s_sweep.txt", OutputDir, FileNameGalaxies);
+    if(!(fd = fopen(buf, "w")))
+    {
+      fprintf(stderr, "can't open file `%s'\n", buf);
+      ABORT(0);
+    }
+
+    fprintf(fd, "# %d parameter sets of %s, their statistics are in %s_stats.txt\n", NSweepSets, SweepFile, FileNameGalaxies);
+    fprintf(fd, "# Set");
+    for(i = 0; i < NSweepParams; i++)
+      fprintf(fd, " %s", ParamTag[SweepParam[i]]);
+    fprintf(fd, "\n");
+
+    for(set = 0; set < NSweepSets; set++)
+    {
+      fprintf(fd, "%d", set);
+      for(i = 0; i < NSweepParams; i++)
+        fprintf(fd, " %g", SweepValue[set * NSweepParams + i]);
+      fprintf(fd, "\n");
+    }
+
+    if(fclose(fd) != 0)
+    {
+      fprintf(stderr, "Error: Failed to write the parameter sets to `%s'\n", buf);
+      ABORT(0);
+    }
+  }
+
+  free(SweepValue);
+}
+
+#undef SWEEP_MAXPARAMS
+#undef SWEEP_MAXLINE
@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#ifdef OPENMP
+#include <omp.h>
+#endif
+
+#include "core_allvars.h"
+#include "core_proto.h"
+
+// Built-in timing of the model (compile with USE-TIMING).
+// Every thread adds the wall time and number of calls of each phase to its own
+// counters; these are merged at the end of a tree file and written, together with
+// the halos, galaxies and time of every tree, to
+//   <OutputDir>/<FileNameGalaxies>_timing_<filenr>.json  (phase totals)
+//   <OutputDir>/<FileNameGalaxies>_timing_<filenr>.csv   (one line per tree)
+// and at the end of the run to <FileNameGalaxies>_timing_task<task>.json.
+// Phases nest (the recipes are part of evolve_galaxies, which is part of
+// construct_galaxies), so their times are inclusive. With OpenMP the phase times
+// are summed over the threads and can exceed the wall time of the file.
+//
+// The recipes run for every galaxy and substep, where reading the clock would cost
+// about as much as the recipes themselves. Those phases are timed for one galaxy in
+// TIMING_SAMPLE_EVERY and their time is scaled up; their calls are always counted.
+
+#ifndef TIMING_SAMPLE_EVERY
+#define TIMING_SAMPLE_EVERY 16
+#endif
+
+static const char *PhaseName[num_timing_phases] =
+{
+  "load_tree",
+  "construct_galaxies",
+  "join_galaxies_of_progenitors",
+  "evolve_galaxies",
+  "infall_recipe",
+  "reincorporation_and_stripping",
+  "cooling_recipe",
+  "starformation_and_feedback",
+  "deal_with_galaxy_merger",
+  "disrupt_satellite_to_ICS",
+  "attach_galaxies_to_halos",
+  "save_galaxies"
+};
+
+/* per thread */
+static double PhaseStart[num_timing_phases];
+static double PhaseTime[num_timing_phases];
+static long long PhaseCalls[num_timing_phases];
+static double TreeStart;
+static int SampleCounter, Sampled;
+
+#ifdef OPENMP
+#pragma omp threadprivate(PhaseStart, PhaseTime, PhaseCalls, TreeStart, SampleCounter, Sampled)
+#endif
+
+/* merged over the threads, for the current file and for the whole run */
+static double FilePhaseTime[num_timing_phases], RunPhaseTime[num_timing_phases];
+static long long FilePhaseCalls[num_timing_phases], RunPhaseCalls[num_timing_phases];
+static double FileStart, RunWallTime = 0.0;
+static int RunFiles = 0;
+static long long RunTrees = 0, RunHalos = 0, RunGalaxies = 0;
+
+/* per tree of the current file */
+static double *TreeTime = NULL;
+static int *TreeGalaxies = NULL;
+
+
+
+double timing_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1.0e-9 * ts.tv_nsec;
+}
+
+
+
+void timing_start(enum timing_phase phase)
+{
+  PhaseStart[phase] = timing_now();
+}
+
+
+
+void timing_stop(enum timing_phase phase)
+{
+  PhaseTime[phase] += timing_now() - PhaseStart[phase];
+  PhaseCalls[phase]++;
+}
+
+
+
+// the sampled variants; timing_start_sampled decides whether this galaxy is timed,
+// timing_switch_sampled ends one phase and starts the next with a single clock reading
+void timing_start_sampled(enum timing_phase phase)
+{
+  Sampled = (++SampleCounter >= TIMING_SAMPLE_EVERY);
+  if(Sampled)
+  {
+    SampleCounter = 0;
+    PhaseStart[phase] = timing_now();
+  }
+}
+
+
+
+void timing_switch_sampled(enum timing_phase from, enum timing_phase to)
+{
+  PhaseCalls[from]++;
+  if(Sampled)
+  {
+    double now = timing_now();
+
+    PhaseTime[from] += (now - PhaseStart[from]) * TIMING_SAMPLE_EVERY;
+    PhaseStart[to] = now;
+  }
+}
+
+
+
+void timing_stop_sampled(enum timing_phase phase)
+{
+  PhaseCalls[phase]++;
+  if(Sampled)
+    PhaseTime[phase] += (timing_now() - PhaseStart[phase]) * TIMING_SAMPLE_EVERY;
+}
+
+
+
+void timing_begin_file(void)
+{
+  int i;
+
+  for(i = 0; i < num_timing_phases; i++)
+  {
+    FilePhaseTime[i] = 0.0;
+    FilePhaseCalls[i] = 0;
+  }
+
+  TreeTime = mymalloc(sizeof(double) * Ntrees);
+  TreeGalaxies = mymalloc(sizeof(int) * Ntrees);
+  for(i = 0; i < Ntrees; i++)
+  {
+    TreeTime[i] = 0.0;
+    TreeGalaxies[i] = 0;
+  }
+
+  FileStart = timing_now();
+}
+
+
+
+void timing_begin_tree(void)
+{
+  TreeStart = timing_now();
+}
+
+
+
+void timing_end_tree(int treenr, int ngals)
+{
+  // each tree is done by exactly one thread, so no locking is needed here
+  TreeTime[treenr] = timing_now() - TreeStart;
+  TreeGalaxies[treenr] = ngals;
+}
+
+
+
+// called by every thread once it is done with the trees of a file
+void timing_merge_thread(void)
+{
+  int i;
+
+#ifdef OPENMP
+#pragma omp critical (timing_merge)
+#endif
+  for(i = 0; i < num_timing_phases; i++)
+  {
+    FilePhaseTime[i] += PhaseTime[i];
+    FilePhaseCalls[i] += PhaseCalls[i];
+    PhaseTime[i] = 0.0;
+    PhaseCalls[i] = 0;
+  }
+}
+
+
+
+static void write_phases(FILE *fd, double *time, long long *calls)
+{
+  int i;
+
+  fprintf(fd, "  \"phases\": {\n");
+  for(i = 0; i < num_timing_phases; i++)
+    fprintf(fd, "    \"%s\": {\"seconds\": %.6f, \"calls\": %lld}%s\n", PhaseName[i], time[i], calls[i],
+            i < num_timing_phases - 1 ? "," : "");
+  fprintf(fd, "  }\n");
+}
+
+
+
+static int get_task(void)
+{
+#ifdef MPI
+  return ThisTask;
+#else
+  return 0;
+#endif
+}
+
+
+
+static int get_threads(void)
+{
+#ifdef OPENMP
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+
+
+void timing_end_file(int filenr)
+{
+  char buf[MAX_STRING_LEN];
+  FILE *fd;
+  double wall = timing_now() - FileStart;
+  long long nhalos = 0, ngals = 0;
+  int i, maxhalos = 0, maxgals = 0;
+
+  for(i = 0; i < Ntrees; i++)
+  {
+    nhalos += TreeNHalos[i];
+    ngals += TreeGalaxies[i];
+    if(TreeNHalos[i] > maxhalos)
+      maxhalos = TreeNHalos[i];
+    if(TreeGalaxies[i] > maxgals)
+      maxgals = TreeGalaxies[i];
+  }
+
+  path_printf(buf, MAX_STRING_LEN, "%s/%s_timing_%d.csv", OutputDir, FileNameGalaxies, filenr);
+  if(!(fd = fopen(buf, "w")))
+  {
+    printf("can't open file `%s'\n", buf);
+    ABORT(0);
+  }
+  fprintf(fd, "tree,halos,galaxies,seconds\n");
+  for(i = 0; i < Ntrees; i++)
+    fprintf(fd, "%d,%d,%d,%.6f\n", i, TreeNHalos[i], TreeGalaxies[i], TreeTime[i]);
+  fclose(fd);
+
+  path_printf(buf, MAX_STRING_LEN, "%s/%s_timing_%d.json", OutputDir, FileNameGalaxies, filenr);
+  if(!(fd = fopen(buf, "w")))
+  {
+    printf("can't open file `%s'\n", buf);
+    ABORT(0);
+  }
+  fprintf(fd, "{\n");
+  fprintf(fd, "  \"file\": %d,\n", filenr);
+  fprintf(fd, "  \"task\": %d,\n", get_task());
+  fprintf(fd, "  \"threads\": %d,\n", get_threads());
+  fprintf(fd, "  \"wall_seconds\": %.6f,\n", wall);
+  fprintf(fd, "  \"trees\": %d,\n", Ntrees);
+  fprintf(fd, "  \"halos\": %lld,\n", nhalos);
+  fprintf(fd, "  \"galaxies\": %lld,\n", ngals);
+  fprintf(fd, "  \"max_halos_per_tree\": %d,\n", maxhalos);
+  fprintf(fd, "  \"max_galaxies_per_tree\": %d,\n", maxgals);
+  fprintf(fd, "  \"memory_high_mark_mb\": %.3f,\n", get_high_mark_memory() / (1024.0 * 1024.0));
+  write_phases(fd, FilePhaseTime, FilePhaseCalls);
+  fprintf(fd, "}\n");
+  fclose(fd);
+
+  for(i = 0; i < num_timing_phases; i++)
+  {
+    RunPhaseTime[i] += FilePhaseTime[i];
+    RunPhaseCalls[i] += FilePhaseCalls[i];
+  }
+  RunWallTime += wall;
+  RunFiles++;
+  RunTrees += Ntrees;
+  RunHalos += nhalos;
+  RunGalaxies += ngals;
+
+  myfree(TreeGalaxies);
+  myfree(TreeTime);
+  TreeGalaxies = NULL;
+  TreeTime = NULL;
+}
+
+
+
+// a file stopped by SIGXCPU gets no report, its trees are redone by the restart
+void timing_abort_file(void)
+{
+  myfree(TreeGalaxies);
+  myfree(TreeTime);
+  TreeGalaxies = NULL;
+  TreeTime = NULL;
+}
+
+
+
+void timing_end_run(void)
+{
+  char buf[MAX_STRING_LEN];
+  FILE *fd;
+
+  path_printf(buf, MAX_STRING_LEN, "%s/%s_timing_task%d.json", OutputDir, FileNameGalaxies, get_task());
+  if(!(fd = fopen(buf, "w")))
+  {
+    printf("can't open file `%s'\n", buf);
+    ABORT(0);
+  }
+  fprintf(fd, "{\n");
+  fprintf(fd, "  \"task\": %d,\n", get_task());
+  fprintf(fd, "  \"threads\": %d,\n", get_threads());
+  fprintf(fd, "  \"files\": %d,\n", RunFiles);
+  fprintf(fd, "  \"wall_seconds\": %.6f,\n", RunWallTime);
+  fprintf(fd, "  \"trees\": %lld,\n", RunTrees);
+  fprintf(fd, "  \"halos\": %lld,\n", RunHalos);
+  fprintf(fd, "  \"galaxies\": %lld,\n", RunGalaxies);
+  fprintf(fd, "  \"memory_high_mark_mb\": %.3f,\n", get_high_mark_memory() / (1024.0 * 1024.0));
+  write_phases(fd, RunPhaseTime, RunPhaseCalls);
+  fprintf(fd, "}\n");
+  fclose(fd);
+}
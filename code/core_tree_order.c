@@ -0,0 +1,511 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "core_allvars.h"
+#include "core_proto.h"
+
+// The order in which the trees of a file are evolved (TreeOrder 1): the most expensive
+// first, so that a pool of threads does not end on one giant tree. The galaxies of a tree
+// that is done wait in memory until all trees before it are written, so with
+// TreeOrderWindow > 0 only the trees that are less than that many after the first one
+// not yet placed are candidates for the next place, and a tree does not start before
+// the trees written have got to within TreeOrderWindow of it (wait_tree_window). The
+// order makes sure that the tree the others wait for is never waiting itself.
+//
+// The cost of a tree is estimated from its structure as
+//
+//   cost = a * halos + b * sum over FoF groups of n + c * sum over FoF groups of n^2
+//
+// where n is the number of galaxies a FoF group is expected to carry: one per halo
+// plus the orphans its halos inherit, every progenitor beyond the first leaving one
+// behind. The coefficients are fitted (least squares, none negative) to the seconds
+// per tree of <FileNameGalaxies>_timing_<filenr>.csv from an earlier run with
+// USE-TIMING if there is one, else the defaults below are used.
+//
+// The pre-scan reads every tree of the file once and keeps its result next to the
+// galaxies, in <OutputDir>/<TreeName>.<filenr>.schedule:
+//
+//   # comments
+//   Ntrees TreeOrderWindow a b c
+//   treenr halos n n^2 cost     one line per tree, in the order they are evolved
+//
+// A later run reads it instead of the trees, and refits the costs if a timing file has
+// turned up since. The galaxies are still written in tree order, see stage_galaxies().
+
+// fitted to a timing run on trees like the mini-Millennium ones, on one core
+#define TREECOST_A 5.5e-6    /* seconds per halo */
+#define TREECOST_B 1.0e-7    /* per expected galaxy */
+#define TREECOST_C 1.0e-9    /* per expected galaxy squared, within a FoF group */
+
+struct tree_cost
+{
+  int treenr;
+  int nhalos;
+  double f[3];   /* halos, sum of n and of n^2 over the FoF groups */
+  double cost;
+};
+
+
+
+static void schedule_file_name(char *buf, int filenr)
+{
+  path_printf(buf, MAX_STRING_LEN, "%s/%s.%d%s.schedule", OutputDir, TreeName, filenr, TreeExtension);
+}
+
+
+
+// the cost features of one tree, with scratch for three values per halo
+static void tree_cost_features(int nhalos, const struct halo_data *Halo, int *order, double *orphans, double *group, double f[3])
+{
+  int first[ABSOLUTEMAXSNAPS + 1], i, j, h, p, nprog, snap;
+
+  // halos by snapshot, so that all progenitors of a halo come before it
+  for(snap = 0; snap <= MAXSNAPS; snap++)
+    first[snap] = 0;
+  for(i = 0; i < nhalos; i++)
+  {
+    snap = Halo[i].SnapNum < 0 || Halo[i].SnapNum >= MAXSNAPS ? MAXSNAPS - 1 : Halo[i].SnapNum;
+    first[snap + 1]++;
+  }
+  for(snap = 1; snap <= MAXSNAPS; snap++)
+    first[snap] += first[snap - 1];
+  for(i = 0; i < nhalos; i++)
+  {
+    snap = Halo[i].SnapNum < 0 || Halo[i].SnapNum >= MAXSNAPS ? MAXSNAPS - 1 : Halo[i].SnapNum;
+    order[first[snap]++] = i;
+  }
+
+  for(i = 0; i < nhalos; i++)
+    group[i] = 0.0;
+
+  for(j = 0; j < nhalos; j++)
+  {
+    h = order[j];
+    orphans[h] = 0.0;
+    nprog = 0;
+    for(p = Halo[h].FirstProgenitor; p >= 0; p = Halo[p].NextProgenitor)
+    {
+      orphans[h] += orphans[p];
+      nprog++;
+    }
+    if(nprog > 1)
+      orphans[h] += nprog - 1;
+
+    p = Halo[h].FirstHaloInFOFgroup;
+    group[p >= 0 && p < nhalos ? p : h] += 1.0 + orphans[h];
+  }
+
+  f[0] = nhalos;
+  f[1] = f[2] = 0.0;
+  for(i = 0; i < nhalos; i++)
+  {
+    f[1] += group[i];
+    f[2] += group[i] * group[i];
+  }
+}
+
+
+
+static void prescan_tree_file(int filenr, struct tree_cost *tc)
+{
+  struct halo_data *Halo;
+  double *orphans, *group;
+  int *order, treenr, maxhalos = 1;
+
+  for(treenr = 0; treenr < Ntrees; treenr++)
+    if(TreeNHalos[treenr] > maxhalos)
+      maxhalos = TreeNHalos[treenr];
+
+  Halo = mymalloc(sizeof(struct halo_data) * maxhalos);
+  order = mymalloc(sizeof(int) * maxhalos);
+  orphans = mymalloc(sizeof(double) * maxhalos);
+  group = mymalloc(sizeof(double) * maxhalos);
+
+  for(treenr = 0; treenr < Ntrees; treenr++)
+  {
+    read_tree_halos(filenr, treenr, TreeType, Halo);
+    tc[treenr].treenr = treenr;
+    tc[treenr].nhalos = TreeNHalos[treenr];
+    tree_cost_features(TreeNHalos[treenr], Halo, order, orphans, group, tc[treenr].f);
+  }
+
+  myfree(group);
+  myfree(orphans);
+  myfree(order);
+  myfree(Halo);
+}
+
+
+
+// reads the schedule of filenr into tc[] (by tree), returns 0 if there is none that fits the file
+static int read_tree_schedule(int filenr, struct tree_cost *tc, int *window, double coef[3])
+{
+  char buf[MAX_STRING_LEN], line[MAX_STRING_LEN];
+  struct tree_cost t;
+  int ntrees = -1, n = 0, ok = 1, i;
+  FILE *fd;
+
+  schedule_file_name(buf, filenr);
+  if(!(fd = fopen(buf, "r")))
+    return 0;
+
+  for(i = 0; i < Ntrees; i++)
+    tc[i].treenr = -1;
+
+  while(ok && fgets(line, MAX_STRING_LEN, fd))
+  {
+    if(line[0] == '#')
+      continue;
+    if(ntrees < 0)
+      ok = sscanf(line, "%d %d %lg %lg %lg", &ntrees, window, &coef[0], &coef[1], &coef[2]) == 5 && ntrees == Ntrees;
+    else
+    {
+      ok = sscanf(line, "%d %d %lg %lg %lg", &t.treenr, &t.nhalos, &t.f[1], &t.f[2], &t.cost) == 5
+        && t.treenr >= 0 && t.treenr < Ntrees && t.nhalos == TreeNHalos[t.treenr] && tc[t.treenr].treenr < 0;
+      if(ok)
+      {
+        t.f[0] = t.nhalos;
+        tc[t.treenr] = t;
+        n++;
+      }
+    }
+  }
+  fclose(fd);
+
+  if(!ok || n != Ntrees)
+  {
+    printf("-- schedule %s does not belong to these trees, scanning them again\n", buf);
+    return 0;
+  }
+
+  return 1;
+}
+
+
+
+static void write_tree_schedule(int filenr, const struct tree_cost *tc, const int *order, const double coef[3])
+{
+  char buf[MAX_STRING_LEN];
+  int i, ok;
+  FILE *fd;
+
+  schedule_file_name(buf, filenr);
+  if(!(fd = fopen(buf, "w")))
+  {
+    printf("can't write the tree schedule `%s', the trees are ordered anyway\n", buf);
+    return;
+  }
+
+  fprintf(fd, "# trees of %s/%s.%d%s by estimated cost, see code/core_tree_order.c\n", SimulationDir, TreeName, filenr, TreeExtension);
+  fprintf(fd, "# cost [s] = a * halos + b * sum(n) + c * sum(n^2), n the expected galaxies of a FoF group\n");
+  fprintf(fd, "# Ntrees TreeOrderWindow a b c\n");
+  fprintf(fd, "%d %d %.8g %.8g %.8g\n", Ntrees, TreeOrderWindow, coef[0], coef[1], coef[2]);
+  fprintf(fd, "# treenr halos sum(n) sum(n^2) cost\n");
+  for(i = 0; i < Ntrees; i++)
+    fprintf(fd, "%d %d %.17g %.17g %.8g\n", tc[order[i]].treenr, tc[order[i]].nhalos,
+            tc[order[i]].f[1], tc[order[i]].f[2], tc[order[i]].cost);
+  ok = fclose(fd) == 0;
+
+  if(!ok)
+    printf("Failed to write the tree schedule `%s'\n", buf);
+}
+
+
+
+// least squares for the coefficients of the columns in mask, scaled to order unity
+static double fit_columns(int n, const double *f, const double *t, int mask, double coef[3])
+{
+  double a[3][4], scale[3], x, r, chi2 = 0.0;
+  int col[3], k = 0, i, j, l, m, piv;
+
+  for(j = 0; j < 3; j++)
+    if(mask & (1 << j))
+    {
+      col[k] = j;
+      scale[k] = 0.0;
+      for(i = 0; i < n; i++)
+        if(f[3 * i + j] > scale[k])
+          scale[k] = f[3 * i + j];
+      if(scale[k] <= 0.0)
+        return -1.0;
+      k++;
+    }
+
+  // normal equations, solved by Gaussian elimination with pivoting
+  for(j = 0; j < k; j++)
+    for(l = 0; l <= k; l++)
+    {
+      a[j][l] = 0.0;
+      for(i = 0; i < n; i++)
+        a[j][l] += f[3 * i + col[j]] / scale[j] * (l < k ? f[3 * i + col[l]] / scale[l] : t[i]);
+    }
+
+  for(j = 0; j < k; j++)
+  {
+    piv = j;
+    for(l = j + 1; l < k; l++)
+      if(fabs(a[l][j]) > fabs(a[piv][j]))
+        piv = l;
+    if(fabs(a[piv][j]) < 1.0e-12 * n)
+      return -1.0;
+    for(m = 0; m <= k; m++)
+    {
+      x = a[j][m];
+      a[j][m] = a[piv][m];
+      a[piv][m] = x;
+    }
+    for(l = 0; l < k; l++)
+      if(l != j)
+      {
+        x = a[l][j] / a[j][j];
+        for(m = j; m <= k; m++)
+          a[l][m] -= x * a[j][m];
+      }
+  }
+
+  coef[0] = coef[1] = coef[2] = 0.0;
+  for(j = 0; j < k; j++)
+  {
+    coef[col[j]] = a[j][k] / a[j][j] / scale[j];
+    if(coef[col[j]] < 0.0)
+      return -1.0;
+  }
+
+  for(i = 0; i < n; i++)
+  {
+    r = t[i] - coef[0] * f[3 * i] - coef[1] * f[3 * i + 1] - coef[2] * f[3 * i + 2];
+    chi2 += r * r;
+  }
+  return chi2;
+}
+
+
+
+// fits coef to the tree times of an earlier timing run of filenr; returns 0 if there is none
+static int calibrate_tree_cost(int filenr, const struct tree_cost *tc, double coef[3])
+{
+  char buf[MAX_STRING_LEN], line[MAX_STRING_LEN];
+  double *f, *t, c[3], chi2, best = -1.0;
+  int n = 0, treenr, nhalos, ngals, mask;
+  FILE *fd;
+
+  path_printf(buf, MAX_STRING_LEN, "%s/%s_timing_%d.csv", OutputDir, FileNameGalaxies, filenr);
+  if(!(fd = fopen(buf, "r")))
+    return 0;
+
+  f = mymalloc(sizeof(double) * 3 * Ntrees);
+  t = mymalloc(sizeof(double) * Ntrees);
+  while(n < Ntrees && fgets(line, MAX_STRING_LEN, fd))
+  {
+    double seconds;
+
+    if(sscanf(line, "%d,%d,%d,%lg", &treenr, &nhalos, &ngals, &seconds) != 4
+       || treenr < 0 || treenr >= Ntrees || nhalos != tc[treenr].nhalos || seconds <= 0.0)
+      continue;   // the header, and trees that were not done
+    memcpy(&f[3 * n], tc[treenr].f, sizeof(double) * 3);
+    t[n++] = seconds;
+  }
+  fclose(fd);
+
+  // the best fit with no negative cost, over all subsets of the three terms
+  for(mask = 1; mask < 8 && n >= 3; mask++)
+    if((chi2 = fit_columns(n, f, t, mask, c)) >= 0.0 && (best < 0.0 || chi2 < best))
+    {
+      best = chi2;
+      memcpy(coef, c, sizeof(double) * 3);
+    }
+
+  myfree(t);
+  myfree(f);
+
+  if(best < 0.0)
+    return 0;
+
+  printf("-- tree costs of file %d calibrated on %d trees of %s: %.3g s/halo, %.3g s/galaxy, %.3g s/galaxy^2\n",
+         filenr, n, buf, coef[0], coef[1], coef[2]);
+  return 1;
+}
+
+
+
+static struct tree_cost *SortCost;
+
+static int compare_tree_cost(const void *a, const void *b)
+{
+  const struct tree_cost *ca = &SortCost[*(const int *) a], *cb = &SortCost[*(const int *) b];
+
+  // most expensive first, ties in tree order so that every run uses the same order
+  if(ca->cost > cb->cost)
+    return -1;
+  if(ca->cost < cb->cost)
+    return 1;
+  return (ca->treenr > cb->treenr) - (ca->treenr < cb->treenr);
+}
+
+
+
+// a heap of trees, the first one to be evolved on top
+static void push_tree(int *heap, int *n, int treenr)
+{
+  int i = (*n)++, up;
+
+  while(i > 0 && compare_tree_cost(&treenr, &heap[up = (i - 1) / 2]) < 0)
+  {
+    heap[i] = heap[up];
+    i = up;
+  }
+  heap[i] = treenr;
+}
+
+
+
+static int pop_tree(int *heap, int *n)
+{
+  int top = heap[0], last = heap[--(*n)], i = 0, down;
+
+  while((down = 2 * i + 1) < *n)
+  {
+    if(down + 1 < *n && compare_tree_cost(&heap[down + 1], &heap[down]) < 0)
+      down++;
+    if(compare_tree_cost(&heap[down], &last) >= 0)
+      break;
+    heap[i] = heap[down];
+    i = down;
+  }
+  heap[i] = last;
+
+  return top;
+}
+
+
+
+// the most expensive of the trees less than TreeOrderWindow after the first one not placed yet
+static void window_tree_order(int *order)
+{
+  int *heap, *placed, i, n = 0, next = 0, first = 0;
+
+  heap = mymalloc(sizeof(int) * TreeOrderWindow);
+  placed = mymalloc(sizeof(int) * Ntrees);
+  for(i = 0; i < Ntrees; i++)
+    placed[i] = 0;
+
+  for(i = 0; i < Ntrees; i++)
+  {
+    while(next < Ntrees && next < first + TreeOrderWindow)
+      push_tree(heap, &n, next++);
+    order[i] = pop_tree(heap, &n);
+    placed[order[i]] = 1;
+    while(first < Ntrees && placed[first])
+      first++;
+  }
+
+  myfree(placed);
+  myfree(heap);
+}
+
+
+
+// Fills order[] with the trees from firsttree on in the order they are to be evolved
+// and returns how many there are. Needs the tree table of the file.
+int plan_tree_order(int filenr, int firsttree, int *order)
+{
+  struct tree_cost *tc;
+  double coef[3] = { TREECOST_A, TREECOST_B, TREECOST_C }, old[3];
+  int i, n, window = -1, changed = 0;
+
+  if(TreeOrder == 0)
+  {
+    for(i = firsttree; i < Ntrees; i++)
+      order[i - firsttree] = i;
+    return Ntrees - firsttree;
+  }
+
+  tc = mymalloc(sizeof(struct tree_cost) * (Ntrees > 0 ? Ntrees : 1));
+
+  if(!read_tree_schedule(filenr, tc, &window, coef))
+  {
+    prescan_tree_file(filenr, tc);
+    changed = 1;
+  }
+  if(window != TreeOrderWindow)
+    changed = 1;   // the same costs, but the trees are listed in a different order
+
+  memcpy(old, coef, sizeof(old));
+  if(calibrate_tree_cost(filenr, tc, coef) && memcmp(old, coef, sizeof(old)) != 0)
+    changed = 1;
+
+  for(i = 0; i < Ntrees; i++)
+  {
+    tc[i].cost = coef[0] * tc[i].f[0] + coef[1] * tc[i].f[1] + coef[2] * tc[i].f[2];
+    order[i] = i;
+  }
+  SortCost = tc;
+  if(TreeOrderWindow > 0 && TreeOrderWindow < Ntrees)
+    window_tree_order(order);
+  else
+    qsort(order, Ntrees, sizeof(int), compare_tree_cost);
+
+  if(changed)
+    write_tree_schedule(filenr, tc, order, coef);
+
+  // the trees restored from a checkpoint are done already
+  for(i = n = 0; i < Ntrees; i++)
+    if(order[i] >= firsttree)
+      order[n++] = order[i];
+
+  myfree(tc);
+
+  return n;
+}
+
+
+
+static int WindowLastDone;   /* the last of the trees written one after the other from the first on */
+
+// before the first tree of a file, or of a set of a sweep; lastdone as for advance_tree_window
+void start_tree_window(int lastdone)
+{
+  WindowLastDone = lastdone;
+}
+
+
+
+// all trees up to lastdone are written, from the ordered section
+void advance_tree_window(int lastdone)
+{
+#ifdef OPENMP
+#pragma omp atomic write
+#endif
+  WindowLastDone = lastdone;
+}
+
+
+
+// Returns 1 if treenr may start, else waits a millisecond and returns 0 so that the
+// caller can look for SIGXCPU before it asks again. Only threads ever wait: one thread
+// evolves the trees in the order of plan_tree_order, which never gets ahead of the window.
+int wait_tree_window(int treenr)
+{
+  int lastdone;
+
+  if(TreeOrder != 1 || TreeOrderWindow <= 0)
+    return 1;
+
+#ifdef OPENMP
+#pragma omp atomic read
+#endif
+  lastdone = WindowLastDone;
+
+  if(treenr - lastdone <= TreeOrderWindow)
+    return 1;
+
+  usleep(1000);
+  return 0;
+}
+
+#undef TREECOST_A
+#undef TREECOST_B
+#undef TREECOST_C
@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#ifdef PREFETCH
+#include <pthread.h>
+#endif
+
+#ifdef OPENMP
+#include <omp.h>
+#endif
+
+#include "core_allvars.h"
+#include "core_proto.h"
+
+// Optional read-ahead of the trees of a file (compile with USE-PREFETCH).
+// A background thread reads the trees in the order they are evolved (order[]) into a
+// small ring of slots while the model works on the ones already read. load_tree()
+// borrows a slot's halos instead of reading them itself and free_galaxies_and_tree()
+// hands the slot back.
+//
+// The slot buffers are plain malloc'd memory: mymalloc keeps a LIFO table per thread,
+// and the slots are filled by one thread and released by another.
+
+#ifdef PREFETCH
+
+#ifndef PREFETCH_DEPTH
+#define PREFETCH_DEPTH 2   /* number of trees that can be read ahead */
+#endif
+
+enum prefetch_slot_state
+{
+  slot_free = 0,
+  slot_ready,
+  slot_borrowed
+};
+
+struct prefetch_slot
+{
+  enum prefetch_slot_state state;
+  int treenr;
+  size_t capacity;           /* number of halos the buffer can hold */
+  struct halo_data *Halo;
+};
+
+static struct prefetch_slot *Slots = NULL;
+static int NSlots = 0;
+static int PrefetchActive = 0;
+static int PrefetchFile;
+static const int *PrefetchOrder;      /* the trees in the order they are taken, kept by the caller */
+static int PrefetchNTodo;
+static int PrefetchCancel;            /* the remaining trees are not wanted any more */
+static enum Valid_TreeTypes PrefetchTreeType;
+
+static pthread_t ReaderThread;
+static pthread_mutex_t SlotLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t SlotFreed = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t SlotFilled = PTHREAD_COND_INITIALIZER;
+
+
+
+static void *tree_reader(void *unused)
+{
+  int treenr, i, k;
+  struct prefetch_slot *slot;
+
+  for(k = 0; k < PrefetchNTodo; k++)
+  {
+    treenr = PrefetchOrder[k];
+    pthread_mutex_lock(&SlotLock);
+    for(slot = NULL; slot == NULL; )
+    {
+      if(PrefetchCancel)
+      {
+        pthread_mutex_unlock(&SlotLock);
+        return NULL;
+      }
+
+      for(i = 0; i < NSlots; i++)
+        if(Slots[i].state == slot_free)
+        {
+          slot = &Slots[i];
+          break;
+        }
+      if(slot == NULL)
+        pthread_cond_wait(&SlotFreed, &SlotLock);
+    }
+    pthread_mutex_unlock(&SlotLock);
+
+    // only this thread touches a free slot, so the read itself happens outside the lock
+    if(slot->capacity < (size_t) TreeNHalos[treenr])
+    {
+      free(slot->Halo);
+      slot->capacity = TreeNHalos[treenr];
+      if(!(slot->Halo = malloc(sizeof(struct halo_data) * slot->capacity)))
+      {
+        printf("Failed to allocate memory for %g MB in the tree prefetch buffer\n", sizeof(struct halo_data) * slot->capacity / (1024.0 * 1024.0));
+        ABORT(0);
+      }
+    }
+
+    read_tree_halos(PrefetchFile, treenr, PrefetchTreeType, slot->Halo);
+
+    pthread_mutex_lock(&SlotLock);
+    slot->treenr = treenr;
+    slot->state = slot_ready;
+    pthread_cond_broadcast(&SlotFilled);
+    pthread_mutex_unlock(&SlotLock);
+  }
+
+  return NULL;
+}
+
+
+
+void start_tree_prefetch(int filenr, const int *order, int ntodo, enum Valid_TreeTypes my_TreeType)
+{
+  int i;
+
+  PrefetchActive = 0;
+
+  // a mapped file is paged in by the kernel, reading ahead there would only add a copy
+  if(my_TreeType == lhalo_binary_mmap)
+    return;
+
+#ifdef HDF5
+  // the reader thread calls HDF5 while the main thread may be writing HDF5 output;
+  // that is only safe with a thread-safe build of the library
+  if(my_TreeType == genesis_lhalo_hdf5 && HDF5Output)
+  {
+    static int warned = 0;
+    hbool_t threadsafe = 0;
+
+    H5is_library_threadsafe(&threadsafe);
+    if(!threadsafe)
+    {
+      if(!warned)
+        printf("HDF5 library is not thread-safe, reading trees without prefetching\n");
+      warned = 1;
+      return;
+    }
+  }
+#endif
+
+  NSlots = PREFETCH_DEPTH;
+#ifdef OPENMP
+  // every worker may be holding a tree while the reader fills the next one
+  if(NSlots < omp_get_max_threads() + 1)
+    NSlots = omp_get_max_threads() + 1;
+#endif
+
+  if(!(Slots = calloc(NSlots, sizeof(struct prefetch_slot))))
+  {
+    printf("Failed to allocate the tree prefetch queue\n");
+    ABORT(0);
+  }
+  for(i = 0; i < NSlots; i++)
+    Slots[i].treenr = -1;
+
+  PrefetchFile = filenr;
+  PrefetchOrder = order;
+  PrefetchNTodo = ntodo;
+  PrefetchCancel = 0;
+  PrefetchTreeType = my_TreeType;
+
+  if(pthread_create(&ReaderThread, NULL, tree_reader, NULL) != 0)
+  {
+    printf("Could not start the tree prefetch thread\n");
+    ABORT(0);
+  }
+
+  PrefetchActive = 1;
+}
+
+
+
+int take_prefetched_tree(int treenr, struct tree_context *ctx)
+{
+  int i, found = -1;
+
+  if(!PrefetchActive)
+    return 0;
+
+  pthread_mutex_lock(&SlotLock);
+  while(found < 0)
+  {
+    for(i = 0; i < NSlots; i++)
+      if(Slots[i].state == slot_ready && Slots[i].treenr == treenr)
+      {
+        found = i;
+        break;
+      }
+    if(found < 0)
+      pthread_cond_wait(&SlotFilled, &SlotLock);
+  }
+  Slots[found].state = slot_borrowed;
+  pthread_mutex_unlock(&SlotLock);
+
+  ctx->Halo = Slots[found].Halo;
+  ctx->PrefetchSlot = found;
+
+  return 1;
+}
+
+
+
+void release_prefetched_tree(struct tree_context *ctx)
+{
+  assert(ctx->PrefetchSlot >= 0 && ctx->PrefetchSlot < NSlots);
+
+  pthread_mutex_lock(&SlotLock);
+  Slots[ctx->PrefetchSlot].state = slot_free;
+  Slots[ctx->PrefetchSlot].treenr = -1;
+  pthread_cond_signal(&SlotFreed);
+  pthread_mutex_unlock(&SlotLock);
+
+  ctx->PrefetchSlot = -1;
+}
+
+
+
+void stop_tree_prefetch(void)
+{
+  int i;
+
+  if(!PrefetchActive)
+    return;
+
+  // normally every tree has been taken by now and the reader has left its loop;
+  // after a stop on SIGXCPU it may still be waiting for a slot
+  pthread_mutex_lock(&SlotLock);
+  PrefetchCancel = 1;
+  pthread_cond_broadcast(&SlotFreed);
+  pthread_mutex_unlock(&SlotLock);
+  pthread_join(ReaderThread, NULL);
+
+  for(i = 0; i < NSlots; i++)
+    free(Slots[i].Halo);
+  free(Slots);
+  Slots = NULL;
+  NSlots = 0;
+  PrefetchActive = 0;
+}
+
+#else  /* PREFETCH */
+
+void start_tree_prefetch(int filenr, const int *order, int ntodo, enum Valid_TreeTypes my_TreeType)
+{
+}
+
+int take_prefetched_tree(int treenr, struct tree_context *ctx)
+{
+  return 0;
+}
+
+void release_prefetched_tree(struct tree_context *ctx)
+{
+}
+
+void stop_tree_prefetch(void)
+{
+}
+
+#endif /* PREFETCH */
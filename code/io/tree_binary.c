@@ -6,6 +6,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <assert.h>
 
 #include "../core_allvars.h"
@@ -16,8 +17,16 @@
 
 FILE *load_fd;
 
+// lhalo_binary_mmap: the whole file is mapped once and the trees are used in place
+static char *load_map = NULL;
+static size_t load_map_size = 0;
+
 // Local Proto-Types //
 
+static void map_binary_file(int32_t filenr);
+static off_t tree_offset_binary(int32_t treenr);
+static void check_mapped_tree(int32_t filenr, int32_t treenr, off_t offset);
+
 // External Functions //
 
 void load_tree_table_binary(int32_t filenr) 
@@ -46,26 +55,136 @@ void load_tree_table_binary(int32_t filenr)
   for(i = 1; i < Ntrees; i++)
     TreeFirstHalo[i] = TreeFirstHalo[i - 1] + TreeNHalos[i - 1];
 
+  if(TreeType == lhalo_binary_mmap)
+    map_binary_file(filenr);
+
 }
 
-void load_tree_binary(int32_t filenr, int32_t treenr)
+void load_tree_binary(int32_t filenr, int32_t treenr, struct halo_data *Halo)
 {
+  off_t offset;
+
   // must have an FD
   assert(load_fd );
 
-  Halo = mymalloc(sizeof(struct halo_data) * TreeNHalos[treenr]);
+  // trees may be requested in any order when several threads work on one file,
+  // so position the stream explicitly rather than relying on the previous read
+  offset = tree_offset_binary(treenr);
+
+  if(load_map)
+  {
+    check_mapped_tree(filenr, treenr, offset);
+    memcpy(Halo, load_map + offset, sizeof(struct halo_data) * TreeNHalos[treenr]);
+    return;
+  }
+
+  if(fseeko(load_fd, offset, SEEK_SET) != 0)
+  {
+    fprintf(stderr, "Error: Could not seek to tree %d in file %d\n", treenr, filenr);
+    ABORT(0);
+  }
 
   myfread(Halo, TreeNHalos[treenr], sizeof(struct halo_data), load_fd);
 
 }
 
+struct halo_data *map_tree_binary(int32_t filenr, int32_t treenr)
+{
+  off_t offset;
+
+  assert(load_map);
+
+  offset = tree_offset_binary(treenr);
+  check_mapped_tree(filenr, treenr, offset);
+
+  // ask for the following tree now so it is already paged in when we get to it
+  if(treenr + 1 < Ntrees)
+  {
+    size_t next = offset + sizeof(struct halo_data) * TreeNHalos[treenr];
+    size_t start = next & ~((size_t) sysconf(_SC_PAGESIZE) - 1);
+    madvise(load_map + start, next - start + sizeof(struct halo_data) * TreeNHalos[treenr + 1], MADV_WILLNEED);
+  }
+
+  // the halos start after Ntrees+2 ints, so they are only aligned for even Ntrees;
+  // otherwise the caller has to copy them rather than use a misaligned struct pointer
+  if(offset % __alignof__(struct halo_data) != 0)
+    return NULL;
+
+  return (struct halo_data *) (load_map + offset);
+}
+
+int64_t read_tree_file_nhalos_binary(int32_t filenr)
+{
+  int header[2];
+  char buf[MAX_STRING_LEN];
+  FILE *fd;
+
+  path_printf(buf, MAX_STRING_LEN, "%s/%s.%d%s", SimulationDir, TreeName, filenr, TreeExtension);
+  if(!(fd = fopen(buf, "r")))
+    return -1;
+
+  // the header starts with Ntrees and totNHalos; that is all the scheduler needs
+  if(myfread(header, sizeof(int), 2, fd) != 2)
+  {
+    fclose(fd);
+    return -1;
+  }
+
+  fclose(fd);
+  return header[1];
+}
+
 void close_binary_file(void)
 {
+  if(load_map)
+  {
+    munmap(load_map, load_map_size);
+    load_map = NULL;
+    load_map_size = 0;
+  }
+
   if(load_fd) 
   {
     fclose(load_fd);
     load_fd = NULL;
   }
 }
+
 // Local Functions //
 
+static void map_binary_file(int32_t filenr)
+{
+  struct stat filestatus;
+
+  if(fstat(fileno(load_fd), &filestatus) != 0)
+  {
+    fprintf(stderr, "Error: Could not stat tree file %d\n", filenr);
+    ABORT(0);
+  }
+
+  load_map_size = filestatus.st_size;
+  load_map = mmap(NULL, load_map_size, PROT_READ, MAP_PRIVATE, fileno(load_fd), 0);
+  if(load_map == MAP_FAILED)
+  {
+    fprintf(stderr, "Error: Could not memory-map tree file %d (%g MB)\n", filenr, load_map_size / (1024.0 * 1024.0));
+    load_map = NULL;
+    ABORT(0);
+  }
+
+  // trees are mostly visited front to back, let the kernel read ahead aggressively
+  madvise(load_map, load_map_size, MADV_SEQUENTIAL);
+}
+
+static off_t tree_offset_binary(int32_t treenr)
+{
+  return sizeof(int) * (2 + (off_t) Ntrees) + sizeof(struct halo_data) * (off_t) TreeFirstHalo[treenr];
+}
+
+static void check_mapped_tree(int32_t filenr, int32_t treenr, off_t offset)
+{
+  if((size_t) offset + sizeof(struct halo_data) * TreeNHalos[treenr] > load_map_size)
+  {
+    fprintf(stderr, "Error: Tree %d extends beyond the end of file %d\n", treenr, filenr);
+    ABORT(0);
+  }
+}
@@ -4,6 +4,8 @@
 // Proto-Types //
 
 void load_tree_table_binary(int32_t filenr); 
-void load_tree_binary(int32_t filenr, int32_t treenr); 
+void load_tree_binary(int32_t filenr, int32_t treenr, struct halo_data *Halo);
+struct halo_data *map_tree_binary(int32_t filenr, int32_t treenr); 
+int64_t read_tree_file_nhalos_binary(int32_t filenr);
 void close_binary_file(void);
 #endif
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <math.h>
 #include <time.h>
@@ -24,11 +25,19 @@ struct METADATA_NAMES
   char name_TreeNHalos[MAX_STRING_LEN];
 }; 
 
+struct tree_field
+{
+  const char *name;   /* dataset name */
+  size_t offset;      /* member of struct halo_data */
+  int32_t dim;        /* values per halo */
+  int32_t datatype;   /* 0: int, 1: float, 2: long long */
+};
+
 // Local Proto-Types //
 
 int32_t fill_metadata_names(struct METADATA_NAMES *metadata_names, enum Valid_TreeTypes my_TreeType);
 int32_t read_attribute_int(hid_t my_hdf5_file, char *groupname, char *attr_name, int *attribute);
-int32_t read_dataset(hid_t my_hdf5_file, char *dataset_name, int32_t datatype, void *buffer);
+static int32_t read_halo_field(hid_t group_id, const struct tree_field *field, int32_t nhalos, struct halo_data *Halo);
 
 // External Functions //
 
@@ -86,8 +95,10 @@ void load_tree_table_hdf5(int filenr)
 
   TreeFirstHalo = mymalloc(sizeof(int) * Ntrees);
 
-  for (i = 0; i < 20; ++i)
+#ifdef DEBUG_HDF5_READER
+  for (i = 0; i < 20 && i < Ntrees; ++i)
     printf("Tree %d: NHalos %d\n", i, TreeNHalos[i]);
+#endif
 
   if(Ntrees)
     TreeFirstHalo[0] = 0;
@@ -96,48 +107,45 @@ void load_tree_table_hdf5(int filenr)
 
 }
 
-#define READ_TREE_PROPERTY(sage_name, hdf5_name, type_int, data_type) \
-{ \
-  snprintf(dataset_name, MAX_STRING_LEN - 1, "tree_%03d/%s", treenr, #hdf5_name);\
-  status = read_dataset(hdf5_file, dataset_name, type_int, buffer);\
-  if (status != EXIT_SUCCESS) \
-  {\
-    ABORT(0);\
-  }\
-  for (halo_idx = 0; halo_idx < NHalos_ThisTree; ++halo_idx)\
-  {\
-    Halo[halo_idx].sage_name = ((data_type*)buffer)[halo_idx];\
-  }\
-} \
-
-#define READ_TREE_PROPERTY_MULTIPLEDIM(sage_name, hdf5_name, type_int, data_type) \
-{ \
-  snprintf(dataset_name, MAX_STRING_LEN - 1, "tree_%03d/%s", treenr, #hdf5_name);\
-  status = read_dataset(hdf5_file, dataset_name, type_int, buffer_multipledim);\
-  if (status != EXIT_SUCCESS) \
-  {\
-    ABORT(0);\
-  }\
-  for (halo_idx = 0; halo_idx < NHalos_ThisTree; ++halo_idx)\
-  {\
-    for (dim = 0; dim < NDIM; ++dim)\
-    { \
-      Halo[halo_idx].sage_name[dim] = ((data_type*)buffer_multipledim)[halo_idx * NDIM + dim];\
-    } \
-  }\
-} \
-
-
-void load_tree_hdf5(int32_t filenr, int32_t treenr)
+// The halo fields read from the tree_NNN group of a tree. Every dataset holds just the
+// halos of that tree and is read straight into its member of struct halo_data: the
+// memory selection is a hyperslab that steps over the Halo array one struct at a time,
+// so there is no staging buffer and no copy loop. Only the fields used by the model
+// and the output are read; M_Mean200, M_TopHat, FileNr, SubhaloIndex and SubHalfMass
+// are left at zero.
+
+static const struct tree_field TreeFields[] =
 {
+  /* Merger Tree Pointers */
+  { "Descendant",          offsetof(struct halo_data, Descendant),          1, 0 },
+  { "FirstProgenitor",     offsetof(struct halo_data, FirstProgenitor),     1, 0 },
+  { "NextProgenitor",      offsetof(struct halo_data, NextProgenitor),      1, 0 },
+  { "FirstHaloInFOFgroup", offsetof(struct halo_data, FirstHaloInFOFgroup), 1, 0 },
+  { "NextHaloInFOFgroup",  offsetof(struct halo_data, NextHaloInFOFgroup),  1, 0 },
+
+  /* Halo Properties */
+  { "Len",                 offsetof(struct halo_data, Len),                 1, 0 },
+  { "Mvir",                offsetof(struct halo_data, Mvir),                1, 1 },
+  { "Pos",                 offsetof(struct halo_data, Pos),              NDIM, 1 },
+  { "Vel",                 offsetof(struct halo_data, Vel),              NDIM, 1 },
+  { "VelDisp",             offsetof(struct halo_data, VelDisp),             1, 1 },
+  { "Vmax",                offsetof(struct halo_data, Vmax),                1, 1 },
+  { "Spin",                offsetof(struct halo_data, Spin),             NDIM, 1 },
+  { "MostBoundID",         offsetof(struct halo_data, MostBoundID),         1, 2 },
 
-  char dataset_name[MAX_STRING_LEN];
-  int32_t NHalos_ThisTree, status, halo_idx, dim;
+  /* File Position Info */
+  { "SnapNum",             offsetof(struct halo_data, SnapNum),             1, 0 },
+};
+
+#define NTREEFIELDS ((int32_t) (sizeof(TreeFields) / sizeof(TreeFields[0])))
 
-  double *buffer; // Buffer to hold the read HDF5 data.  
-                  // The largest data-type will be double. 
 
-  double *buffer_multipledim; // However also need a buffer three times as large to hold data such as position/velocity.
+void load_tree_hdf5(int32_t filenr, int32_t treenr, struct halo_data *Halo)
+{
+
+  char group_name[MAX_STRING_LEN];
+  int32_t NHalos_ThisTree, status, i;
+  hid_t group_id;
 
   if (hdf5_file <= 0)
   {
@@ -148,56 +156,32 @@ void load_tree_hdf5(int32_t filenr, int32_t treenr)
 
   NHalos_ThisTree = TreeNHalos[treenr];
 
-  Halo = mymalloc(sizeof(struct halo_data) * NHalos_ThisTree); 
+  memset(Halo, 0, sizeof(struct halo_data) * NHalos_ThisTree);
+  if (NHalos_ThisTree == 0)
+    return;
 
-  buffer = calloc(NHalos_ThisTree, sizeof(*(buffer)));
-  if (buffer == NULL)
+  snprintf(group_name, MAX_STRING_LEN - 1, "tree_%03d", treenr);
+  group_id = H5Gopen2(hdf5_file, group_name, H5P_DEFAULT);
+  if (group_id < 0)
   {
-    fprintf(stderr, "Could not allocate memory for the HDF5 buffer.\n");
+    fprintf(stderr, "Error %d when trying to open up group %s of file %d\n", (int) group_id, group_name, filenr);
     ABORT(0);
   }
 
-  buffer_multipledim = calloc(NHalos_ThisTree * NDIM, sizeof(*(buffer_multipledim))); 
-  if (buffer_multipledim == NULL)
+  for (i = 0; i < NTREEFIELDS; ++i)
   {
-    fprintf(stderr, "Could not allocate memory for the HDF5 multiple dimension buffer.\n");
-    ABORT(0);
+    status = read_halo_field(group_id, &TreeFields[i], NHalos_ThisTree, Halo);
+    if (status != EXIT_SUCCESS)
+    {
+      fprintf(stderr, "Could not read %s/%s of file %d\n", group_name, TreeFields[i].name, filenr);
+      ABORT(0);
+    }
   }
 
-  // We now need to read in all the halo fields for this tree.
-  // To do so, we read the field into a buffer and then properly slot the field into the Halo struct.
-
-  /* Merger Tree Pointers */ 
-  READ_TREE_PROPERTY(Descendant, Descendant, 0, int);
-  READ_TREE_PROPERTY(FirstProgenitor, FirstProgenitor, 0, int);
-  READ_TREE_PROPERTY(NextProgenitor, NextProgenitor, 0, int);
-  READ_TREE_PROPERTY(FirstHaloInFOFgroup, FirstHaloInFOFgroup, 0, int);
-  READ_TREE_PROPERTY(NextHaloInFOFgroup, NextHaloInFOFgroup, 0, int);
-
-  /* Halo Properties */ 
-  READ_TREE_PROPERTY(Len, Len, 0, int);
-  READ_TREE_PROPERTY(M_Mean200, M_mean200, 1, float);
-  READ_TREE_PROPERTY(Mvir, Mvir, 1, float);
-  READ_TREE_PROPERTY(M_TopHat, M_TopHat, 1, float);
-  READ_TREE_PROPERTY_MULTIPLEDIM(Pos, Pos, 1, float);
-  READ_TREE_PROPERTY_MULTIPLEDIM(Vel, Vel, 1, float);
-  READ_TREE_PROPERTY(VelDisp, VelDisp, 1, float);
-  READ_TREE_PROPERTY(Vmax, Vmax, 1, float);
-  READ_TREE_PROPERTY_MULTIPLEDIM(Spin, Spin, 1, float);
-  READ_TREE_PROPERTY(MostBoundID, MostBoundID, 2, long long);
-
-  /* File Position Info */
-  READ_TREE_PROPERTY(SnapNum, SnapNum, 0, int);
-  READ_TREE_PROPERTY(FileNr, Filenr, 0, int);
-  READ_TREE_PROPERTY(SubhaloIndex, SubHaloIndex, 0, int);
-  READ_TREE_PROPERTY(SubHalfMass, SubHalfMass, 0, int);
-
-  free(buffer);
-  free(buffer_multipledim);
+  H5Gclose(group_id);
 
 #ifdef DEBUG_HDF5_READER 
-  int32_t i;
-  for (i = 0; i < 20; ++i)
+  for (i = 0; i < 20 && i < NHalos_ThisTree; ++i)
   { 
     printf("halo %d: Descendant %d FirstProg %d x %.4f y %.4f z %.4f\n", i, Halo[i].Descendant, Halo[i].FirstProgenitor, Halo[i].Pos[0], Halo[i].Pos[1], Halo[i].Pos[2]); 
   }
@@ -206,8 +190,35 @@ void load_tree_hdf5(int32_t filenr, int32_t treenr)
  
 }
 
-#undef READ_TREE_PROPERTY
-#undef READ_TREE_PROPERTY_MULTIPLEDIM
+#undef NTREEFIELDS
+
+int64_t read_tree_file_nhalos_hdf5(int32_t filenr)
+{
+  char buf[MAX_STRING_LEN];
+  int32_t totNHalos, status;
+  hid_t fd;
+
+  struct METADATA_NAMES metadata_names;
+
+  path_printf(buf, MAX_STRING_LEN, "%s/%s.%d%s", SimulationDir, TreeName, filenr, TreeExtension);
+  if (access(buf, R_OK) != 0)
+    return -1;  // missing files are skipped later on, don't let HDF5 complain about them
+
+  fd = H5Fopen(buf, H5F_ACC_RDONLY, H5P_DEFAULT);
+  if (fd < 0)
+    return -1;
+
+  status = fill_metadata_names(&metadata_names, TreeType);
+  if (status == EXIT_SUCCESS)
+    status = read_attribute_int(fd, "/Header", metadata_names.name_totNHalos, &totNHalos);
+
+  H5Fclose(fd);
+
+  if (status != EXIT_SUCCESS)
+    return -1;
+
+  return totNHalos;
+}
 
 void close_hdf5_file(void)
 {
@@ -232,6 +243,7 @@ int32_t fill_metadata_names(struct METADATA_NAMES *metadata_names, enum Valid_Tr
       return EXIT_SUCCESS;
 
     case lhalo_binary: 
+    case lhalo_binary_mmap: 
       fprintf(stderr, "If the file is binary then this function should never be called.  Something's gone wrong...");
       return EXIT_FAILURE;
 
@@ -276,26 +288,69 @@ int32_t read_attribute_int(hid_t my_hdf5_file, char *groupname, char *attr_name,
   return EXIT_SUCCESS; 
 }
 
-int32_t read_dataset(hid_t my_hdf5_file, char *dataset_name, int32_t datatype, void *buffer)
+static int32_t read_halo_field(hid_t group_id, const struct tree_field *field, int32_t nhalos, struct halo_data *Halo)
 {
-  hid_t dataset_id;
+  hid_t dataset_id, filespace_id, memspace_id, memtype;
+  hsize_t nmem, start, stride, count, block;
+  size_t elsize;
+  herr_t status;
+
+  switch (field->datatype)
+  {
+    case 0:
+      memtype = H5T_NATIVE_INT;
+      elsize = sizeof(int);
+      break;
+    case 1:
+      memtype = H5T_NATIVE_FLOAT;
+      elsize = sizeof(float);
+      break;
+    default:
+      memtype = H5T_NATIVE_LLONG;
+      elsize = sizeof(long long);
+      break;
+  }
 
-  dataset_id = H5Dopen2(hdf5_file, dataset_name, H5P_DEFAULT);
+  // the Halo array seen as an array of elsize values, so that its members fall on elements
+  assert(sizeof(struct halo_data) % elsize == 0 && field->offset % elsize == 0);
+
+  dataset_id = H5Dopen2(group_id, field->name, H5P_DEFAULT);
   if (dataset_id < 0)
   {
-    fprintf(stderr, "Error %d when trying to open up dataset %s\n", dataset_id, dataset_name); 
+    fprintf(stderr, "Error %d when trying to open up dataset %s\n", (int) dataset_id, field->name); 
     return dataset_id;
   }
 
-  if (datatype == 0)
-    H5Dread(dataset_id, H5T_NATIVE_INT, H5S_ALL, H5S_ALL, H5P_DEFAULT, buffer);
-  else if (datatype == 1)  
-    H5Dread(dataset_id, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, buffer);
- 
-  else if (datatype == 2)
-    H5Dread(dataset_id, H5T_NATIVE_LLONG, H5S_ALL, H5S_ALL, H5P_DEFAULT, buffer);
+  filespace_id = H5Dget_space(dataset_id);
+  if (H5Sget_simple_extent_npoints(filespace_id) != (hssize_t) nhalos * field->dim)
+  {
+    fprintf(stderr, "Dataset %s has %lld values instead of %d per halo for %d halos\n", field->name,
+            (long long) H5Sget_simple_extent_npoints(filespace_id), field->dim, nhalos);
+    H5Sclose(filespace_id);
+    H5Dclose(dataset_id);
+    return EXIT_FAILURE;
+  }
 
+  nmem = (hsize_t) nhalos * (sizeof(struct halo_data) / elsize);
+  start = field->offset / elsize;
+  stride = sizeof(struct halo_data) / elsize;
+  count = nhalos;
+  block = field->dim;
+
+  memspace_id = H5Screate_simple(1, &nmem, NULL);
+  status = H5Sselect_hyperslab(memspace_id, H5S_SELECT_SET, &start, &stride, &count, &block);
+  if (status >= 0)
+    status = H5Dread(dataset_id, memtype, memspace_id, filespace_id, H5P_DEFAULT, Halo);
+
+  H5Sclose(memspace_id);
+  H5Sclose(filespace_id);
+  H5Dclose(dataset_id);
+
+  if (status < 0)
+  {
+    fprintf(stderr, "Error %d when reading dataset %s\n", (int) status, field->name);
+    return status;
+  }
 
-  
   return EXIT_SUCCESS;
 }
@@ -7,7 +7,8 @@
 // Proto-Types //
 
 void load_tree_table_hdf5(int filenr);
-void load_tree_hdf5(int32_t filenr, int32_t treenr);
+void load_tree_hdf5(int32_t filenr, int32_t treenr, struct halo_data *Halo);
+int64_t read_tree_file_nhalos_hdf5(int32_t filenr);
 void close_hdf5_file(void);
 
 #endif
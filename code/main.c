@@ -11,6 +11,10 @@
 #include <mpi.h>
 #endif
 
+#ifdef OPENMP
+#include <omp.h>
+#endif
+
 #include "core_allvars.h"
 #include "core_proto.h"
 
@@ -18,6 +22,7 @@
 
 char bufz0[1000];
 int exitfail = 1;
+int checkpointed = 0;   /* bufz0 has a checkpoint, keep it for the restart */
 
 struct sigaction saveaction_XCPU;
 volatile sig_atomic_t gotXCPU = 0;
@@ -55,7 +60,8 @@ void bye()
 
   if(exitfail)
   {
-    unlink(bufz0);
+    if(!checkpointed)
+      unlink(bufz0);
 
 #ifdef MPI
     if(ThisTask == 0 && gotXCPU == 1)
@@ -66,9 +72,20 @@ void bye()
 
 
 
+// a restart point after every CheckpointEveryTrees trees, for the binary files
+static int checkpoint_due(int treenr)
+{
+  return CheckpointEveryTrees > 0 && checkpoints_enabled() && (treenr + 1) % CheckpointEveryTrees == 0 && treenr + 1 < Ntrees;
+}
+
+
+
 int main(int argc, char **argv)
 {
-  int filenr, treenr, halonr;
+  int filenr, treenr, group, nctx, firsttree, lastsaved, ntodo, i;
+  int *order;
+  struct staged_galaxies **staged;
+  struct tree_context *TreeContext;
   struct sigaction current_XCPU;
 
   struct stat filestatus;
@@ -104,12 +121,47 @@ int main(int argc, char **argv)
 
   read_parameter_file(argv[1]);
   init();
+  if(strcmp(SweepFile, "none") != 0)
+    read_sweep_file();
+  else if(GalaxyStats)
+    init_galaxy_stats(1);
+
+#ifdef HDF5
+  if(HDF5Output)
+    calc_hdf5_props();
+#endif
 
-#ifdef MPI
-  for(filenr = FirstFile+ThisTask; filenr <= LastFile; filenr += NTask)
+#ifdef OPENMP
+  printf("Processing the trees of each file with %d OpenMP threads\n", omp_get_max_threads());
+  if(FoFParallelMinHalos > 0)
+  {
+    omp_set_max_active_levels(2);   // the FoF groups of a big tree get a team of their own
+    printf("and the FoF groups of trees with at least %d halos as well\n", FoFParallelMinHalos);
+  }
+#endif
+  if(StreamTreesMinHalos > 0)
+    printf("Trees with at least %d halos are evolved snapshot by snapshot and written as they go\n", StreamTreesMinHalos);
+
+  start_output_writer();
+
+  // files are handed out one by one; under MPI the largest go first to whichever task is free
+  init_file_schedule();
+
+  // one tree_context per thread for the whole run, so the memory of a tree is reused by
+  // all the later trees and files
+#ifdef OPENMP
+  nctx = omp_get_max_threads();
 #else
-  for(filenr = FirstFile; filenr <= LastFile; filenr++)
+  nctx = 1;
 #endif
+  TreeContext = mymalloc(sizeof(struct tree_context) * nctx);
+  for(group = 0; group < nctx; group++)
+    init_tree_context(&TreeContext[group]);
+
+  if(SharedOutput)
+    open_shared_output();
+
+  while((filenr = get_next_file()) >= 0 && !gotXCPU)
   {
     sprintf(bufz0, "%s/%s.%d%s", SimulationDir, TreeName, filenr, TreeExtension);
     if(!(fd = fopen(bufz0, "r")))
@@ -120,56 +172,282 @@ int main(int argc, char **argv)
     else
       fclose(fd);
 
-    sprintf(bufz0, "%s/%s_z%1.3f_%d", OutputDir, FileNameGalaxies, ZZ[ListOutputSnaps[0]], filenr);
-    if(stat(bufz0, &filestatus) == 0)
+    if(TreeOrder == 2 || strcmp(SweepFile, "none") != 0)
     {
-      printf("-- output for tree %s already exists ... skipping\n", bufz0);
-      continue;  // output seems to already exist, dont overwrite, move along
+      bufz0[0] = 0;  // no galaxy files
+      load_tree_table(filenr, TreeType);
+      order = mymalloc(sizeof(int) * (Ntrees > 0 ? Ntrees : 1));
+      ntodo = plan_tree_order(filenr, 0, order);
+      if(TreeOrder == 2)
+        printf("-- schedule of tree file %d written\n", filenr);
+      else
+        sweep_tree_file(filenr, order, ntodo, TreeContext);
+      myfree(order);
+      free_tree_table(TreeType);
+      continue;
     }
 
-    if((fd = fopen(bufz0, "w")))
-      fclose(fd);
+    if(HDF5Output)
+      path_printf(bufz0, sizeof(bufz0), "%s/%s_%03d.hdf5", OutputDir, FileNameGalaxies, filenr);
+    else
+      sprintf(bufz0, "%s/%s_z%1.3f_%d", OutputDir, FileNameGalaxies, ZZ[ListOutputSnaps[0]], filenr);
+    checkpointed = checkpoint_exists(filenr);
+    if(SharedOutput || !CatalogOutput)
+      bufz0[0] = 0;  // the shared files were started afresh, or there are none, and there is nothing of this file to remove
+    else
+    {
+      if(!checkpointed && stat(bufz0, &filestatus) == 0)
+      {
+        printf("-- output for tree %s already exists ... skipping\n", bufz0);
+        continue;  // output seems to already exist, dont overwrite, move along
+      }
+    }
 
-    FileNum = filenr;
     load_tree_table(filenr, TreeType);
+    firsttree = 0;
+    if(checkpointed)
+    {
+      firsttree = read_checkpoint(filenr);
+      printf("-- resuming %s from its checkpoint at tree %d of %d\n", bufz0, firsttree, Ntrees);
+    }
+    else if(bufz0[0])
+    {
+      // the restart point before the first tree goes first, then the file that claims the
+      // tree file, so a run killed at any point after this redoes the file
+      if(checkpoints_enabled())
+      {
+        write_checkpoint(filenr, -1);
+        checkpointed = 1;
+      }
+      if((fd = fopen(bufz0, "w")))
+        fclose(fd);
+    }
+    lastsaved = firsttree - 1;
+    start_tree_window(lastsaved);
+
+    // the trees in the order they are evolved, and with TreeOrder the galaxies of those
+    // that are done but can't be written yet
+    order = mymalloc(sizeof(int) * (Ntrees > 0 ? Ntrees : 1));
+    ntodo = plan_tree_order(filenr, firsttree, order);
+    staged = NULL;
+    if(TreeOrder)
+    {
+      staged = mymalloc(sizeof(struct staged_galaxies *) * (Ntrees > 0 ? Ntrees : 1));
+      for(i = 0; i < Ntrees; i++)
+        staged[i] = NULL;
+    }
+
+    start_tree_prefetch(filenr, order, ntodo, TreeType);
+    TIMING_BEGIN_FILE();
+#ifdef OPENMP
+    reset_idle_threads();
+#endif
 
-    for(treenr = 0; treenr < Ntrees; treenr++)
+    // Trees of one file are independent, so a pool of threads can work on them at once. 
+    // Each thread owns a tree_context; the ordered section makes sure the galaxies are 
+    // still written tree by tree, exactly as in the serial code. 
+#ifdef OPENMP
+#pragma omp parallel private(treenr, group, i)
+#endif
     {
-      
-			assert(!gotXCPU);
+#ifdef OPENMP
+      struct tree_context *ctx = &TreeContext[omp_get_thread_num()];
+#else
+      struct tree_context *ctx = &TreeContext[0];
+#endif
 
-      if(treenr % 10000 == 0)
+#ifdef OPENMP
+#pragma omp for schedule(dynamic) ordered nowait
+#endif
+      for(i = 0; i < ntodo; i++)
       {
+        treenr = order[i];
+
+        // with TreeOrder a tree waits until it is close enough to the trees written; on
+        // SIGXCPU the trees not started yet are left for the restart
+        while(!gotXCPU && !wait_tree_window(treenr))
+          ;
+        if(gotXCPU)
+          continue;
+
+        if((firsttree + i) % 10000 == 0)
+        {
 #ifdef MPI
-        printf("\ttask: %d\tnode: %s\tfile: %i\ttree: %i of %i\n", ThisTask, ThisNode, filenr, treenr, Ntrees);
+          printf("\ttask: %d\tnode: %s\tfile: %i\ttree: %i of %i\n", ThisTask, ThisNode, filenr, firsttree + i, Ntrees);
 #else
-				printf("\tfile: %i\ttree: %i of %i\n", filenr, treenr, Ntrees);
+          printf("\tfile: %i\ttree: %i of %i\n", filenr, firsttree + i, Ntrees);
+#endif
+          fflush(stdout);
+        }
+
+        TIMING_BEGIN_TREE();
+        TIMING_START(timing_load_tree);
+        load_tree(filenr, treenr, TreeType, ctx);
+        TIMING_STOP(timing_load_tree);
+
+        // a streamed tree writes its galaxies while it is evolved, so that waits for its turn below
+        int streamed = is_streamed_tree(treenr);
+
+        TIMING_START(timing_construct_galaxies);
+        build_fof_order(TreeNHalos[treenr], ctx);
+        if(!streamed)
+        {
+#ifdef OPENMP
+          if(FoFParallelMinHalos > 0 && TreeNHalos[treenr] >= FoFParallelMinHalos)
+            construct_galaxies_parallel(ctx);
+          else
+#endif
+          for(group = 0; group < ctx->NumFoFGroups; group++)
+            construct_galaxies(ctx->FoFOrder[group], ctx);
+        }
+        TIMING_STOP(timing_construct_galaxies);
+#ifdef TIMING
+        int ngals = ctx->NumGals;   // with USE-WRITER the tree leaves ctx when it is saved
+#endif
+
+        // out of order the records are made here, in parallel, and wait for their turn
+        struct staged_galaxies *s = NULL;
+        if(TreeOrder)
+        {
+          TIMING_START(timing_save_galaxies);
+          s = stage_galaxies(filenr, treenr, ctx);
+          TIMING_STOP(timing_save_galaxies);
+        }
+
+#ifdef OPENMP
+#pragma omp ordered
 #endif
-				fflush(stdout);
+        if(TreeOrder)
+        {
+          // write every tree whose predecessors are all written by now
+          TIMING_START(timing_save_galaxies);
+          staged[treenr] = s;
+          while(lastsaved + 1 < Ntrees && staged[lastsaved + 1])
+          {
+            lastsaved++;
+            save_staged_galaxies(filenr, lastsaved, staged[lastsaved]);
+            staged[lastsaved] = NULL;
+            if(checkpoint_due(lastsaved))
+            {
+              write_checkpoint(filenr, lastsaved);
+              checkpointed = 1;
+            }
+          }
+          advance_tree_window(lastsaved);
+          TIMING_STOP(timing_save_galaxies);
+        }
+        // the galaxies of all earlier trees must be out before these, otherwise a tree
+        // was skipped after SIGXCPU and the rest of the file is redone by the restart
+        else if(lastsaved == treenr - 1)
+        {
+          if(streamed)
+          {
+            TIMING_START(timing_construct_galaxies);
+            wait_output_writer();   // the trees before it go into the same buffers
+            stream_tree_galaxies(filenr, treenr, ctx);
+            TIMING_STOP(timing_construct_galaxies);
+#ifdef TIMING
+            ngals = ctx->NumGals;
+#endif
+          }
+
+          TIMING_START(timing_save_galaxies);
+          if(!streamed)
+            output_tree_galaxies(filenr, treenr, ctx);
+          lastsaved = treenr;
+          if(checkpoint_due(treenr))
+          {
+            write_checkpoint(filenr, treenr);
+            checkpointed = 1;
+          }
+          TIMING_STOP(timing_save_galaxies);
+        }
+
+        TIMING_END_TREE(treenr, ngals);
+        free_galaxies_and_tree(ctx);
       }
 
-      TreeID = treenr;
-      load_tree(filenr, treenr, TreeType);
+#ifdef OPENMP
+      mark_thread_idle();   // its core can go to the FoF groups of a big tree still running
+#endif
+      TIMING_MERGE_THREAD();
+    }
+
+    wait_output_writer();   // the writer may still hold trees borrowed from the prefetch queue
+    stop_tree_prefetch();
 
-      gsl_rng_set(random_generator, filenr * 100000 + treenr);
-      NumGals = 0;
-      GalaxyCounter = 0;
-      for(halonr = 0; halonr < TreeNHalos[treenr]; halonr++)
-        if(HaloAux[halonr].DoneFlag == 0)
-        construct_galaxies(halonr, treenr);
+    // after SIGXCPU trees beyond the first one missing may be done; the restart redoes them
+    if(TreeOrder)
+    {
+      for(i = lastsaved + 1; i < Ntrees; i++)
+        if(staged[i])
+          free_staged_galaxies(staged[i]);
+    }
+
+    if(lastsaved < Ntrees - 1)
+    {
+      // stopped by SIGXCPU; the HDF5 tables, the history index and the statistics can't be
+      // resumed, so that file is removed and redone, or the whole run without catalogs
+      if(HDF5Output || HistoryOutput || !CatalogOutput)
+        ABORT(0);
+
+      // the restart point goes out before anything is freed, so a failure there can't lose it;
+      // nor can a block of the shared files be resumed, the file is left out of them (offset -1)
+      if(!SharedOutput && lastsaved >= firsttree)
+      {
+        write_checkpoint(filenr, lastsaved);
+        checkpointed = 1;
+      }
 
-      save_galaxies(filenr, treenr);
-      free_galaxies_and_tree();
+      if(SharedOutput)
+        printf("-- stopped tree file %d after tree %d of %d, it is not in the shared output\n", filenr, lastsaved, Ntrees);
+      else if(checkpointed && lastsaved >= 0)
+        printf("-- stopped %s after tree %d of %d, the next run continues from there\n", bufz0, lastsaved, Ntrees);
+      else if(checkpointed)
+        printf("-- stopped %s before its first tree, the next run starts it again\n", bufz0);
+      else
+        unlink(bufz0);  // no galaxies saved yet, the next run starts the file again
+
+      // in the same order as at the end of a file, the last allocated first
+      TIMING_ABORT_FILE();
+      if(TreeOrder)
+        myfree(staged);
+      myfree(order);
+      free_tree_table(TreeType);
+      break;
     }
 
     finalize_galaxy_file(filenr);
+    end_file_galaxy_stats(filenr);
+    remove_checkpoint(filenr);
+    checkpointed = 0;
+    TIMING_END_FILE(filenr);
+    if(TreeOrder)
+      myfree(staged);
+    myfree(order);
     free_tree_table(TreeType);
 
     printf("\ndone file %d\n\n", filenr);
   }
 
-/*
-  if(HDF5Output){
+  if(strcmp(SweepFile, "none") != 0)
+    write_sweep_results();
+  write_galaxy_stats();  // collective as well
+
+  if(SharedOutput)
+    close_shared_output();  // collective, every task gets here once the files are all handed out
+
+  for(group = nctx - 1; group >= 0; group--)
+    free_tree_context(&TreeContext[group]);
+  myfree(TreeContext);
+  stop_output_writer();
+
+  finalize_file_schedule();
+  TIMING_END_RUN();
+
+#ifdef HDF5
+  if(HDF5Output)
+  {
     free_hdf5_ids();
 
 #ifdef MPI
@@ -177,20 +455,26 @@ int main(int argc, char **argv)
     MPI_Barrier(MPI_COMM_WORLD);
     if (ThisTask == 0)
 #endif
-      //write_master_file();
-  
+      write_master_file();
   }
-*/
-
+#endif
 
   //free Ages. But first
   //reset Age to the actual allocated address
   Age--;
   myfree(Age);                              
 
-  gsl_rng_free(random_generator); 
-
   exitfail = 0;
+
+  if(gotXCPU)
+  {
+#ifdef MPI
+    if(ThisTask == 0)
+#endif
+      printf("Received XCPU, exiting. But we'll be back.\n");
+    return EXIT_FAILURE;
+  }
+
   return 0;
 }
 
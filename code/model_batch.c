@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "core_allvars.h"
+#include "core_proto.h"
+
+// Reductions over all galaxies of a FoF group. They read the fields straight from
+// Gal[]: each field is summed once per call, so copying them into contiguous arrays
+// first costs more than it saves. With USE-SIMD the loops may be vectorised and the
+// order of the additions may change (the results then differ in the last bits),
+// without it they are added in the order of Gal[] as before.
+
+
+
+// totals of the FoF group for infall_recipe, tot_satBaryons without the central
+void sum_fof_baryons(const struct GALAXY *Gal, int ngal, int centralgal, struct fof_baryons *tot)
+{
+  double stellar = 0.0, bh = 0.0, cold = 0.0, hot = 0.0, hotMetals = 0.0;
+  double ejected = 0.0, ejectedMetals = 0.0, ics = 0.0, icsMetals = 0.0, satBaryons = 0.0;
+  int i;
+
+  SIMD_REDUCE(stellar, bh, cold, hot, hotMetals, ejected, ejectedMetals, ics, icsMetals, satBaryons)
+  for(i = 0; i < ngal; i++)
+  {
+    stellar += Gal[i].StellarMass;
+    bh += Gal[i].BlackHoleMass;
+    cold += Gal[i].ColdGas;
+    hot += Gal[i].HotGas;
+    hotMetals += Gal[i].MetalsHotGas;
+    ejected += Gal[i].EjectedMass;
+    ejectedMetals += Gal[i].MetalsEjectedMass;
+    ics += Gal[i].ICS;
+    icsMetals += Gal[i].MetalsICS;
+
+    // adding 0.0 for the central leaves the sum exactly as skipping it would
+    satBaryons += i != centralgal ? Gal[i].StellarMass + Gal[i].BlackHoleMass + Gal[i].ColdGas + Gal[i].HotGas : 0.0f;
+  }
+
+  tot->StellarMass = stellar;
+  tot->BlackHoleMass = bh;
+  tot->ColdGas = cold;
+  tot->HotGas = hot;
+  tot->MetalsHotGas = hotMetals;
+  tot->EjectedMass = ejected;
+  tot->MetalsEjectedMass = ejectedMetals;
+  tot->ICS = ics;
+  tot->MetalsICS = icsMetals;
+  tot->SatelliteBaryons = satBaryons;
+}
+
+
+
+// baryons in the satellites that have not merged, summed in single precision
+// like Gal[centralgal].TotalSatelliteBaryons always was
+float sum_satellite_baryons(const struct GALAXY *Gal, int ngal, int centralgal)
+{
+  float sum = 0.0f;
+  int i;
+
+  SIMD_REDUCE(sum)
+  for(i = 0; i < ngal; i++)
+    sum += (i != centralgal && Gal[i].mergeType == 0) ?
+      Gal[i].StellarMass + Gal[i].BlackHoleMass + Gal[i].ColdGas + Gal[i].HotGas : 0.0f;
+
+  return sum;
+}
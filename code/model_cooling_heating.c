@@ -10,7 +10,7 @@
 
 
 
-double cooling_recipe(int gal, double dt)
+double cooling_recipe(int gal, double dt, struct GALAXY *Gal)
 {
   double tcool, x, logZ, lambda, rcool, rho_rcool, rho0, temp, coolingGas;
 
@@ -49,8 +49,8 @@ double cooling_recipe(int gal, double dt)
 		// at this point we have calculated the maximal cooling rate
 		// if AGNrecipeOn we now reduce it in line with past heating before proceeding
 
-		if(AGNrecipeOn > 0 && coolingGas > 0.0)
-			coolingGas = do_AGN_heating(coolingGas, gal, dt, x, rcool);
+		if(AGN_RECIPE > 0 && coolingGas > 0.0)
+			coolingGas = do_AGN_heating(coolingGas, gal, dt, x, rcool, Gal);
 	
 		if (coolingGas > 0.0)
 			Gal[gal].Cooling += 0.5 * coolingGas * Gal[gal].Vvir * Gal[gal].Vvir;
@@ -65,7 +65,7 @@ double cooling_recipe(int gal, double dt)
 
 
 
-double do_AGN_heating(double coolingGas, int centralgal, double dt, double x, double rcool)
+double do_AGN_heating(double coolingGas, int centralgal, double dt, double x, double rcool, struct GALAXY *Gal)
 {
   double AGNrate, EDDrate, AGNaccreted, AGNcoeff, AGNheating, metallicity, r_heat_new;
 
@@ -81,12 +81,12 @@ double do_AGN_heating(double coolingGas, int centralgal, double dt, double x, do
   if(Gal[centralgal].HotGas > 0.0)
   {
 
-    if(AGNrecipeOn == 2)
+    if(AGN_RECIPE == 2)
     {
       // Bondi-Hoyle accretion recipe
       AGNrate = (2.5 * M_PI * G) * (0.375 * 0.6 * x) * Gal[centralgal].BlackHoleMass * RadioModeEfficiency;
     }
-    else if(AGNrecipeOn == 3)
+    else if(AGN_RECIPE == 3)
     {
       // Cold cloud accretion: trigger: rBH > 1.0e-4 Rsonic, and accretion rate = 0.01% cooling rate 
       if(Gal[centralgal].BlackHoleMass > 0.0001 * Gal[centralgal].Mvir * pow(rcool/Gal[centralgal].Rvir, 3.0))
@@ -158,7 +158,7 @@ double do_AGN_heating(double coolingGas, int centralgal, double dt, double x, do
 
 
 
-void cool_gas_onto_galaxy(int centralgal, double coolingGas)
+void cool_gas_onto_galaxy(int centralgal, double coolingGas, struct GALAXY *Gal)
 {
   double metallicity;
 
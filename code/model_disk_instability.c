@@ -9,7 +9,7 @@
 
 
 
-void check_disk_instability(int p, int centralgal, int halonr, double time, double dt, int step)
+void check_disk_instability(int p, int centralgal, int halonr, double time, double dt, int step, struct GALAXY *Gal, struct GALAXY_HISTORY *History)
 {
   double Mcrit, gas_fraction, unstable_gas, unstable_gas_fraction, unstable_stars, diskmass, metallicity;
   double star_fraction;
@@ -62,10 +62,10 @@ void check_disk_instability(int p, int centralgal, int halonr, double time, doub
       }
 
       unstable_gas_fraction = unstable_gas / Gal[p].ColdGas;
-      if(AGNrecipeOn > 0)
-        grow_black_hole(p, unstable_gas_fraction);
+      if(AGN_RECIPE > 0)
+        grow_black_hole(p, unstable_gas_fraction, Gal);
     
-      collisional_starburst_recipe(unstable_gas_fraction, p, centralgal, time, dt, halonr, 1, step);
+      collisional_starburst_recipe(unstable_gas_fraction, p, centralgal, time, dt, halonr, 1, step, Gal, History);
     }
 
   }
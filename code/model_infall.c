@@ -9,49 +9,38 @@
 
 
 
-double infall_recipe(int centralgal, int ngal, double Zcurr)
+double infall_recipe(int centralgal, int ngal, double Zcurr, struct GALAXY *Gal)
 {
   int i;
   double tot_stellarMass, tot_BHMass, tot_coldMass, tot_hotMass, tot_ejected, tot_ICS;
-	double tot_hotMetals, tot_ejectedMetals, tot_ICSMetals;
+	double tot_ejectedMetals, tot_ICSMetals;
 	double tot_satBaryons, newSatBaryons;
   double infallingMass, reionization_modifier;
+  struct fof_baryons tot;
 
   // need to add up all the baryonic mass asociated with the full halo 
-  tot_stellarMass = tot_coldMass = tot_hotMass = tot_hotMetals = tot_ejected = tot_BHMass = tot_ejectedMetals = tot_ICS = tot_ICSMetals = tot_satBaryons = 0.0;
-
-	// loop over all galaxies in the FoF-halo 
+  sum_fof_baryons(Gal, ngal, centralgal, &tot);
+  tot_stellarMass = tot.StellarMass;
+  tot_BHMass = tot.BlackHoleMass;
+  tot_coldMass = tot.ColdGas;
+  tot_hotMass = tot.HotGas;
+  tot_ejected = tot.EjectedMass;
+  tot_ejectedMetals = tot.MetalsEjectedMass;
+  tot_ICS = tot.ICS;
+  tot_ICSMetals = tot.MetalsICS;
+  tot_satBaryons = tot.SatelliteBaryons;
+
+  // satellite ejected gas and ICS go to the central's reserviors
   for(i = 0; i < ngal; i++)
-  {
-    tot_stellarMass += Gal[i].StellarMass;
-    tot_BHMass += Gal[i].BlackHoleMass;
-    tot_coldMass += Gal[i].ColdGas;
-    tot_hotMass += Gal[i].HotGas;
-    tot_hotMetals += Gal[i].MetalsHotGas;
-    tot_ejected += Gal[i].EjectedMass;
-    tot_ejectedMetals += Gal[i].MetalsEjectedMass;
-    tot_ICS += Gal[i].ICS;
-    tot_ICSMetals += Gal[i].MetalsICS;
-
-		// record the current baryons in satellites only
-    if(i != centralgal)
-			tot_satBaryons += Gal[i].StellarMass + Gal[i].BlackHoleMass + Gal[i].ColdGas + Gal[i].HotGas;
-
-    // satellite ejected gas goes to central ejected reservior
     if(i != centralgal)
-      Gal[i].EjectedMass = Gal[i].MetalsEjectedMass = 0.0;
-
-    // satellite ICS goes to central ICS
-    if(i != centralgal) 
-      Gal[i].ICS = Gal[i].MetalsICS = 0.0; 
-  }
+      Gal[i].EjectedMass = Gal[i].MetalsEjectedMass = Gal[i].ICS = Gal[i].MetalsICS = 0.0;
 
 	// the existing baryons that have fallen in with substructure since the last timestep
 	newSatBaryons = tot_satBaryons - Gal[centralgal].TotalSatelliteBaryons;
 
   // include reionization if necessary 
-  if(ReionizationOn)
-    reionization_modifier = do_reionization(centralgal, Zcurr);
+  if(REIONIZATION)
+    reionization_modifier = do_reionization(centralgal, Zcurr, Gal);
   else
     reionization_modifier = 1.0;
 
@@ -86,12 +75,12 @@ double infall_recipe(int centralgal, int ngal, double Zcurr)
 
 
 
-void strip_from_satellite(int halonr, int centralgal, int gal)
+void strip_from_satellite(int halonr, int centralgal, int gal, struct GALAXY *Gal, struct halo_data *Halo)
 {
   double reionization_modifier, strippedGas, strippedGasMetals, metallicity;
   
-  if(ReionizationOn)
-    reionization_modifier = do_reionization(gal, ZZ[Halo[halonr].SnapNum]);
+  if(REIONIZATION)
+    reionization_modifier = do_reionization(gal, ZZ[Halo[halonr].SnapNum], Gal);
   else
     reionization_modifier = 1.0;
   
@@ -118,7 +107,7 @@ void strip_from_satellite(int halonr, int centralgal, int gal)
 
 
 
-double do_reionization(int gal, double Zcurr)
+double do_reionization(int gal, double Zcurr, struct GALAXY *Gal)
 {
   double alpha, a, f_of_a, a_on_a0, a_on_ar, Mfiltering, Mjeans, Mchar, mass_to_use, modifier;
   double Tvir, Vchar, omegaZ, xZ, deltacritZ, HubbleZ;
@@ -173,7 +162,7 @@ double do_reionization(int gal, double Zcurr)
 
 
 
-void add_infall_to_hot(int gal, double infallingGas)
+void add_infall_to_hot(int gal, double infallingGas, struct GALAXY *Gal)
 {
   float metallicity;
 
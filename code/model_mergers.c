@@ -10,7 +10,7 @@
 
 
 
-double estimate_merging_time(int sat_halo, int mother_halo, int ngal)
+double estimate_merging_time(int sat_halo, int mother_halo, int ngal, struct GALAXY *Gal, struct halo_data *Halo)
 {
   double coulomb, mergtime, SatelliteMass, SatelliteRadius;
 
@@ -23,12 +23,12 @@ double estimate_merging_time(int sat_halo, int mother_halo, int ngal)
   
   coulomb = log(Halo[mother_halo].Len / ((double) Halo[sat_halo].Len) + 1);
 
-  SatelliteMass = get_virial_mass(sat_halo) + Gal[ngal].StellarMass + Gal[ngal].ColdGas;
-  SatelliteRadius = get_virial_radius(mother_halo);
+  SatelliteMass = get_virial_mass(sat_halo, Halo) + Gal[ngal].StellarMass + Gal[ngal].ColdGas;
+  SatelliteRadius = get_virial_radius(mother_halo, Halo);
 
   if(SatelliteMass > 0.0 && coulomb > 0.0)
     mergtime = 2.0 *
-    1.17 * SatelliteRadius * SatelliteRadius * get_virial_velocity(mother_halo) / (coulomb * G * SatelliteMass);
+    1.17 * SatelliteRadius * SatelliteRadius * get_virial_velocity(mother_halo, Halo) / (coulomb * G * SatelliteMass);
   else
     mergtime = -1.0;
   
@@ -38,7 +38,7 @@ double estimate_merging_time(int sat_halo, int mother_halo, int ngal)
 
 
 
-void deal_with_galaxy_merger(int p, int merger_centralgal, int centralgal, double time, double dt, int halonr, int step)
+void deal_with_galaxy_merger(int p, int merger_centralgal, int centralgal, double time, double dt, int halonr, int step, struct GALAXY *Gal, struct GALAXY_HISTORY *History)
 {
   double mi, ma, mass_ratio;
 
@@ -60,21 +60,21 @@ void deal_with_galaxy_merger(int p, int merger_centralgal, int centralgal, doubl
   else
     mass_ratio = 1.0;
 
-  add_galaxies_together(merger_centralgal, p);
+  add_galaxies_together(merger_centralgal, p, Gal, History);
 
   // grow black hole through accretion from cold disk during mergers, a la Kauffmann & Haehnelt (2000) 
-  if(AGNrecipeOn)
-    grow_black_hole(merger_centralgal, mass_ratio);
+  if(AGN_RECIPE)
+    grow_black_hole(merger_centralgal, mass_ratio, Gal);
   
   // starburst recipe similar to Somerville et al. 2001
-  collisional_starburst_recipe(mass_ratio, merger_centralgal, centralgal, time, dt, halonr, 0, step);
+  collisional_starburst_recipe(mass_ratio, merger_centralgal, centralgal, time, dt, halonr, 0, step, Gal, History);
 
   if(mass_ratio > 0.1)
 		Gal[merger_centralgal].TimeOfLastMinorMerger = time;
 
   if(mass_ratio > ThreshMajorMerger)
   {
-    make_bulge_from_burst(merger_centralgal);
+    make_bulge_from_burst(merger_centralgal, Gal, History);
     Gal[merger_centralgal].TimeOfLastMajorMerger = time;
     Gal[p].mergeType = 2;  // mark as major merger
   }
@@ -87,7 +87,7 @@ void deal_with_galaxy_merger(int p, int merger_centralgal, int centralgal, doubl
 
 
 
-void grow_black_hole(int merger_centralgal, double mass_ratio)
+void grow_black_hole(int merger_centralgal, double mass_ratio, struct GALAXY *Gal)
 {
   double BHaccrete, metallicity;
 
@@ -107,13 +107,13 @@ void grow_black_hole(int merger_centralgal, double mass_ratio)
 
     Gal[merger_centralgal].QuasarModeBHaccretionMass += BHaccrete;
 
-    quasar_mode_wind(merger_centralgal, BHaccrete);
+    quasar_mode_wind(merger_centralgal, BHaccrete, Gal);
   }
 }
 
 
 
-void quasar_mode_wind(int gal, float BHaccrete)
+void quasar_mode_wind(int gal, float BHaccrete, struct GALAXY *Gal)
 {
   float quasar_energy, cold_gas_energy, hot_gas_energy;
   
@@ -145,7 +145,7 @@ void quasar_mode_wind(int gal, float BHaccrete)
 
 
 
-void add_galaxies_together(int t, int p)
+void add_galaxies_together(int t, int p, struct GALAXY *Gal, struct GALAXY_HISTORY *History)
 {
   int step;
   
@@ -172,15 +172,15 @@ void add_galaxies_together(int t, int p)
 
   for(step = 0; step < STEPS; step++)
   {
-    Gal[t].SfrBulge[step] += Gal[p].SfrDisk[step] + Gal[p].SfrBulge[step];
-    Gal[t].SfrBulgeColdGas[step] += Gal[p].SfrDiskColdGas[step] + Gal[p].SfrBulgeColdGas[step];
-    Gal[t].SfrBulgeColdGasMetals[step] += Gal[p].SfrDiskColdGasMetals[step] + Gal[p].SfrBulgeColdGasMetals[step];
+    History[t].SfrBulge[step] += History[p].SfrDisk[step] + History[p].SfrBulge[step];
+    History[t].SfrBulgeColdGas[step] += History[p].SfrDiskColdGas[step] + History[p].SfrBulgeColdGas[step];
+    History[t].SfrBulgeColdGasMetals[step] += History[p].SfrDiskColdGasMetals[step] + History[p].SfrBulgeColdGasMetals[step];
   }
 }
 
 
 
-void make_bulge_from_burst(int p)
+void make_bulge_from_burst(int p, struct GALAXY *Gal, struct GALAXY_HISTORY *History)
 {
   int step;
   
@@ -191,18 +191,18 @@ void make_bulge_from_burst(int p)
   // update the star formation rate 
   for(step = 0; step < STEPS; step++)
   {
-    Gal[p].SfrBulge[step] += Gal[p].SfrDisk[step];
-    Gal[p].SfrBulgeColdGas[step] += Gal[p].SfrDiskColdGas[step];
-    Gal[p].SfrBulgeColdGasMetals[step] += Gal[p].SfrDiskColdGasMetals[step];
-    Gal[p].SfrDisk[step] = 0.0;
-    Gal[p].SfrDiskColdGas[step] = 0.0;
-    Gal[p].SfrDiskColdGasMetals[step] = 0.0;
+    History[p].SfrBulge[step] += History[p].SfrDisk[step];
+    History[p].SfrBulgeColdGas[step] += History[p].SfrDiskColdGas[step];
+    History[p].SfrBulgeColdGasMetals[step] += History[p].SfrDiskColdGasMetals[step];
+    History[p].SfrDisk[step] = 0.0;
+    History[p].SfrDiskColdGas[step] = 0.0;
+    History[p].SfrDiskColdGasMetals[step] = 0.0;
   }
 }
 
 
 
-void collisional_starburst_recipe(double mass_ratio, int merger_centralgal, int centralgal, double time, double dt, int halonr, int mode, int step)
+void collisional_starburst_recipe(double mass_ratio, int merger_centralgal, int centralgal, double time, double dt, int halonr, int mode, int step, struct GALAXY *Gal, struct GALAXY_HISTORY *History)
 {
   double stars, reheated_mass, ejected_mass, fac, metallicity, eburst;
   double FracZleaveDiskVal;
@@ -221,7 +221,7 @@ void collisional_starburst_recipe(double mass_ratio, int merger_centralgal, int
     stars = 0.0;
 
   // this bursting results in SN feedback on the cold/hot gas 
-  if(SupernovaRecipeOn == 1)
+  if(SUPERNOVA_RECIPE == 1)
     reheated_mass = FeedbackReheatingEpsilon * stars;
   else
     reheated_mass = 0.0;
@@ -237,7 +237,7 @@ void collisional_starburst_recipe(double mass_ratio, int merger_centralgal, int
   }
 
   // determine ejection
-  if(SupernovaRecipeOn == 1)
+  if(SUPERNOVA_RECIPE == 1)
   {
     if(Gal[centralgal].Vvir > 0.0)
 			ejected_mass = 
@@ -253,12 +253,12 @@ void collisional_starburst_recipe(double mass_ratio, int merger_centralgal, int
     ejected_mass = 0.0;
 
   // starbursts add to the bulge
-  Gal[merger_centralgal].SfrBulge[step] += stars / dt;
-  Gal[merger_centralgal].SfrBulgeColdGas[step] += Gal[merger_centralgal].ColdGas;
-  Gal[merger_centralgal].SfrBulgeColdGasMetals[step] += Gal[merger_centralgal].MetalsColdGas;
+  History[merger_centralgal].SfrBulge[step] += stars / dt;
+  History[merger_centralgal].SfrBulgeColdGas[step] += Gal[merger_centralgal].ColdGas;
+  History[merger_centralgal].SfrBulgeColdGasMetals[step] += Gal[merger_centralgal].MetalsColdGas;
 
   metallicity = get_metallicity(Gal[merger_centralgal].ColdGas, Gal[merger_centralgal].MetalsColdGas);
-  update_from_star_formation(merger_centralgal, stars, metallicity);
+  update_from_star_formation(merger_centralgal, stars, metallicity, Gal);
 
   Gal[merger_centralgal].BulgeMass += (1 - RecycleFraction) * stars;
   Gal[merger_centralgal].MetalsBulgeMass += metallicity * (1 - RecycleFraction) * stars;
@@ -267,12 +267,12 @@ void collisional_starburst_recipe(double mass_ratio, int merger_centralgal, int
   metallicity = get_metallicity(Gal[merger_centralgal].ColdGas, Gal[merger_centralgal].MetalsColdGas);
 
   // update from feedback 
-  update_from_feedback(merger_centralgal, centralgal, reheated_mass, ejected_mass, metallicity);
+  update_from_feedback(merger_centralgal, centralgal, reheated_mass, ejected_mass, metallicity, Gal);
 
   // check for disk instability
-  if(DiskInstabilityOn && mode == 0)
+  if(DISK_INSTABILITY && mode == 0)
     if(mass_ratio < ThreshMajorMerger)
-    check_disk_instability(merger_centralgal, centralgal, halonr, time, dt, step);
+    check_disk_instability(merger_centralgal, centralgal, halonr, time, dt, step, Gal, History);
 
   // formation of new metals - instantaneous recycling approximation - only SNII 
   if(Gal[merger_centralgal].ColdGas > 1e-8 && mass_ratio < ThreshMajorMerger)
@@ -289,7 +289,7 @@ void collisional_starburst_recipe(double mass_ratio, int merger_centralgal, int
 
 
 
-void disrupt_satellite_to_ICS(int centralgal, int gal)
+void disrupt_satellite_to_ICS(int centralgal, int gal, struct GALAXY *Gal)
 {  
   Gal[centralgal].HotGas += Gal[gal].ColdGas + Gal[gal].HotGas;
   Gal[centralgal].MetalsHotGas += Gal[gal].MetalsColdGas + Gal[gal].MetalsHotGas;
@@ -3,7 +3,6 @@
 #include <string.h>
 #include <math.h>
 #include <time.h>
-#include <gsl/gsl_rng.h>
 #include <assert.h>
 
 #include "core_allvars.h"
@@ -11,19 +10,22 @@
 
 
 
-void init_galaxy(int p, int halonr)
+void init_galaxy(int p, int halonr, struct tree_context *ctx)
 {
   int j, step;
+  struct GALAXY *Gal = ctx->Gal;
+  struct GALAXY_HISTORY *History = ctx->GalHistory;
+  struct halo_data *Halo = ctx->Halo;
 
 	assert(halonr == Halo[halonr].FirstHaloInFOFgroup);
 
   Gal[p].Type = 0;
 
-  Gal[p].GalaxyNr = GalaxyCounter;
-  GalaxyCounter++;
+  Gal[p].GalaxyNr = -1;   // numbered when it is stored, see attach_galaxies
   
   Gal[p].HaloNr = halonr;
-  Gal[p].MostBoundID = Halo[halonr].MostBoundID;
+  Gal[p].BirthHalo = halonr;
+  History[p].MostBoundID = Halo[halonr].MostBoundID;
   Gal[p].SnapNum = Halo[halonr].SnapNum - 1;
 
   Gal[p].mergeType = 0;
@@ -39,9 +41,9 @@ void init_galaxy(int p, int halonr)
 
   Gal[p].Len = Halo[halonr].Len;
   Gal[p].Vmax = Halo[halonr].Vmax;
-  Gal[p].Vvir = get_virial_velocity(halonr);
-  Gal[p].Mvir = get_virial_mass(halonr);
-  Gal[p].Rvir = get_virial_radius(halonr);
+  Gal[p].Vvir = get_virial_velocity(halonr, Halo);
+  Gal[p].Mvir = get_virial_mass(halonr, Halo);
+  Gal[p].Rvir = get_virial_radius(halonr, Halo);
 
   Gal[p].deltaMvir = 0.0;
 
@@ -62,15 +64,15 @@ void init_galaxy(int p, int halonr)
   
   for(step = 0; step < STEPS; step++)
   {
-    Gal[p].SfrDisk[step] = 0.0;
-    Gal[p].SfrBulge[step] = 0.0;
-    Gal[p].SfrDiskColdGas[step] = 0.0;
-    Gal[p].SfrDiskColdGasMetals[step] = 0.0;
-    Gal[p].SfrBulgeColdGas[step] = 0.0;
-    Gal[p].SfrBulgeColdGasMetals[step] = 0.0;
+    History[p].SfrDisk[step] = 0.0;
+    History[p].SfrBulge[step] = 0.0;
+    History[p].SfrDiskColdGas[step] = 0.0;
+    History[p].SfrDiskColdGasMetals[step] = 0.0;
+    History[p].SfrBulgeColdGas[step] = 0.0;
+    History[p].SfrBulgeColdGasMetals[step] = 0.0;
   }
 
-  Gal[p].DiskScaleRadius = get_disk_radius(halonr, p);
+  Gal[p].DiskScaleRadius = get_disk_radius(halonr, p, Gal, Halo);
   Gal[p].MergTime = 999.9;
   Gal[p].Cooling = 0.0;
   Gal[p].Heating = 0.0;
@@ -90,7 +92,7 @@ void init_galaxy(int p, int halonr)
 
 
 
-double get_disk_radius(int halonr, int p)
+double get_disk_radius(int halonr, int p, struct GALAXY *Gal, struct halo_data *Halo)
 {
   double SpinMagnitude, SpinParameter;
   
@@ -139,7 +141,7 @@ double dmax(double x, double y)
 
 
 
-double get_virial_mass(int halonr)
+double get_virial_mass(int halonr, struct halo_data *Halo)
 {
   if(halonr == Halo[halonr].FirstHaloInFOFgroup && Halo[halonr].Mvir >= 0.0)
     return Halo[halonr].Mvir;   /* take spherical overdensity mass estimate */ 
@@ -149,35 +151,29 @@ double get_virial_mass(int halonr)
 
 
 
-double get_virial_velocity(int halonr)
+double get_virial_velocity(int halonr, struct halo_data *Halo)
 {
 	double Rvir;
 	
-	Rvir = get_virial_radius(halonr);
+	Rvir = get_virial_radius(halonr, Halo);
 	
   if(Rvir > 0.0)
-		return sqrt(G * get_virial_mass(halonr) / Rvir);
+		return sqrt(G * get_virial_mass(halonr, Halo) / Rvir);
 	else
 		return 0.0;
 }
 
 
 
-double get_virial_radius(int halonr)
+double get_virial_radius(int halonr, struct halo_data *Halo)
 {
   // return Halo[halonr].Rvir;  // Used for Bolshoi
 
-  double zplus1, hubble_of_z_sq, rhocrit, fac;
+  double fac;
   
-  zplus1 = 1 + ZZ[Halo[halonr].SnapNum];
-  hubble_of_z_sq =
-    Hubble * Hubble *(Omega * zplus1 * zplus1 * zplus1 + (1 - Omega - OmegaLambda) * zplus1 * zplus1 +
-    OmegaLambda);
+  fac = 1 / (200 * 4 * M_PI / 3.0 * RhoCritOfZ[Halo[halonr].SnapNum]);
   
-  rhocrit = 3 * hubble_of_z_sq / (8 * M_PI * G);
-  fac = 1 / (200 * 4 * M_PI / 3.0 * rhocrit);
-  
-  return cbrt(get_virial_mass(halonr) * fac);
+  return cbrt(get_virial_mass(halonr, Halo) * fac);
 }
 
 
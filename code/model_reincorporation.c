@@ -9,7 +9,7 @@
 
 
 
-void reincorporate_gas(int centralgal, double dt)
+void reincorporate_gas(int centralgal, double dt, struct GALAXY *Gal)
 {
   double reincorporated, metallicity;
   
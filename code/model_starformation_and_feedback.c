@@ -10,7 +10,7 @@
 
 
 
-void starformation_and_feedback(int p, int centralgal, double time, double dt, int halonr, int step)
+void starformation_and_feedback(int p, int centralgal, double time, double dt, int halonr, int step, struct GALAXY *Gal, struct GALAXY_HISTORY *History)
 {
   double reff, tdyn, strdot, stars, reheated_mass, ejected_mass, fac, metallicity;
   double cold_crit;
@@ -20,7 +20,7 @@ void starformation_and_feedback(int p, int centralgal, double time, double dt, i
   strdot = 0.0;
 
   // star formation recipes 
-  if(SFprescription == 0)
+  if(SF_PRESCRIPTION == 0)
   {
     // we take the typical star forming region as 3.0*r_s using the Milky Way as a guide
     reff = 3.0 * Gal[p].DiskScaleRadius;
@@ -43,7 +43,7 @@ void starformation_and_feedback(int p, int centralgal, double time, double dt, i
   if(stars < 0.0)
     stars = 0.0;
 
-  if(SupernovaRecipeOn == 1)
+  if(SUPERNOVA_RECIPE == 1)
     reheated_mass = FeedbackReheatingEpsilon * stars;
   else
     reheated_mass = 0.0;
@@ -59,7 +59,7 @@ void starformation_and_feedback(int p, int centralgal, double time, double dt, i
   }
 
   // determine ejection
-  if(SupernovaRecipeOn == 1)
+  if(SUPERNOVA_RECIPE == 1)
   {
     if(Gal[centralgal].Vvir > 0.0)
 			ejected_mass = 
@@ -75,23 +75,23 @@ void starformation_and_feedback(int p, int centralgal, double time, double dt, i
     ejected_mass = 0.0;
 
   // update the star formation rate 
-  Gal[p].SfrDisk[step] += stars / dt;
-  Gal[p].SfrDiskColdGas[step] = Gal[p].ColdGas;
-  Gal[p].SfrDiskColdGasMetals[step] = Gal[p].MetalsColdGas;
+  History[p].SfrDisk[step] += stars / dt;
+  History[p].SfrDiskColdGas[step] = Gal[p].ColdGas;
+  History[p].SfrDiskColdGasMetals[step] = Gal[p].MetalsColdGas;
 
   // update for star formation 
   metallicity = get_metallicity(Gal[p].ColdGas, Gal[p].MetalsColdGas);
-  update_from_star_formation(p, stars, metallicity);
+  update_from_star_formation(p, stars, metallicity, Gal);
 
   // recompute the metallicity of the cold phase
   metallicity = get_metallicity(Gal[p].ColdGas, Gal[p].MetalsColdGas);
 
   // update from SN feedback 
-  update_from_feedback(p, centralgal, reheated_mass, ejected_mass, metallicity);
+  update_from_feedback(p, centralgal, reheated_mass, ejected_mass, metallicity, Gal);
 
   // check for disk instability
-  if(DiskInstabilityOn)
-    check_disk_instability(p, centralgal, halonr, time, dt, step);
+  if(DISK_INSTABILITY)
+    check_disk_instability(p, centralgal, halonr, time, dt, step, Gal, History);
 
   // formation of new metals - instantaneous recycling approximation - only SNII 
   if(Gal[p].ColdGas > 1.0e-8)
@@ -108,7 +108,7 @@ void starformation_and_feedback(int p, int centralgal, double time, double dt, i
 
 
 
-void update_from_star_formation(int p, double stars, double metallicity)
+void update_from_star_formation(int p, double stars, double metallicity, struct GALAXY *Gal)
 {
   // update gas and metals from star formation 
   Gal[p].ColdGas -= (1 - RecycleFraction) * stars;
@@ -119,13 +119,13 @@ void update_from_star_formation(int p, double stars, double metallicity)
 
 
 
-void update_from_feedback(int p, int centralgal, double reheated_mass, double ejected_mass, double metallicity)
+void update_from_feedback(int p, int centralgal, double reheated_mass, double ejected_mass, double metallicity, struct GALAXY *Gal)
 {
   double metallicityHot;
 
 	assert(!(reheated_mass > Gal[p].ColdGas && reheated_mass > 0.0));
 
-  if(SupernovaRecipeOn == 1)
+  if(SUPERNOVA_RECIPE == 1)
   {
     Gal[p].ColdGas -= reheated_mass;
     Gal[p].MetalsColdGas -= metallicity * reheated_mass;
@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+"""Stops SAGE with SIGXCPU in the middle of a tree file and checks the restart (`make check-restart`).
+
+The trees of a bench shape are evolved once without interruption. Then the same
+run is sent SIGXCPU after a fraction of that wall time, which must leave a
+restart point, and is started again until it finishes. The galaxy files of the
+resumed run have to be identical to the uninterrupted ones, and no restart
+point may be left over. Build sage with the options to check, e.g.
+make check-restart USE-TIMING=yes USE-OPENMP=yes.
+
+    check_restart.py [--sage ./sage] [--shape mixed] [--files 2] [--at 0.25]
+                     [--every 0] [--tree-order 0]
+"""
+
+import argparse
+import filecmp
+import glob
+import os
+import signal
+import subprocess
+import sys
+import time
+
+from run_bench import HERE, REPO, SHAPES, generate, write_par
+
+
+def run(sage, parfile, outdir, log, stop_after=None):
+    """Runs sage, with SIGXCPU after stop_after seconds; returns the wall time and the log."""
+    start = time.time()
+    with open(log, 'w') as out:
+        proc = subprocess.Popen([sage, parfile], stdout=out, stderr=subprocess.STDOUT)
+        try:
+            proc.wait(timeout=stop_after)
+        except subprocess.TimeoutExpired:
+            proc.send_signal(signal.SIGXCPU)
+            proc.wait()
+    return time.time() - start, open(log).read()
+
+
+def galaxy_files(outdir):
+    return sorted(os.path.basename(f) for f in glob.glob(os.path.join(outdir, 'model_z*')))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--sage', default=os.path.join(REPO, 'sage'))
+    parser.add_argument('--gen', default=os.path.join(HERE, 'gen_trees'))
+    parser.add_argument('--par', default=os.path.join(REPO, 'input', 'millennium.par'), help='physics template')
+    parser.add_argument('--workdir', default=os.path.join(HERE, 'work'))
+    parser.add_argument('--shape', default='mixed', help='one of ' + ', '.join(SHAPES))
+    parser.add_argument('--files', type=int, default=2, help='tree files')
+    parser.add_argument('--seed', type=int, default=1)
+    parser.add_argument('--at', type=float, default=0.25, help='SIGXCPU after this fraction of the full run')
+    parser.add_argument('--every', type=int, default=0, help='CheckpointEveryTrees')
+    parser.add_argument('--tree-order', type=int, default=0, help='TreeOrder')
+    args = parser.parse_args()
+
+    for exe in (args.sage, args.gen):
+        if not os.access(exe, os.X_OK):
+            sys.exit('%s not found, run `make check-restart` or build it first' % exe)
+    if args.shape not in SHAPES:
+        sys.exit("unknown shape '%s', choose from %s" % (args.shape, ', '.join(SHAPES)))
+
+    sage = os.path.abspath(args.sage)
+    prefix, nsnap = generate(os.path.abspath(args.gen), args.shape, args.workdir, args.files, args.seed)
+    extra = {'CheckpointEveryTrees': str(args.every), 'TreeOrder': str(args.tree_order)}
+
+    outdirs = {}
+    for name in ('full', 'restart'):
+        outdir = os.path.join(args.workdir, 'restart', name)
+        os.makedirs(outdir, exist_ok=True)
+        for fname in glob.glob(os.path.join(outdir, 'model_*')):
+            os.remove(fname)
+        write_par(args.par, os.path.join(outdir, 'restart.par'), prefix, nsnap, args.files, outdir, extra)
+        outdirs[name] = outdir
+
+    full = outdirs['full']
+    seconds, log = run(sage, os.path.join(full, 'restart.par'), full, os.path.join(full, 'sage.log'))
+    if 'done file %d' % (args.files - 1) not in log:
+        sys.exit('the full run failed, see %s' % os.path.join(full, 'sage.log'))
+
+    resumed = outdirs['restart']
+    parfile = os.path.join(resumed, 'restart.par')
+    _, log = run(sage, parfile, resumed, os.path.join(resumed, 'sage_stop.log'), args.at * seconds)
+    if 'Error in file' in log:
+        sys.exit('sage failed while stopping, see %s' % os.path.join(resumed, 'sage_stop.log'))
+    if '-- stopped' not in log:
+        sys.exit('sage was not stopped in the middle of a file, see %s (try another --at)' %
+                 os.path.join(resumed, 'sage_stop.log'))
+    if not glob.glob(os.path.join(resumed, 'model_checkpoint_*')):
+        sys.exit('no restart point was left, see %s' % os.path.join(resumed, 'sage_stop.log'))
+    print(log[log.index('-- stopped'):].splitlines()[0])
+
+    _, log = run(sage, parfile, resumed, os.path.join(resumed, 'sage.log'))
+    if 'done file %d' % (args.files - 1) not in log:
+        sys.exit('the restarted run failed, see %s' % os.path.join(resumed, 'sage.log'))
+    if glob.glob(os.path.join(resumed, 'model_checkpoint_*')):
+        sys.exit('a restart point was left after the run finished')
+
+    names = galaxy_files(full)
+    if names != galaxy_files(resumed):
+        sys.exit('the restarted run wrote other galaxy files than the full run')
+    _, mismatch, errors = filecmp.cmpfiles(full, resumed, names, shallow=False)
+    if mismatch or errors:
+        sys.exit('galaxy files differ from the full run: %s' % ', '.join(mismatch + errors))
+
+    print('restart ok: %d galaxy files identical to the uninterrupted run' % len(names))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,275 @@
+/*
+ * Synthetic LHalo merger trees for benchmarking SAGE (used by `make bench`).
+ *
+ * Writes <prefix>.0 ... <prefix>.<nfiles-1> in the lhalo_binary format and a
+ * matching <prefix>.a_list of scale factors. Every tree grows backwards from a
+ * final FoF group: each halo gets a main progenitor with 80-98% of its mass (for
+ * 64 snapshots, proportionally more or less for other numbers) and,
+ * with probability -merge (repeatedly), secondary progenitors whose galaxies end
+ * up as orphans and mergers. Subhalos fall in from their own FoF groups with
+ * probability -infall. The same seed always gives the same trees.
+ *
+ *   gen_trees -o prefix [-files 1] [-trees 1000] [-snaps 64] [-sats 40]
+ *             [-merge 0.3] [-infall 0.1] [-mmax 3e4] [-seed 1]
+ *
+ * Masses are in 10^10 Msun/h with the mini-Millennium particle mass.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../../code/core_simulation.h"
+
+#define PARTMASS 0.0860657
+#define MINMASS  (20 * PARTMASS)   /* smallest halo that is kept */
+#define BOXSIZE  62.5
+#define MAXMERGE 3                 /* most secondary progenitors per halo and snapshot */
+
+static struct halo_data *Halo = NULL;
+static double *Mass = NULL;
+static int *LastInGroup = NULL;   /* for centrals, the last halo of their FoF group */
+static int NHalos = 0, MaxHalos = 0;
+static long long NextID = 0;
+static unsigned long long RandomState = 1;
+
+
+
+static double urand(void)
+{
+  /* xorshift64, reproducible on every platform */
+  RandomState ^= RandomState << 13;
+  RandomState ^= RandomState >> 7;
+  RandomState ^= RandomState << 17;
+  return (RandomState >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+
+/* splitmix64, spreads nearby seeds over the whole state space of urand */
+static void seed_random(unsigned long long seed)
+{
+  unsigned long long z = seed + 0x9E3779B97F4A7C15ULL;
+
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  RandomState = (z ^ (z >> 31)) | 1;
+}
+
+
+
+/* adds a halo of mass m to the FoF group of central (a new group if central < 0) */
+static int new_halo(double m, int snap, int central)
+{
+  int i, j;
+
+  if(NHalos == MaxHalos)
+  {
+    MaxHalos = MaxHalos ? 2 * MaxHalos : 1024;
+    Halo = realloc(Halo, MaxHalos * sizeof(struct halo_data));
+    Mass = realloc(Mass, MaxHalos * sizeof(double));
+    LastInGroup = realloc(LastInGroup, MaxHalos * sizeof(int));
+    if(Halo == NULL || Mass == NULL || LastInGroup == NULL)
+    {
+      fprintf(stderr, "out of memory after %d halos\n", NHalos);
+      exit(1);
+    }
+  }
+
+  i = NHalos++;
+  memset(&Halo[i], 0, sizeof(struct halo_data));
+  Halo[i].Descendant = Halo[i].FirstProgenitor = Halo[i].NextProgenitor = -1;
+  Halo[i].NextHaloInFOFgroup = -1;
+  Halo[i].FirstHaloInFOFgroup = central < 0 ? i : central;
+  LastInGroup[i] = i;
+  if(central >= 0)
+  {
+    Halo[LastInGroup[central]].NextHaloInFOFgroup = i;
+    LastInGroup[central] = i;
+  }
+
+  Mass[i] = m;
+  Halo[i].Len = (int) (m / PARTMASS) + 1;
+  Halo[i].Mvir = central < 0 ? m : 0.0;   // like the Millennium trees, subhalos have no Mvir
+  Halo[i].M_Mean200 = Halo[i].M_TopHat = m;
+  for(j = 0; j < 3; j++)
+  {
+    Halo[i].Pos[j] = BOXSIZE * urand();
+    Halo[i].Vel[j] = 300.0 * (urand() - 0.5);
+    Halo[i].Spin[j] = 0.05 * (urand() - 0.5) * pow(m, 0.66);
+  }
+  Halo[i].Vmax = 100.0 * pow(m / 10.0, 1.0 / 3.0);
+  Halo[i].VelDisp = 0.7 * Halo[i].Vmax;
+  Halo[i].MostBoundID = NextID++;
+  Halo[i].SnapNum = snap;
+
+  return i;
+}
+
+
+
+static void make_tree(int nsnap, int nsats, double pmerge, double pinfall, double mmax)
+{
+  int *cur, *next, ncur, nnext, maxnext;
+  int i, k, n, snap, central, newcentral, prog, last;
+  double m0;
+
+  NHalos = 0;
+
+  // final group: between 50 MINMASS and mmax, skewed towards small trees
+  m0 = 50 * MINMASS * pow(mmax / (50 * MINMASS), urand() * urand());
+  central = new_halo(m0, nsnap - 1, -1);
+  n = (int) (nsats * urand() * (m0 / mmax) * 4) + (urand() < 0.5);
+  for(i = 0; i < n; i++)
+    new_halo(MINMASS * (1 + 30 * urand()), nsnap - 1, central);
+
+  cur = malloc(sizeof(int) * NHalos);
+  for(ncur = 0; ncur < NHalos; ncur++)
+    cur[ncur] = ncur;
+
+  for(snap = nsnap - 1; snap > 0 && ncur > 0; snap--)
+  {
+    maxnext = (MAXMERGE + 1) * ncur;
+    next = malloc(sizeof(int) * maxnext);
+    nnext = 0;
+
+    for(n = 0; n < ncur; n++)
+    {
+      if(Halo[cur[n]].FirstHaloInFOFgroup != cur[n])
+        continue;   // groups are handled from their central
+
+      newcentral = -1;
+      for(k = cur[n]; k >= 0; k = Halo[k].NextHaloInFOFgroup)
+      {
+        // the same growth history per unit of time, whatever the number of snapshots
+        double mprog = Mass[k] * (1.0 - (0.02 + 0.18 * urand()) * 64.0 / nsnap);
+
+        if(mprog < MINMASS)
+          continue;   // the subhalo is lost, its galaxy becomes an orphan
+
+        if(k == cur[n])
+          prog = newcentral = new_halo(mprog, snap - 1, -1);
+        else if(newcentral < 0 || urand() < pinfall)
+          prog = new_halo(mprog, snap - 1, -1);   // falls in from a group of its own
+        else
+          prog = new_halo(mprog, snap - 1, newcentral);
+
+        Halo[k].FirstProgenitor = prog;
+        Halo[prog].Descendant = k;
+        next[nnext++] = prog;
+
+        // secondary progenitors merge into k at this snapshot
+        for(last = prog, i = 0; i < MAXMERGE && urand() < pmerge; i++)
+        {
+          double msec = Mass[k] * (0.02 + 0.25 * urand());
+          int sec;
+
+          if(msec < MINMASS)
+            break;
+          sec = new_halo(msec, snap - 1, Halo[prog].FirstHaloInFOFgroup);
+          Halo[last].NextProgenitor = sec;
+          Halo[sec].Descendant = k;
+          next[nnext++] = sec;
+          last = sec;
+        }
+      }
+    }
+
+    free(cur);
+    cur = next;
+    ncur = nnext;
+  }
+
+  free(cur);
+}
+
+
+
+int main(int argc, char **argv)
+{
+  char *prefix = NULL, fname[1024];
+  int nfiles = 1, ntrees = 1000, nsnap = 64, nsats = 40;
+  double pmerge = 0.3, pinfall = 0.1, mmax = 3.0e4;
+  unsigned long long seed = 1;
+  int i, filenr, treenr, snap;
+  FILE *fd;
+
+  for(i = 1; i + 1 < argc; i += 2)
+  {
+    if(strcmp(argv[i], "-o") == 0) prefix = argv[i + 1];
+    else if(strcmp(argv[i], "-files") == 0) nfiles = atoi(argv[i + 1]);
+    else if(strcmp(argv[i], "-trees") == 0) ntrees = atoi(argv[i + 1]);
+    else if(strcmp(argv[i], "-snaps") == 0) nsnap = atoi(argv[i + 1]);
+    else if(strcmp(argv[i], "-sats") == 0) nsats = atoi(argv[i + 1]);
+    else if(strcmp(argv[i], "-merge") == 0) pmerge = atof(argv[i + 1]);
+    else if(strcmp(argv[i], "-infall") == 0) pinfall = atof(argv[i + 1]);
+    else if(strcmp(argv[i], "-mmax") == 0) mmax = atof(argv[i + 1]);
+    else if(strcmp(argv[i], "-seed") == 0) seed = strtoull(argv[i + 1], NULL, 10);
+    else break;
+  }
+  if(prefix == NULL || i != argc || nfiles < 1 || ntrees < 1 || nsnap < 2 || pmerge >= 1.0)
+  {
+    fprintf(stderr, "usage: %s -o prefix [-files 1] [-trees 1000] [-snaps 64] [-sats 40]\n"
+                    "          [-merge 0.3] [-infall 0.1] [-mmax 3e4] [-seed 1]\n", argv[0]);
+    return 1;
+  }
+
+  for(filenr = 0; filenr < nfiles; filenr++)
+  {
+    int *treenhalos = malloc(sizeof(int) * ntrees), tothalos = 0;
+    struct halo_data **trees = malloc(sizeof(struct halo_data *) * ntrees);
+
+    for(treenr = 0; treenr < ntrees; treenr++)
+    {
+      // every tree has its own stream, so changing -trees does not change the first trees
+      seed_random((seed * 1000003ULL + filenr) * 1000003ULL + treenr);
+      NextID = (long long) filenr * 1000000000LL + treenr * 1000000LL;
+
+      make_tree(nsnap, nsats, pmerge, pinfall, mmax);
+
+      trees[treenr] = malloc(sizeof(struct halo_data) * NHalos);
+      memcpy(trees[treenr], Halo, sizeof(struct halo_data) * NHalos);
+      for(i = 0; i < NHalos; i++)
+      {
+        trees[treenr][i].FileNr = filenr;
+        trees[treenr][i].SubhaloIndex = i;
+      }
+      treenhalos[treenr] = NHalos;
+      tothalos += NHalos;
+    }
+
+    snprintf(fname, sizeof(fname), "%s.%d", prefix, filenr);
+    if(!(fd = fopen(fname, "w")))
+    {
+      fprintf(stderr, "can't open file `%s'\n", fname);
+      return 1;
+    }
+    fwrite(&ntrees, sizeof(int), 1, fd);
+    fwrite(&tothalos, sizeof(int), 1, fd);
+    fwrite(treenhalos, sizeof(int), ntrees, fd);
+    for(treenr = 0; treenr < ntrees; treenr++)
+    {
+      fwrite(trees[treenr], sizeof(struct halo_data), treenhalos[treenr], fd);
+      free(trees[treenr]);
+    }
+    fclose(fd);
+
+    printf("%s: %d trees, %d halos\n", fname, ntrees, tothalos);
+    free(treenhalos);
+    free(trees);
+  }
+
+  // scale factors from z = 20 to z = 0, evenly spaced in log(1+z)
+  snprintf(fname, sizeof(fname), "%s.a_list", prefix);
+  if(!(fd = fopen(fname, "w")))
+  {
+    fprintf(stderr, "can't open file `%s'\n", fname);
+    return 1;
+  }
+  for(snap = 0; snap < nsnap; snap++)
+    fprintf(fd, "%.6f\n", 1.0 / pow(21.0, 1.0 - (double) snap / (nsnap - 1)));
+  fclose(fd);
+
+  return 0;
+}
@@ -0,0 +1,184 @@
+#!/usr/bin/env python3
+"""Runs SAGE on synthetic merger trees and reports its throughput (`make bench`).
+
+Every shape below is generated by gen_trees with a fixed seed, so the same
+build always does the same work. For each shape sage is run once on the
+physics of input/millennium.par and the script reports
+
+    trees/s, halos/s    trees and halos of the input over the wall time
+    galaxies/s          galaxies written to the output snapshots over the wall time
+    peak MB             maximum resident size of the sage process
+
+    run_bench.py [--sage ./sage] [--workdir extra/bench/work] [--shapes mixed,deep]
+                 [--repeat 1] [--json results.json] [--mpirun "mpirun -np 4"]
+"""
+
+import argparse
+import glob
+import json
+import os
+import shlex
+import struct
+import subprocess
+import sys
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+REPO = os.path.dirname(os.path.dirname(HERE))
+
+# name: (gen_trees options, what the shape stresses)
+SHAPES = {
+    'mixed':   ('-trees 1000 -snaps 64 -sats 40 -merge 0.3 -infall 0.1 -mmax 3e4',
+                'Millennium-like mix of tree sizes'),
+    'deep':    ('-trees 30 -snaps 256 -sats 10 -merge 0.2 -infall 0.1 -mmax 3e4',
+                'long main branches, many substeps per galaxy'),
+    'bigfof':  ('-trees 20 -snaps 64 -sats 2000 -merge 0.3 -infall 0.3 -mmax 3e5',
+                'few trees with very large FoF groups'),
+    'orphans': ('-trees 50 -snaps 64 -sats 40 -merge 0.7 -infall 0.05 -mmax 3e4',
+                'many secondary progenitors, so many orphans and mergers'),
+}
+
+NUM_OUTPUTS = 4   # output snapshots, evenly spaced and always including the last one
+
+
+def generate(gen, shape, workdir, nfiles, seed):
+    """Writes the trees of a shape unless they exist already, returns (prefix, nsnap)."""
+    opts = SHAPES[shape][0]
+    tag = '%s_s%d_f%d' % (shape, seed, nfiles)
+    prefix = os.path.join(workdir, 'trees', tag, 'trees')
+    nsnap = int(opts.split('-snaps')[1].split()[0])
+
+    stamp = prefix + '.stamp'
+    cmd = [gen, '-o', prefix, '-files', str(nfiles), '-seed', str(seed)] + opts.split()
+    if (not os.path.exists(stamp) or open(stamp).read() != ' '.join(cmd)
+            or os.path.getmtime(stamp) < os.path.getmtime(gen)):
+        os.makedirs(os.path.dirname(prefix), exist_ok=True)
+        subprocess.check_call(cmd, stdout=subprocess.DEVNULL)
+        with open(stamp, 'w') as f:
+            f.write(' '.join(cmd))
+
+    return prefix, nsnap
+
+
+def write_par(template, parfile, prefix, nsnap, nfiles, outdir, extra=None):
+    """millennium.par with the trees, snapshots and output directory of the benchmark."""
+    last = nsnap - 1
+    outputs = [last - i * last // NUM_OUTPUTS for i in range(NUM_OUTPUTS)]
+    override = {
+        'FileNameGalaxies': 'model',
+        'OutputDir': outdir + '/',
+        'FirstFile': '0',
+        'LastFile': str(nfiles - 1),
+        'NumOutputs': str(NUM_OUTPUTS),
+        'TreeName': os.path.basename(prefix),
+        'TreeType': 'lhalo_binary',
+        'SimulationDir': os.path.dirname(prefix) + '/',
+        'FileWithSnapList': prefix + '.a_list',
+        'LastSnapShotNr': str(last),
+        'PartMass': '0.0860657',
+    }
+    override.update(extra or {})
+
+    lines = []
+    for line in open(template):
+        words = line.split()
+        if words and words[0] == '->':
+            line = '-> ' + ' '.join(str(s) for s in outputs) + '\n'
+        elif words and words[0] in override:
+            line = '%-25s %s\n' % (words[0], override.pop(words[0]))
+        lines.append(line)
+    for key, value in override.items():
+        lines.append('%-25s %s\n' % (key, value))
+
+    with open(parfile, 'w') as f:
+        f.writelines(lines)
+
+
+def count(prefix, outdir, nfiles):
+    """Trees and halos of the input, galaxies in the output."""
+    trees = halos = galaxies = 0
+    for filenr in range(nfiles):
+        with open('%s.%d' % (prefix, filenr), 'rb') as f:
+            ntrees, nhalos = struct.unpack('<ii', f.read(8))
+        trees += ntrees
+        halos += nhalos
+
+    for fname in glob.glob(os.path.join(outdir, 'model_z*_*')):
+        with open(fname, 'rb') as f:
+            galaxies += struct.unpack('<ii', f.read(8))[1]
+
+    return trees, halos, galaxies
+
+
+def run_sage(sage, mpirun, parfile, outdir, log):
+    for fname in glob.glob(os.path.join(outdir, 'model_*')):
+        os.remove(fname)
+
+    # the children's peak RSS is a running maximum, so each run gets its own process
+    probe = ('import resource, subprocess, sys, time\n'
+             't = time.time()\n'
+             'r = subprocess.call(sys.argv[1:], stdout=open(%r, "w"), stderr=subprocess.STDOUT)\n'
+             'print(r, time.time() - t, resource.getrusage(resource.RUSAGE_CHILDREN).ru_maxrss)\n' % log)
+    out = subprocess.check_output([sys.executable, '-c', probe] + mpirun + [sage, parfile])
+    status, seconds, maxrss = out.split()
+    if int(status) != 0:
+        sys.exit('sage failed, see %s' % log)
+
+    # ru_maxrss is in kilobytes on Linux and in bytes on macOS
+    peak_mb = int(maxrss) / (1024.0 * 1024.0 if sys.platform == 'darwin' else 1024.0)
+    return float(seconds), peak_mb
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--sage', default=os.path.join(REPO, 'sage'))
+    parser.add_argument('--gen', default=os.path.join(HERE, 'gen_trees'))
+    parser.add_argument('--par', default=os.path.join(REPO, 'input', 'millennium.par'), help='physics template')
+    parser.add_argument('--workdir', default=os.path.join(HERE, 'work'))
+    parser.add_argument('--shapes', default=','.join(SHAPES), help='comma separated, from ' + ', '.join(SHAPES))
+    parser.add_argument('--files', type=int, default=1, help='tree files per shape')
+    parser.add_argument('--seed', type=int, default=1)
+    parser.add_argument('--repeat', type=int, default=1, help='runs per shape, the fastest is reported')
+    parser.add_argument('--mpirun', default='', help='launcher prefix, e.g. "mpirun -np 4"')
+    parser.add_argument('--json', help='also write the results to this file')
+    args = parser.parse_args()
+
+    for exe in (args.sage, args.gen):
+        if not os.access(exe, os.X_OK):
+            sys.exit('%s not found, run `make bench` or build it first' % exe)
+
+    results = []
+    print('%-8s %8s %10s %10s %10s %10s %12s %10s %8s' %
+          ('shape', 'trees', 'halos', 'galaxies', 'seconds', 'trees/s', 'halos/s', 'gals/s', 'peak MB'))
+
+    for shape in args.shapes.split(','):
+        if shape not in SHAPES:
+            sys.exit("unknown shape '%s', choose from %s" % (shape, ', '.join(SHAPES)))
+
+        prefix, nsnap = generate(os.path.abspath(args.gen), shape, args.workdir, args.files, args.seed)
+        outdir = os.path.join(args.workdir, 'out', shape)
+        os.makedirs(outdir, exist_ok=True)
+        parfile = os.path.join(outdir, 'bench.par')
+        write_par(args.par, parfile, prefix, nsnap, args.files, outdir)
+
+        runs = [run_sage(os.path.abspath(args.sage), shlex.split(args.mpirun), parfile, outdir,
+                         os.path.join(outdir, 'sage.log')) for _ in range(args.repeat)]
+        seconds = min(r[0] for r in runs)
+        peak_mb = max(r[1] for r in runs)
+        trees, halos, galaxies = count(prefix, outdir, args.files)
+
+        print('%-8s %8d %10d %10d %10.3f %10.1f %12.0f %10.0f %8.1f' %
+              (shape, trees, halos, galaxies, seconds, trees / seconds, halos / seconds,
+               galaxies / seconds, peak_mb))
+        results.append({'shape': shape, 'description': SHAPES[shape][1], 'generator': SHAPES[shape][0],
+                        'seed': args.seed, 'files': args.files, 'trees': trees, 'halos': halos,
+                        'galaxies': galaxies, 'seconds': seconds, 'trees_per_second': trees / seconds,
+                        'halos_per_second': halos / seconds, 'galaxies_per_second': galaxies / seconds,
+                        'peak_memory_mb': peak_mb})
+
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump({'sage': args.sage, 'mpirun': args.mpirun, 'results': results}, f, indent=2)
+
+
+if __name__ == '__main__':
+    main()
@@ -60,10 +60,12 @@ def galdtype():
 	return Galdesc
 
 
-def sageoutsingle(fname):
+def sageoutsingle(fname, offset=0):
 	# Read a single SAGE output file, intended only as a subroutine of read_sagesnap
+	# (offset: where it starts, for the blocks of a SharedOutput file)
 	Galdesc = galdtype()
 	fin = open(fname, 'rb')  # Open the file
+	fin.seek(offset)
 	Ntrees = np.fromfile(fin,np.dtype(np.int32),1)  # Read number of trees in file
 	NtotGals = np.fromfile(fin,np.dtype(np.int32),1)[0]  # Read number of gals in file.
 	GalsPerTree = np.fromfile(fin, np.dtype((np.int32, Ntrees)),1) # Read the number of gals in each tree
@@ -88,6 +90,126 @@ def read_sagesnap(fpre, firstfile=0, lastfile=7):
 	return G
 
 
+def sagecolumnsingle(fname, fields=None, offset=0):
+	# Read a single SAGE output file written with OutputFormat sage_columns.
+	# Returns a dict of arrays, one per property; only the properties in fields are read (default: all stored).
+	fin = open(fname, 'rb')
+	fin.seek(offset)
+	Ntrees = np.fromfile(fin,np.dtype(np.int32),1)[0]
+	NtotGals = np.fromfile(fin,np.dtype(np.int32),1)[0]
+	GalsPerTree = np.fromfile(fin, np.dtype(np.int32), Ntrees)
+	Nfields = np.fromfile(fin,np.dtype(np.int32),1)[0]
+	desc = np.fromfile(fin, np.dtype([('name','S32'), ('dtype','S4'), ('count',np.int32)]), Nfields)
+	names = [d['name'].decode().rstrip('\0') for d in desc]
+	dtypes = [np.dtype((d['dtype'].decode().rstrip('\0'), d['count'])) if d['count'] > 1 else np.dtype(d['dtype'].decode().rstrip('\0')) for d in desc]
+	if fields is None: fields = names
+	for f in fields:
+		if f not in names: raise KeyError(f+' is not stored in '+fname)
+	blocks = dict((f, []) for f in fields)
+	Nread = 0
+	while Nread < NtotGals:
+		Nblock = np.fromfile(fin,np.dtype(np.int32),1)[0]
+		for name, dt in zip(names, dtypes):
+			if name in blocks:
+				blocks[name] += [np.fromfile(fin, dt, Nblock)]
+			else:
+				fin.seek(Nblock*dt.itemsize, 1)  # skip the properties that were not asked for
+		Nread += Nblock
+	fin.close()
+	G = {}
+	for name, dt in zip(names, dtypes):
+		if name in blocks:
+			G[name] = np.concatenate(blocks[name]) if len(blocks[name]) > 0 else np.empty(0, dtype=dt)
+	return G, NtotGals
+
+
+def read_sagecolumns(fpre, firstfile=0, lastfile=7, fields=None):
+	# Read full SAGE snapshot written with OutputFormat sage_columns, going through each file and compiling the properties into 1 array each
+	Glist = []
+	for i in range(firstfile,lastfile+1):
+		G1, N1 = sagecolumnsingle(fpre+'_'+str(i), fields)
+		Glist += [G1]
+	G = {}
+	for name in Glist[0].keys():
+		G[name] = np.concatenate([G1[name] for G1 in Glist])
+	return G
+
+
+def historydtype():
+	# A record of a file written with HistoryOutput 1: a galaxy, and the record numbers of its descendant and main progenitor (-1 for none)
+	Galdesc = galdtype()
+	names = list(Galdesc.names) + ['Descendant', 'MainProgenitor']
+	formats = [Galdesc.fields[name][0] for name in Galdesc.names] + [np.int64, np.int64]
+	return np.dtype({'names':names, 'formats':formats}, align=True)
+
+
+def read_sagehistory_index(fname):
+	# Read the index of a history file, e.g. model_history_0: the first record of every tree (plus the end) and GalaxyIndex, FirstRecord, NRecords of every galaxy, ordered by GalaxyIndex
+	fin = open(fname, 'rb')
+	Ntrees, Ngalaxies = np.fromfile(fin, np.dtype(np.int32), 2)
+	Nrecords, TreeTable, GalaxyTable = np.fromfile(fin, np.dtype(np.int64), 3)
+	fin.seek(TreeTable)
+	TreeFirstRecord = np.fromfile(fin, np.dtype(np.int64), Ntrees+1)
+	Galaxies = np.fromfile(fin, np.dtype([('GalaxyIndex',np.int64), ('FirstRecord',np.int64), ('NRecords',np.int32), ('pad',np.int32)]), Ngalaxies)
+	fin.close()
+	return TreeFirstRecord, Galaxies
+
+
+def read_sagehistory(fname, GalaxyIndex=None, tree=None, index=None):
+	# Read the history of one galaxy (all its snapshots, in time order) or all records of one tree from a history file, with a single seek;
+	# pass index=read_sagehistory_index(fname) when reading many
+	if index is None: index = read_sagehistory_index(fname)
+	TreeFirstRecord, Galaxies = index
+	if GalaxyIndex is not None:
+		i = np.searchsorted(Galaxies['GalaxyIndex'], GalaxyIndex)
+		if i == len(Galaxies) or Galaxies['GalaxyIndex'][i] != GalaxyIndex: raise KeyError(str(GalaxyIndex)+' is not in '+fname)
+		first, n = Galaxies['FirstRecord'][i], Galaxies['NRecords'][i]
+	else:
+		first, n = TreeFirstRecord[tree], TreeFirstRecord[tree+1] - TreeFirstRecord[tree]
+	Hdesc = historydtype()
+	fin = open(fname, 'rb')
+	fin.seek(32 + first*Hdesc.itemsize)  # after the header
+	H = np.fromfile(fin, Hdesc, n)
+	fin.close()
+	return H.view(np.recarray)
+
+
+def read_sageshared(fname, columns=False, fields=None):
+	# Read a snapshot written with SharedOutput 1, e.g. model_z0.000: a table of where the block
+	# of each tree file starts, followed by the blocks, which are read in tree file order.
+	# columns=True for OutputFormat sage_columns (the result is then a dict, as for read_sagecolumns)
+	fin = open(fname, 'rb')
+	Nfiles = np.fromfile(fin,np.dtype(np.int32),1)[0]
+	FirstFile = np.fromfile(fin,np.dtype(np.int32),1)[0]
+	offsets = np.fromfile(fin, np.dtype(np.int64), Nfiles)
+	fin.close()
+	for i in np.where(offsets < 0)[0]:
+		print 'tree file', FirstFile+i, 'is not in', fname
+	Glist = []
+	for off in offsets[offsets >= 0]:
+		if columns: G1, N1 = sagecolumnsingle(fname, fields, off)
+		else: G1, N1 = sageoutsingle(fname, off)
+		Glist += [G1]
+	if columns:
+		G = {}
+		for name in Glist[0].keys():
+			G[name] = np.concatenate([G1[name] for G1 in Glist])
+		return G
+	return np.concatenate(Glist).view(np.recarray)
+
+
+def read_sagestats(fname, statistic=None, snap=None, set=0):
+	# Read the statistics of a run with GalaxyStats 1 or a SweepFile, e.g. model_stats.txt: one row per
+	# statistic, set, output snapshot and bin with galaxies in it. Mean = SumY/N, scatter = sqrt(SumY2/N - Mean**2)
+	S = np.genfromtxt(fname, comments='#', dtype=[('Set',np.int32), ('Statistic','S32'), ('SnapNum',np.int32), ('Redshift',np.float64),
+		('XMin',np.float64), ('N',np.int64), ('SumY',np.float64), ('SumY2',np.float64)])
+	S = np.atleast_1d(S)
+	f = (S['Set'] == set)
+	if statistic is not None: f = f & (S['Statistic'] == statistic.encode())
+	if snap is not None: f = f & (S['SnapNum'] == snap)
+	return S[f].view(np.recarray)
+
+
 
 def sphere2dk(R, Lbin, Nbin):
 	# Make a square 2d kernel of a collapsed sphere of radius R with Nbin bins of length Lbin.